@@ -31,6 +31,7 @@
 
 static char dirseps[3] = {'/'};
 static int option_verbose;
+static const char *option_index_dir;
 
 static void make_links(const char *name);
 
@@ -65,6 +66,9 @@ static PARSE_FUNCTION(parse_args)
     OPTION('v', "verbose", NO_ARG)
       option_verbose = 1;
     END_OPTION
+    OPTION('i', "index", REQUIRED_ARG)
+      option_index_dir = optArg;
+    END_OPTION
     DOUBLE_DASH
       NO_MORE_OPTIONS;
     END_OPTION
@@ -76,6 +80,8 @@ static PARSE_FUNCTION(load_files)
   OPTIONS
     OPTION('v', "verbose", NO_ARG)
     END_OPTION
+    OPTION('i', "index", REQUIRED_ARG)
+    END_OPTION
     DOUBLE_DASH
       NO_MORE_OPTIONS;
     END_OPTION
@@ -212,5 +218,13 @@ int main(int argc, char *argv[]) {
 #endif
   load_files(argc, argv);
   lt_dlexit();
+
+  if (option_index_dir != NULL) {
+    transcript_error_t error;
+    if ((error = transcript_write_index(option_index_dir)) != TRANSCRIPT_SUCCESS) {
+      fatal("%s: could not write availability index: %s\n", option_index_dir,
+            transcript_strerror(error));
+    }
+  }
   return EXIT_SUCCESS;
 }
@@ -12,12 +12,15 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "ucm2ltc.h"
-#include <limits.h>
-#include <list>
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+#include <queue>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 struct full_state_t;
 
@@ -40,11 +43,35 @@ struct state_pair_t {
   full_state_t *full_state;
 };
 
+/* A candidate for merging, identified by the indices of both states. Candidates are kept in a
+   priority queue, and are not removed from it when the cost changes. Instead, the versions of
+   the states at the time the cost was calculated are stored, such that outdated candidates can
+   be discarded when they reach the top of the queue. */
 struct merge_cost_t {
-  full_state_t *left, *right;
+  int left, right;
   int cost;
+  /* Position in the list of all pairs, used to break ties between candidates with equal cost. */
+  uint64_t order;
+  int left_version, right_version;
 };
 
+struct merge_cost_greater {
+  bool operator()(const merge_cost_t &a, const merge_cost_t &b) const {
+    return a.cost > b.cost || (a.cost == b.cost && a.order > b.order);
+  }
+};
+
+typedef priority_queue<merge_cost_t, vector<merge_cost_t>, merge_cost_greater> merge_queue_t;
+
+struct cost_job_t {
+  const vector<full_state_t *> *states;
+  Ucm::StateMachineInfo *info;
+  size_t thread_idx, nr_threads;
+  vector<merge_cost_t> costs;
+};
+
+#define MAX_COST_THREADS 64
+
 #if defined(DEBUG) && 0
 static void print_full_state(full_state_t *state) {
   int i;
@@ -202,12 +229,6 @@ static void mark_entry(full_state_t *start, unsigned char *bytes, int length,
   }
 }
 
-static int count_states(full_state_t *ptr) {
-  int states = 0;
-  for (; ptr != NULL; ptr = ptr->next) states++;
-  return states;
-}
-
 static bool can_merge(full_state_t *a, full_state_t *b) {
   int i;
 
@@ -436,79 +457,157 @@ static void merge_states(full_state_t **tail, full_state_t *left, full_state_t *
   free(right);
 }
 
+static uint32_t hash_state(const full_state_t *state) {
+  uint32_t hash = UINT32_C(2166136261);
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    hash = (hash ^ (uint32_t)state->entries[i].action) * UINT32_C(16777619);
+    hash = (hash ^ (uint32_t)(uintptr_t)state->entries[i].next_state) * UINT32_C(16777619);
+  }
+  return hash;
+}
+
 static void merge_duplicate_states(full_state_t *head, full_state_t **tail,
                                    Ucm::StateMachineInfo *info) {
-  full_state_t *ptr;
-  bool change;
+  full_state_t *ptr, *next;
+  bool change, merged;
+  size_t i;
 
+  /* Merging states changes the entries of the states linking to the merged state, which may
+     create new duplicates. The hashes of those states are outdated at that point, so simply
+     repeat until nothing changes anymore. */
   do {
-    change = false;
-    for (; head != NULL; head = head->next) {
-      for (ptr = head->next; ptr != NULL; ptr = ptr->next) {
-        if (memcmp(head->entries, ptr->entries, sizeof(full_entry_t) * 256) != 0) continue;
+    map<uint32_t, vector<full_state_t *> > seen;
 
-        ptr = ptr->prev;
-        merge_states(tail, head, ptr->next, info);
-        change = true;
+    change = false;
+    for (ptr = head; ptr != NULL; ptr = next) {
+      next = ptr->next;
+      vector<full_state_t *> &candidates = seen[hash_state(ptr)];
+
+      merged = false;
+      for (i = 0; i < candidates.size(); i++) {
+        if (memcmp(candidates[i]->entries, ptr->entries, sizeof(full_entry_t) * 256) != 0)
+          continue;
+        merge_states(tail, candidates[i], ptr, info);
+        change = merged = true;
+        break;
       }
+      if (!merged) candidates.push_back(ptr);
     }
   } while (change);
 }
 
+static void *calculate_costs(void *data) {
+  cost_job_t *job = (cost_job_t *)data;
+  const vector<full_state_t *> &states = *job->states;
+  size_t i, j;
+
+  for (i = job->thread_idx; i < states.size(); i += job->nr_threads) {
+    for (j = i + 1; j < states.size(); j++) {
+      if (!can_merge(states[i], states[j])) continue;
+
+      merge_cost_t tmp = {(int)i, (int)j, calculate_merge_cost(states[i], states[j], job->info),
+                          (uint64_t)i * states.size() + j, 0, 0};
+      job->costs.push_back(tmp);
+    }
+  }
+  return NULL;
+}
+
 static void minimize_states(full_state_t *head, full_state_t **tail, Ucm::StateMachineInfo *info) {
-  merge_cost_t previous = {NULL, NULL, 0}, best = {NULL, NULL, INT_MAX};
-  list<merge_cost_t> costs;
-  full_state_t *ptr, *subptr;
+  vector<full_state_t *> states;
+  vector<int> versions;
+  vector<vector<int> > partners;
+  vector<merge_cost_t> costs;
+  cost_job_t jobs[MAX_COST_THREADS];
+  pthread_t threads[MAX_COST_THREADS];
+  bool thread_started[MAX_COST_THREADS];
+  merge_cost_t best;
+  full_state_t *ptr;
+  size_t i, j, kept, nr_threads;
+  long nr_cpus;
   int nr_states;
 
   // Merge duplicate states using a fast algorithm
   merge_duplicate_states(head, tail, info);
-  nr_states = count_states(head);
 
   // Calculate cached costs for all states for which it makes sense
-  for (ptr = head; ptr != NULL; ptr = ptr->next)
-    if (ptr->cost) ptr->cost = calculate_state_cost(ptr, info);
-
-  // Fill cost list
   for (ptr = head; ptr != NULL; ptr = ptr->next) {
-    for (subptr = ptr->next; subptr != NULL; subptr = subptr->next) {
-      if (!can_merge(ptr, subptr)) continue;
-
-      merge_cost_t tmp = {ptr, subptr, calculate_merge_cost(ptr, subptr, info)};
-      costs.push_back(tmp);
+    if (ptr->cost) ptr->cost = calculate_state_cost(ptr, info);
+    states.push_back(ptr);
+  }
+  nr_states = states.size();
+  versions.resize(states.size(), 0);
+  partners.resize(states.size());
+
+  /* Calculating the costs of all pairs is by far the most expensive step, so it is split over
+     multiple threads. Each thread handles an interleaved subset of the rows, and the results
+     are collected in the order of the threads. Because the order of the candidates is recorded
+     in the candidates themselves, the result does not depend on the number of threads. */
+  nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  nr_threads = nr_cpus < 1 ? 1 : nr_cpus > MAX_COST_THREADS ? MAX_COST_THREADS : nr_cpus;
+  for (i = 0; i < nr_threads; i++) {
+    jobs[i].states = &states;
+    jobs[i].info = info;
+    jobs[i].thread_idx = i;
+    jobs[i].nr_threads = nr_threads;
+    thread_started[i] = i > 0 && pthread_create(&threads[i], NULL, calculate_costs, &jobs[i]) == 0;
+  }
+  for (i = 0; i < nr_threads; i++) {
+    if (thread_started[i])
+      pthread_join(threads[i], NULL);
+    else
+      calculate_costs(&jobs[i]);
+    for (j = 0; j < jobs[i].costs.size(); j++) {
+      partners[jobs[i].costs[j].left].push_back(jobs[i].costs[j].right);
+      partners[jobs[i].costs[j].right].push_back(jobs[i].costs[j].left);
     }
+    costs.insert(costs.end(), jobs[i].costs.begin(), jobs[i].costs.end());
+    vector<merge_cost_t>().swap(jobs[i].costs);
   }
 
+  merge_queue_t queue(merge_cost_greater(), costs);
+  vector<merge_cost_t>().swap(costs);
+
   while (1) {
     if (option_verbose) fprintf(stderr, "\rStates remaining: %d   ", nr_states);
 
-    /* Find the best option for merging, simultaneously removing/replacing cost information
-       relating to the previous merge. */
-    for (list<merge_cost_t>::iterator iter = costs.begin(); iter != costs.end();) {
-      if (iter->left == previous.right || iter->right == previous.right) {
-        iter = costs.erase(iter);
-        continue;
-      } else if (iter->left == previous.left || iter->right == previous.left) {
-        iter->cost = calculate_merge_cost(iter->left, iter->right, info);
-      }
-
-      if (iter->cost < best.cost) best = *iter;
-
-      iter++;
-    }
+    // Discard candidates for which the cost is no longer up to date
+    while (!queue.empty() && (queue.top().left_version != versions[queue.top().left] ||
+                              queue.top().right_version != versions[queue.top().right]))
+      queue.pop();
 
-    if (nr_states <= 256 && best.cost > 0) break;
+    if (nr_states <= 256 && (queue.empty() || queue.top().cost > 0)) break;
 
-    if (nr_states > 256 && best.cost == INT_MAX)
+    if (nr_states > 256 && queue.empty())
       fatal("Could not reduce the number of states sufficiently (this is probably a bug).\n");
 
-    merge_states(tail, best.left, best.right, info);
-    previous = best;
-    best.left = NULL;
-    best.right = NULL;
-    best.cost = INT_MAX;
-
-    nr_states = count_states(head);
+    best = queue.top();
+    queue.pop();
+    merge_states(tail, states[best.left], states[best.right], info);
+    states[best.right] = NULL;
+    versions[best.right] = -1;
+    versions[best.left]++;
+    nr_states--;
+
+    /* Only the costs for pairs including the merged state have changed. Pairs including the
+       state that was merged into it are simply discarded. */
+    vector<int> &left_partners = partners[best.left];
+    for (i = 0, kept = 0; i < left_partners.size(); i++) {
+      if (versions[left_partners[i]] < 0) continue;
+      left_partners[kept++] = left_partners[i];
+
+      merge_cost_t tmp;
+      tmp.left = min(best.left, left_partners[i]);
+      tmp.right = max(best.left, left_partners[i]);
+      tmp.cost = calculate_merge_cost(states[tmp.left], states[tmp.right], info);
+      tmp.order = (uint64_t)tmp.left * states.size() + tmp.right;
+      tmp.left_version = versions[tmp.left];
+      tmp.right_version = versions[tmp.right];
+      queue.push(tmp);
+    }
+    left_partners.resize(kept);
   }
   if (option_verbose) fputc('\n', stderr);
 
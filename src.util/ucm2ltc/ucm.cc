@@ -108,6 +108,7 @@ void UcmBase::add_mapping(Mapping *mapping) {
       mapping->to_unicode_flags |= Mapping::TO_UNICODE_PRIVATE_USE;
     mapping->from_unicode_flags |= (mapping->codepage_bytes.size() - 1);
     simple_mappings.push_back(mapping);
+    index_mapping(mapping);
   } else {
     // FIXME: check for private-use or non-character codepoints
     used_to_unicode_flags |= Mapping::TO_UNICODE_MULTI_START;
@@ -120,6 +121,48 @@ void UcmBase::add_mapping(Mapping *mapping) {
   }
 }
 
+void UcmBase::index_mapping(Mapping *mapping) {
+  codepoints_index[mapping->codepoints].push_back(mapping);
+  codepage_bytes_index[mapping->codepage_bytes].push_back(mapping);
+}
+
+template <class T>
+static void remove_from_index(map<T, vector<Mapping *> > &index, const T &key, Mapping *mapping) {
+  typename map<T, vector<Mapping *> >::iterator iter = index.find(key);
+  vector<Mapping *>::iterator mapping_iter;
+
+  if (iter == index.end()) return;
+  mapping_iter = find(iter->second.begin(), iter->second.end(), mapping);
+  if (mapping_iter != iter->second.end()) iter->second.erase(mapping_iter);
+  if (iter->second.empty()) index.erase(iter);
+}
+
+void UcmBase::unindex_mapping(Mapping *mapping) {
+  remove_from_index(codepoints_index, mapping->codepoints, mapping);
+  remove_from_index(codepage_bytes_index, mapping->codepage_bytes, mapping);
+}
+
+template <class T>
+static Mapping *find_in_index(map<T, vector<Mapping *> > &index, const T &key,
+                              int precision_types) {
+  typename map<T, vector<Mapping *> >::const_iterator iter = index.find(key);
+
+  if (iter == index.end()) return NULL;
+  for (vector<Mapping *>::const_iterator mapping_iter = iter->second.begin();
+       mapping_iter != iter->second.end(); mapping_iter++) {
+    if ((1 << (*mapping_iter)->precision) & precision_types) return *mapping_iter;
+  }
+  return NULL;
+}
+
+Mapping *UcmBase::find_simple_mapping(const vector<uint32_t> &codepoints, int precision_types) {
+  return find_in_index(codepoints_index, codepoints, precision_types);
+}
+
+Mapping *UcmBase::find_simple_mapping(const vector<uint8_t> &codepage_bytes, int precision_types) {
+  return find_in_index(codepage_bytes_index, codepage_bytes, precision_types);
+}
+
 Ucm::Ucm(const char *_name)
     : variant(this, option_converter_name == NULL ? _name : option_converter_name),
       name(_name),
@@ -358,48 +401,38 @@ void Ucm::remove_generic_fallbacks(void) {
 }
 
 void Ucm::remove_generic_fallbacks_internal(UcmBase *check, Variant *current_variant) {
-  for (vector<Mapping *>::iterator iter = check->simple_mappings.begin();
-       iter != check->simple_mappings.end();) {
-    vector<Mapping *>::const_iterator search_iter;
-    uint32_t search_for;
-
+  vector<Mapping *> kept;
+  vector<uint32_t> search_for(1);
+  Mapping *found;
+
+  /* Build a new list instead of erasing elements, to keep this linear in the number of
+     mappings. Removed mappings are taken out of the indexes immediately, such that later
+     searches don't find them. */
+  kept.reserve(check->simple_mappings.size());
+  for (vector<Mapping *>::const_iterator iter = check->simple_mappings.begin();
+       iter != check->simple_mappings.end(); iter++) {
     if ((*iter)->precision != 1 || (*iter)->codepoints.size() > 1 ||
-        (search_for = transcript_get_generic_fallback((*iter)->codepoints[0])) == 0xFFFF) {
-      iter++;
+        (search_for[0] = transcript_get_generic_fallback((*iter)->codepoints[0])) == 0xFFFF) {
+      kept.push_back(*iter);
       continue;
     }
 
-    for (search_iter = simple_mappings.begin(); search_iter != simple_mappings.end();
-         search_iter++) {
-      if ((*search_iter)->codepoints[0] == search_for) break;
-    }
+    /* Any precision is accepted here, because only the first mapping of the codepoint is
+       considered. */
+    if ((found = find_simple_mapping(search_for, 0xf)) == NULL && current_variant != NULL)
+      found = current_variant->find_simple_mapping(search_for, 0xf);
 
-    if (search_iter == simple_mappings.end()) {
-      if (current_variant != NULL) {
-        for (search_iter = current_variant->simple_mappings.begin();
-             search_iter != current_variant->simple_mappings.end(); search_iter++) {
-          if ((*search_iter)->codepoints[0] == search_for) break;
-        }
-        if (search_iter == current_variant->simple_mappings.end()) {
-          iter++;
-          continue;
-        }
-      } else {
-        iter++;
-        continue;
-      }
-    }
-
-    if ((*search_iter)->precision != 0 ||
-        (*iter)->codepage_bytes.size() != (*search_iter)->codepage_bytes.size() ||
+    if (found == NULL || found->precision != 0 ||
+        (*iter)->codepage_bytes.size() != found->codepage_bytes.size() ||
         !equal((*iter)->codepage_bytes.begin(), (*iter)->codepage_bytes.end(),
-               (*search_iter)->codepage_bytes.begin())) {
-      iter++;
+               found->codepage_bytes.begin())) {
+      kept.push_back(*iter);
       continue;
     }
 
-    iter = check->simple_mappings.erase(iter);
+    check->unindex_mapping(*iter);
   }
+  check->simple_mappings.swap(kept);
 }
 
 void Ucm::remove_private_use_fallbacks(void) {
@@ -418,14 +451,18 @@ void Ucm::remove_private_use_fallbacks(void) {
 }
 
 void Ucm::remove_private_use_fallbacks_internal(UcmBase *check) {
-  for (vector<Mapping *>::iterator iter = check->simple_mappings.begin();
-       iter != check->simple_mappings.end();) {
+  vector<Mapping *> kept;
+
+  kept.reserve(check->simple_mappings.size());
+  for (vector<Mapping *>::const_iterator iter = check->simple_mappings.begin();
+       iter != check->simple_mappings.end(); iter++) {
     if ((*iter)->precision == 1 && ((*iter)->to_unicode_flags & Mapping::TO_UNICODE_PRIVATE_USE)) {
-      iter = check->simple_mappings.erase(iter);
+      check->unindex_mapping(*iter);
       continue;
     }
-    iter++;
+    kept.push_back(*iter);
   }
+  check->simple_mappings.swap(kept);
 }
 
 void Ucm::ensure_ascii_controls(void) {
@@ -459,13 +496,19 @@ void Ucm::ensure_ascii_controls(void) {
     if ((*iter)->codepage_bytes.size() > 1) continue;
     switch ((*iter)->codepage_bytes[0]) {
       case 0x1a:
+        unindex_mapping(*iter);
         (*iter)->codepage_bytes[0] = 0x1c;
+        index_mapping(*iter);
         break;
       case 0x1c:
+        unindex_mapping(*iter);
         (*iter)->codepage_bytes[0] = 0x7f;
+        index_mapping(*iter);
         break;
       case 0x7f:
+        unindex_mapping(*iter);
         (*iter)->codepage_bytes[0] = 0x1a;
+        index_mapping(*iter);
         break;
       default:;
     }
@@ -699,32 +742,17 @@ void Ucm::ensure_subchar_mapping(void) {
   }
 }
 
-static Mapping *find_mapping_by_codepoint_internal(const vector<Mapping *> &mappings,
-                                                   const vector<uint32_t> &codepoints,
-                                                   int precision_types) {
-  for (vector<Mapping *>::const_iterator iter = mappings.begin(); iter != mappings.end(); iter++) {
-    if (((1 << (*iter)->precision) & precision_types) &&
-        codepoints.size() == (*iter)->codepoints.size() &&
-        equal(codepoints.begin(), codepoints.end(), (*iter)->codepoints.begin()))
-      return *iter;
-  }
-  return NULL;
-}
-
 Mapping *Ucm::find_mapping_by_codepoints(const vector<uint32_t> &codepoints, int where,
                                          int precision_types) {
   Mapping *result;
   if (where & WHERE_MAIN) {
-    if ((result = find_mapping_by_codepoint_internal(simple_mappings, codepoints,
-                                                     precision_types)) != NULL)
-      return result;
+    if ((result = find_simple_mapping(codepoints, precision_types)) != NULL) return result;
   }
 
   if (where & WHERE_VARIANTS) {
     for (deque<Variant *>::const_iterator variant_iter = variants.begin();
          variant_iter != variants.end(); variant_iter++)
-      if ((result = find_mapping_by_codepoint_internal((*variant_iter)->simple_mappings, codepoints,
-                                                       precision_types)) != NULL)
+      if ((result = (*variant_iter)->find_simple_mapping(codepoints, precision_types)) != NULL)
         return result;
   }
   return NULL;
@@ -736,32 +764,18 @@ Mapping *Ucm::find_mapping_by_codepoint(uint32_t codepoint, int where, int preci
   return find_mapping_by_codepoints(codepoints, where, precision_types);
 }
 
-static Mapping *find_mapping_by_codepage_bytes_internal(const vector<Mapping *> &mappings,
-                                                        const vector<uint8_t> &codepage_bytes,
-                                                        int precision_types) {
-  for (vector<Mapping *>::const_iterator iter = mappings.begin(); iter != mappings.end(); iter++) {
-    if (((1 << (*iter)->precision) & precision_types) &&
-        codepage_bytes.size() == (*iter)->codepage_bytes.size() &&
-        equal(codepage_bytes.begin(), codepage_bytes.end(), (*iter)->codepage_bytes.begin()))
-      return *iter;
-  }
-  return NULL;
-}
-
 Mapping *Ucm::find_mapping_by_codepage_bytes(const vector<uint8_t> &codepage_bytes, int where,
                                              int precision_types) {
   Mapping *result;
   if (where & WHERE_MAIN) {
-    if ((result = find_mapping_by_codepage_bytes_internal(simple_mappings, codepage_bytes,
-                                                          precision_types)) != NULL)
-      return result;
+    if ((result = find_simple_mapping(codepage_bytes, precision_types)) != NULL) return result;
   }
 
   if (where & WHERE_VARIANTS) {
     for (deque<Variant *>::const_iterator variant_iter = variants.begin();
          variant_iter != variants.end(); variant_iter++)
-      if ((result = find_mapping_by_codepage_bytes_internal(
-               (*variant_iter)->simple_mappings, codepage_bytes, precision_types)) != NULL)
+      if ((result = (*variant_iter)->find_simple_mapping(codepage_bytes, precision_types)) !=
+          NULL)
         return result;
   }
   return NULL;
@@ -19,7 +19,11 @@
 #include <cstdlib>
 #include <cstring>
 #include <map>
+#include <string>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <transcript/transcript.h>
+#include <unistd.h>
 
 #include "optionMacros.h"
 #include "ucm2ltc.h"
@@ -32,9 +36,18 @@ bool option_abort;
 #endif
 const char *option_output_name;
 const char *option_converter_name;
+const char *option_batch_name;
+int option_jobs = 1;
 extern FILE *yyin;
 
 static vector<Ucm *> completed_ucms;
+/* Input files parsed before starting the jobs in batch mode, indexed by file name, converter
+   name and internal flag. */
+static map<string, Ucm *> parsed_ucms;
+/* Set while reading all the input files for batch mode, without processing them. */
+static bool preparsing;
+/* Set while parsing the arguments of a job from the batch file. */
+static bool batch_job;
 static bool compare_string(const char *a, const char *b);
 
 typedef map<const char *, Variant *, bool (*)(const char *, const char *)> VariantMap;
@@ -95,6 +108,9 @@ static void print_usage(void) {
   printf("  -c,--concatenate              Concatenate the following converters\n");
   printf("       Use this to write multiple unrelated converters to a single file\n");
   printf("  -I,--allow-ibm-rotate         Allow IBM specific rotation of control chars\n");
+  printf("  -B<file>,--batch=<file>       Generate all outputs listed in <file>\n");
+  printf("       Each line in <file> has the form '<output>: <options and ucm files>'\n");
+  printf("  -j<jobs>,--jobs=<jobs>        Generate up to <jobs> outputs in parallel\n");
   exit(EXIT_SUCCESS);
 }
 
@@ -158,6 +174,21 @@ void print_state_machine(const vector<State *> &states) {
         case ACTION_FINAL_LEN4_NOFLAGS | ACTION_FLAG_PAIR:
           printf(".[4]p");
           break;
+        case ACTION_FINAL_LINEAR_NOFLAGS:
+          printf(".l");
+          break;
+        case ACTION_FINAL_LINEAR_LEN1_NOFLAGS:
+          printf(".[1]l");
+          break;
+        case ACTION_FINAL_LINEAR_LEN2_NOFLAGS:
+          printf(".[2]l");
+          break;
+        case ACTION_FINAL_LINEAR_LEN3_NOFLAGS:
+          printf(".[3]l");
+          break;
+        case ACTION_FINAL_LINEAR_LEN4_NOFLAGS:
+          printf(".[4]l");
+          break;
         case ACTION_ILLEGAL:
           printf(".i");
           break;
@@ -227,6 +258,16 @@ static void update_state_attributes(vector<State *> &states, size_t idx) {
         sum += (states[idx]->entries[i].high - states[idx]->entries[i].low + 1) *
                states[idx]->entries[i].mul;
         break;
+      case ACTION_FINAL_LINEAR_NOFLAGS:
+      case ACTION_FINAL_LINEAR_LEN1_NOFLAGS:
+      case ACTION_FINAL_LINEAR_LEN2_NOFLAGS:
+      case ACTION_FINAL_LINEAR_LEN3_NOFLAGS:
+      case ACTION_FINAL_LINEAR_LEN4_NOFLAGS:
+        /* All bytes in a linear range share a single item in the mapping table. */
+        states[idx]->entries[i].mul = 0;
+        states[idx]->entries[i].base = sum;
+        sum++;
+        break;
       default:
         break;
     }
@@ -249,7 +290,8 @@ static uint32_t calculate_state_attributes(vector<State *> &states) {
   return range;
 }
 
-uint32_t map_charseq(vector<State *> &states, uint8_t *charseq, int length, int flags) {
+uint32_t map_charseq(vector<State *> &states, uint8_t *charseq, int length, int flags,
+                     int *linear_delta) {
   uint32_t value;
   int i, state;
   size_t j;
@@ -267,6 +309,7 @@ uint32_t map_charseq(vector<State *> &states, uint8_t *charseq, int length, int
   */
   state = (flags & Ucm::MULTIBYTE_START_STATE_1) && length > 1 ? 1 : 0;
   value = states[state]->base;
+  if (linear_delta != NULL) *linear_delta = 0;
 
   for (i = 0; i < length; i++) {
     for (j = 0; j < states[state]->entries.size(); j++) {
@@ -288,6 +331,13 @@ uint32_t map_charseq(vector<State *> &states, uint8_t *charseq, int length, int
         case ACTION_FINAL_NOFLAGS:
         case ACTION_FINAL:
           return value;
+        case ACTION_FINAL_LINEAR_NOFLAGS:
+        case ACTION_FINAL_LINEAR_LEN1_NOFLAGS:
+        case ACTION_FINAL_LINEAR_LEN2_NOFLAGS:
+        case ACTION_FINAL_LINEAR_LEN3_NOFLAGS:
+        case ACTION_FINAL_LINEAR_LEN4_NOFLAGS:
+          if (linear_delta != NULL) *linear_delta = charseq[i] - states[state]->entries[j].low;
+          return value;
         default:
           printf("action %d\n", states[state]->entries[j].action);
           PANIC();
@@ -380,6 +430,7 @@ static void analyse_ucm_set(vector<Ucm *> &ucms) {
     }
   }
   ucm->calculate_item_costs();
+  ucm->calculate_info_flags();
 
   if (option_dump) {
     ucm->dump();
@@ -394,6 +445,7 @@ static void analyse_ucm_set(vector<Ucm *> &ucms) {
   }
 
   ucm->minimize_state_machines();
+  ucm->find_linear_ranges();
 
   if (option_verbose > 1) {
     printf("Codepage state machine\n");
@@ -417,6 +469,33 @@ static void analyse_ucm_set(vector<Ucm *> &ucms) {
   ucms.clear();
 }
 
+/** Read a ucm file, or take it from the files read in advance in batch mode. */
+static Ucm *read_ucm(char *name) {
+  string key = string(name) + '\n' +
+               (option_converter_name == NULL ? "" : option_converter_name) + '\n' +
+               (option_internal_table ? "i" : "");
+  map<string, Ucm *>::iterator iter = parsed_ucms.find(key);
+  Ucm *ucm;
+
+  file_name = name;
+  if (iter != parsed_ucms.end() && iter->second != NULL) {
+    if (preparsing) return iter->second;
+    /* Processing modifies the Ucm, so it can only be used once. */
+    ucm = iter->second;
+    iter->second = NULL;
+    return ucm;
+  }
+
+  if ((yyin = fopen(name, "r")) == NULL)
+    fatal("Could not open '%s': %s\n", name, strerror(errno));
+  line_number = 1;
+  parse_ucm((void **)&ucm);
+  fclose(yyin);
+
+  if (preparsing) parsed_ucms[key] = ucm;
+  return ucm;
+}
+
 /* clang-format off */
 PARSE_FUNCTION(parse_options)
   vector<Ucm *> ucms;
@@ -457,13 +536,28 @@ PARSE_FUNCTION(parse_options)
         fatal("No input file specified before " OPTFMT "\n", OPTPRARG);
       if (option_output_name == NULL)
         fatal("--output/-o is required with " OPTFMT "\n", OPTPRARG);
-      analyse_ucm_set(ucms);
+      if (preparsing)
+        ucms.clear();
+      else
+        analyse_ucm_set(ucms);
       option_internal_table = false;
       option_converter_name = NULL;
     END_OPTION
     OPTION('I', "allow-ibm-rotate", NO_ARG)
       option_allow_ibm_rotate = true;
     END_OPTION
+    OPTION('B', "batch", REQUIRED_ARG)
+      if (batch_job)
+        fatal(OPTFMT " can not be used in a batch file\n", OPTPRARG);
+      option_batch_name = optArg;
+    END_OPTION
+    OPTION('j', "jobs", REQUIRED_ARG)
+      char *endptr;
+      long jobs = strtol(optArg, &endptr, 10);
+      if (*optArg == 0 || *endptr != 0 || jobs < 1 || jobs > INT_MAX)
+        fatal("Invalid number of jobs for " OPTFMT "\n", OPTPRARG);
+      option_jobs = jobs;
+    END_OPTION
 #ifdef DEBUG
     OPTION('a', "abort", NO_ARG)
       option_abort = true;
@@ -475,12 +569,12 @@ PARSE_FUNCTION(parse_options)
 
     fatal("Unknown option " OPTFMT "\n", OPTPRARG);
   NO_OPTION
-    if ((yyin = fopen(optcurrent, "r")) == NULL)
-      fatal("Could not open '%s': %s\n", optcurrent, strerror(errno));
-    file_name = optcurrent;
-    line_number = 1;
-
-    parse_ucm((void **) &ucm);
+    ucm = read_ucm(optcurrent);
+    if (preparsing) {
+      ucms.push_back(ucm);
+      option_converter_name = NULL;
+      continue;
+    }
     if (ucm->variants.size() == 1)
       fatal("%s: Only a single variant defined\n", ucm->name);
     ucm->check_duplicates();
@@ -491,27 +585,58 @@ PARSE_FUNCTION(parse_options)
     ucm->ensure_subchar_mapping();
 
     ucms.push_back(ucm);
-    fclose(yyin);
     option_converter_name = NULL;
   END_OPTIONS
+  if (option_batch_name != NULL && !batch_job) {
+    if (!ucms.empty() || !completed_ucms.empty())
+      fatal("--batch/-B can not be combined with input files\n");
+    return;
+  }
   if (ucms.empty()) {
     if (completed_ucms.empty())
       print_usage();
     fatal("No input file specified after --concatenate/-c\n");
   }
-  analyse_ucm_set(ucms);
+  if (!preparsing)
+    analyse_ucm_set(ucms);
 END_FUNCTION
 /* clang-format on */
 
-int main(int argc, char *argv[]) {
+static void reset_options(void) {
+  option_internal_table = false;
+  option_allow_ibm_rotate = false;
+  option_output_name = NULL;
+  option_converter_name = NULL;
+}
+
+/** Compare the contents of the (newly written) @a output with the file named @a name. */
+static bool same_contents(FILE *output, const char *name) {
+  char buffer[2][4096];
+  size_t length;
+  bool result = false;
+  FILE *existing;
+
+  if ((existing = fopen(name, "r")) == NULL) return false;
+  rewind(output);
+  while (1) {
+    length = fread(buffer[0], 1, sizeof(buffer[0]), output);
+    if (fread(buffer[1], 1, sizeof(buffer[1]), existing) != length ||
+        memcmp(buffer[0], buffer[1], length) != 0)
+      break;
+    if (length < sizeof(buffer[0])) {
+      result = !ferror(output) && !ferror(existing);
+      break;
+    }
+  }
+  fclose(existing);
+  return result;
+}
+
+static void write_output(void) {
   FILE *output;
   vector<Ucm *>::const_iterator iter;
   char normalized_output_name[160];
-  char *output_name, *base_name;
-
-  transcript_init();
-
-  parse_options(argc, argv);
+  char *output_name, *tmp_name, *base_name, *name_copy;
 
   if (option_output_name != NULL) {
     output_name = safe_strdup(option_output_name);
@@ -527,7 +652,11 @@ int main(int argc, char *argv[]) {
     strcpy(output_name + len - 3, ".c");
   }
 
-  if ((output = fopen(output_name, "w+t")) == NULL)
+  /* Write to a temporary file first, such that a failed run does not leave a partial output
+     file behind. */
+  tmp_name = (char *)safe_malloc(strlen(output_name) + 5);
+  sprintf(tmp_name, "%s.tmp", output_name);
+  if ((output = fopen(tmp_name, "w+t")) == NULL)
     fatal("Could not open output file: %s\n", strerror(errno));
 
   fprintf(output, "/* This file has been automatically generated by ucm2ltc. DO NOT EDIT. */\n");
@@ -540,7 +669,7 @@ int main(int argc, char *argv[]) {
       (*iter)->write_table(output);
   }
 
-  base_name = output_name;
+  base_name = name_copy = safe_strdup(output_name);
   while (strpbrk(base_name, DIRSEPS) != NULL) base_name = strpbrk(base_name, DIRSEPS) + 1;
   // Remove ".c" at the end;
   base_name[strlen(base_name) - 2] = 0;
@@ -555,7 +684,151 @@ int main(int argc, char *argv[]) {
       "TRANSCRIPT_EXPORT const char * const *transcript_namelist_%s(void) { return namelist; }\n",
       normalized_output_name);
 
-  fclose(output);
+  if (fflush(output) != 0 || ferror(output))
+    fatal("Could not write output file: %s\n", strerror(errno));
+
+  /* In batch mode there is no make to decide what needs to be regenerated, so leave outputs
+     which have not changed alone to prevent needless recompilation. */
+  if (option_batch_name != NULL && same_contents(output, output_name)) {
+    fclose(output);
+    remove(tmp_name);
+  } else {
+    fclose(output);
+    if (rename(tmp_name, output_name) != 0)
+      fatal("Could not rename output file: %s\n", strerror(errno));
+  }
+  free(name_copy);
+  free(tmp_name);
   free(output_name);
+}
+
+/** Read the jobs from the batch file.
+    Each line has the form '<output>: <arguments>', and is converted to an argument vector
+    with the output file name passed through -o.
+*/
+static void read_batch_file(vector<vector<string> > &jobs) {
+  string line;
+  size_t colon, start, end;
+  int c, batch_line_number = 0;
+  FILE *batch;
+
+  if (strcmp(option_batch_name, "-") == 0)
+    batch = stdin;
+  else if ((batch = fopen(option_batch_name, "r")) == NULL)
+    fatal("Could not open '%s': %s\n", option_batch_name, strerror(errno));
+
+  do {
+    c = getc(batch);
+    if (c != '\n' && c != EOF) {
+      line += (char)c;
+      continue;
+    }
+    batch_line_number++;
+
+    if ((start = line.find('#')) != string::npos) line.erase(start);
+    if (line.find_first_not_of(" \t\r") == string::npos) {
+      line.clear();
+      continue;
+    }
+    if ((colon = line.find(':')) == string::npos)
+      fatal("%s:%d: Missing output file name\n", option_batch_name, batch_line_number);
+
+    jobs.push_back(vector<string>());
+    jobs.back().push_back("ucm2ltc");
+    jobs.back().push_back("-o");
+    for (start = 0; start <= colon; start = end) {
+      start = line.find_first_not_of(" \t\r", start);
+      end = min(line.find_first_of(" \t\r", start), colon);
+      if (start >= colon) break;
+      if (jobs.back().size() == 3)
+        fatal("%s:%d: Only a single output file may be specified\n", option_batch_name,
+              batch_line_number);
+      jobs.back().push_back(line.substr(start, end - start));
+    }
+    if (jobs.back().size() != 3)
+      fatal("%s:%d: Missing output file name\n", option_batch_name, batch_line_number);
+    for (start = colon + 1; (start = line.find_first_not_of(" \t\r", start)) != string::npos;
+         start = end) {
+      end = line.find_first_of(" \t\r", start);
+      jobs.back().push_back(line.substr(start, end == string::npos ? end : end - start));
+    }
+    if (jobs.back().size() == 3)
+      fatal("%s:%d: No input files specified\n", option_batch_name, batch_line_number);
+    line.clear();
+  } while (c != EOF);
+
+  if (ferror(batch)) fatal("Error reading '%s': %s\n", option_batch_name, strerror(errno));
+  if (batch != stdin) fclose(batch);
+}
+
+/** Create an argument vector for @a job. The strings are never freed, because the parsed
+    Ucm objects refer to them. */
+static vector<char *> make_args(const vector<string> &job) {
+  vector<char *> args;
+
+  for (vector<string>::const_iterator iter = job.begin(); iter != job.end(); iter++)
+    args.push_back(safe_strdup(iter->c_str()));
+  args.push_back(NULL);
+  return args;
+}
+
+/** Generate all the outputs listed in the batch file.
+    All input files are read once up front. Each output is then generated in a separate
+    process, which makes the analysis independent of other outputs that use the same input
+    files, while still sharing the parsed input.
+*/
+static void run_batch(void) {
+  vector<vector<string> > jobs;
+  map<pid_t, size_t> running;
+  vector<char *> args;
+  size_t next_job;
+  bool failed = false;
+  int status;
+  pid_t pid;
+
+  read_batch_file(jobs);
+
+  batch_job = true;
+  preparsing = true;
+  for (vector<vector<string> >::const_iterator iter = jobs.begin(); iter != jobs.end(); iter++) {
+    reset_options();
+    args = make_args(*iter);
+    parse_options(args.size() - 1, &args[0]);
+  }
+  preparsing = false;
+
+  for (next_job = 0; next_job < jobs.size() || !running.empty();) {
+    if (next_job < jobs.size() && running.size() < (size_t)option_jobs) {
+      printf("Generating %s\n", jobs[next_job][2].c_str());
+      fflush(NULL);
+      if ((pid = fork()) < 0) fatal("Could not start new process: %s\n", strerror(errno));
+      if (pid == 0) {
+        reset_options();
+        args = make_args(jobs[next_job]);
+        parse_options(args.size() - 1, &args[0]);
+        write_output();
+        exit(EXIT_SUCCESS);
+      }
+      running[pid] = next_job++;
+      continue;
+    }
+
+    if ((pid = wait(&status)) < 0) fatal("Could not wait for process: %s\n", strerror(errno));
+    if (running.count(pid) == 0) continue;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+      fprintf(stderr, "Failed to generate %s\n", jobs[running[pid]][2].c_str());
+      failed = true;
+    }
+    running.erase(pid);
+  }
+  exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+  transcript_init();
+
+  parse_options(argc, argv);
+  if (option_batch_name != NULL) run_batch();
+  write_output();
   return EXIT_SUCCESS;
 }
@@ -18,6 +18,7 @@
 #include <deque>
 #include <inttypes.h>
 #include <list>
+#include <map>
 #include <vector>
 
 #ifdef _WIN32
@@ -45,6 +46,11 @@ enum action_t {
   ACTION_UNASSIGNED,
   ACTION_SHIFT,
   ACTION_ILLEGAL,
+  ACTION_FINAL_LINEAR_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN1_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN2_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN3_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN4_NOFLAGS,
 
   ACTION_FLAG_PAIR = (1 << 7),
   ACTION_FINAL_PAIR = ACTION_FINAL | ACTION_FLAG_PAIR,
@@ -122,6 +128,16 @@ class UcmBase {
   vector<Mapping *> multi_mappings;
   uint8_t used_from_unicode_flags, used_to_unicode_flags;
 
+ private:
+  /* Indexes on simple_mappings, with the mappings for each key in the same order as in
+     simple_mappings. These are kept up to date by add_mapping, index_mapping and
+     unindex_mapping, and are only used by the checks done directly after reading the file.
+     The analysis later moves mappings around without updating them. */
+  map<vector<uint32_t>, vector<Mapping *> > codepoints_index;
+  map<vector<uint8_t>, vector<Mapping *> > codepage_bytes_index;
+
+ public:
+
   enum tag_t {
     IGNORED = -1,
     CODE_SET_NAME,
@@ -139,6 +155,10 @@ class UcmBase {
 
   UcmBase(void) : used_from_unicode_flags(0), used_to_unicode_flags(0) {}
   void add_mapping(Mapping *mapping);
+  void index_mapping(Mapping *mapping);
+  void unindex_mapping(Mapping *mapping);
+  Mapping *find_simple_mapping(const vector<uint32_t> &codepoints, int precision_types);
+  Mapping *find_simple_mapping(const vector<uint8_t> &codepage_bytes, int precision_types);
   virtual int check_codepage_bytes(vector<uint8_t> &bytes) = 0;
   virtual const char *get_tag_value(tag_t tag) = 0;
 };
@@ -183,7 +203,12 @@ class Ucm : public UcmBase {
     SUBCHAR1_VALID = (1 << 3),
     MULTIBYTE_START_STATE_1 = (1 << 4),
     INTERNAL_TABLE = (1 << 5),
-    VARIANTS_AVAILABLE = (1 << 6)
+    VARIANTS_AVAILABLE = (1 << 6),
+    INFO_STATELESS = (1 << 7),
+    INFO_ASCII_TRANSPARENT = (1 << 8),
+    INFO_SELF_SYNCHRONIZING = (1 << 9),
+    INFO_MAX_CHAR_BYTES_SHIFT = 10,
+    INFO_MAX_CHAR_BYTES_MASK = (7 << 10)
   };
 
   enum { WHERE_MAIN = (1 << 0), WHERE_VARIANTS = (1 << 1) };
@@ -293,7 +318,9 @@ class Ucm : public UcmBase {
   void remove_private_use_fallbacks(void);
   void ensure_ascii_controls(void);
   void calculate_item_costs(void);
+  void calculate_info_flags(void);
   void minimize_state_machines(void);
+  void find_linear_ranges(void);
   void find_shift_sequences(void);
   void write_table(FILE *output);
   void add_variant(Variant *variant);
@@ -332,7 +359,8 @@ void parse_byte_sequence(char *charseq, vector<uint8_t> &store);
 void print_state_machine(const vector<State *> &states);
 const char *sprint_sequence(vector<uint8_t> &bytes);
 const char *sprint_codepoints(vector<uint32_t> &codepoints);
-uint32_t map_charseq(vector<State *> &states, uint8_t *charseq, int length, int flags);
+uint32_t map_charseq(vector<State *> &states, uint8_t *charseq, int length, int flags,
+                     int *linear_delta = NULL);
 int popcount(int x);
 uint8_t create_mask(uint8_t used_flags);
 
@@ -13,9 +13,11 @@
 */
 #include "ucm2ltc.h"
 #include <algorithm>
+#include <arpa/inet.h>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <map>
 
 int Ucm::calculate_depth(Entry *entry) {
   int depth, max_depth = 0;
@@ -306,6 +308,98 @@ void Ucm::calculate_item_costs(void) {
   if (variants.size() > 1) flags |= VARIANTS_AVAILABLE;
 }
 
+/* Check the simple mappings in mappings for ASCII transparency. Conversions of bytes or
+   codepoints 0x00-0x7f must be identity conversions, while other characters may be converted
+   to ASCII. The ASCII characters for which conversions were found are marked in to_unicode and
+   from_unicode. */
+static bool check_ascii_mappings(const vector<Mapping *> &mappings, bool *to_unicode,
+                                 bool *from_unicode) {
+  for (vector<Mapping *>::const_iterator iter = mappings.begin(); iter != mappings.end(); iter++) {
+    const Mapping *mapping = *iter;
+    bool ascii_bytes = mapping->codepage_bytes.size() == 1 && mapping->codepage_bytes[0] < 0x80,
+         ascii_codepoint = mapping->codepoints.size() == 1 && mapping->codepoints[0] < 0x80,
+         identity = ascii_bytes && ascii_codepoint &&
+                    mapping->codepage_bytes[0] == mapping->codepoints[0];
+
+    /* Precision 0 is a round-trip mapping, 3 a fallback to Unicode, and 1 and 2 are fallbacks
+       from Unicode. */
+    if (ascii_bytes && (mapping->precision == 0 || mapping->precision == 3)) {
+      if (!identity) return false;
+      to_unicode[mapping->codepage_bytes[0]] = true;
+    }
+    if (ascii_codepoint && mapping->precision != 3) {
+      if (!identity) return false;
+      from_unicode[mapping->codepoints[0]] = true;
+    }
+  }
+  return true;
+}
+
+/* Check whether none of the multi mappings in mappings start with an ASCII byte or codepoint. */
+static bool check_ascii_multi_mappings(const vector<Mapping *> &mappings) {
+  for (vector<Mapping *>::const_iterator iter = mappings.begin(); iter != mappings.end(); iter++) {
+    if ((*iter)->codepage_bytes[0] < 0x80 || (*iter)->codepoints[0] < 0x80) return false;
+  }
+  return true;
+}
+
+static size_t max_codepage_bytes(const vector<Mapping *> &mappings, size_t max) {
+  for (vector<Mapping *>::const_iterator iter = mappings.begin(); iter != mappings.end(); iter++) {
+    if ((*iter)->codepage_bytes.size() > max) max = (*iter)->codepage_bytes.size();
+  }
+  return max;
+}
+
+/* Determine the structural properties of the converter, which are reported by
+   transcript_get_info. Must be called before the state machines are minimized. */
+void Ucm::calculate_info_flags(void) {
+  bool stateless = !(flags & MULTIBYTE_START_STATE_1), ascii_transparent, self_synchronizing;
+  bool to_unicode[0x80], from_unicode[0x80], lead_byte[256], trail_byte[256];
+  size_t max_bytes;
+  int i;
+
+  for (i = 0; i < 256; i++) lead_byte[i] = trail_byte[i] = false;
+
+  for (vector<State *>::const_iterator state_iter = codepage_states.begin();
+       state_iter != codepage_states.end(); state_iter++) {
+    bool *bytes = ((*state_iter)->flags & State::INITIAL) ? lead_byte : trail_byte;
+    for (vector<Entry>::const_iterator entry_iter = (*state_iter)->entries.begin();
+         entry_iter != (*state_iter)->entries.end(); entry_iter++) {
+      if (entry_iter->action == ACTION_SHIFT) stateless = false;
+      if (entry_iter->action == ACTION_ILLEGAL) continue;
+      for (i = entry_iter->low; i <= entry_iter->high; i++) bytes[i] = true;
+    }
+  }
+
+  self_synchronizing = stateless;
+  for (i = 0; i < 256 && self_synchronizing; i++)
+    if (lead_byte[i] && trail_byte[i]) self_synchronizing = false;
+
+  for (i = 0; i < 0x80; i++) to_unicode[i] = from_unicode[i] = false;
+  ascii_transparent = stateless &&
+                      check_ascii_mappings(simple_mappings, to_unicode, from_unicode) &&
+                      check_ascii_multi_mappings(multi_mappings);
+  max_bytes = max_codepage_bytes(simple_mappings, max_codepage_bytes(multi_mappings, 0));
+  for (deque<Variant *>::const_iterator variant_iter = variants.begin();
+       variant_iter != variants.end(); variant_iter++) {
+    if (ascii_transparent)
+      ascii_transparent =
+          check_ascii_mappings((*variant_iter)->simple_mappings, to_unicode, from_unicode) &&
+          check_ascii_multi_mappings((*variant_iter)->multi_mappings);
+    max_bytes = max_codepage_bytes((*variant_iter)->simple_mappings, max_bytes);
+    max_bytes = max_codepage_bytes((*variant_iter)->multi_mappings, max_bytes);
+  }
+  for (i = 0; i < 0x80 && ascii_transparent; i++)
+    if (!to_unicode[i] || !from_unicode[i]) ascii_transparent = false;
+
+  if (stateless) flags |= INFO_STATELESS;
+  if (ascii_transparent) flags |= INFO_ASCII_TRANSPARENT;
+  if (self_synchronizing) flags |= INFO_SELF_SYNCHRONIZING;
+  /* The maximum is stored in three bits. A value of 0 indicates that it is unknown. */
+  if (max_bytes <= (INFO_MAX_CHAR_BYTES_MASK >> INFO_MAX_CHAR_BYTES_SHIFT))
+    flags |= max_bytes << INFO_MAX_CHAR_BYTES_SHIFT;
+}
+
 void Ucm::trace_back(size_t idx, shift_sequence_t &shift_sequence) {
   if (codepage_states[idx]->flags & State::INITIAL) {
     shift_sequence.from_state = idx;
@@ -342,6 +436,138 @@ void Ucm::find_shift_sequences(void) {
   }
 }
 
+/* Minimum number of bytes in a linear range. Shorter ranges do not save enough space in the
+   mapping tables to pay for the extra entries in the state machine. */
+#define LINEAR_MIN_LENGTH 8
+#define LINEAR_UNASSIGNED (~UINT64_C(0))
+
+/* Values of the final byte of all sequences, grouped by the state reached before the final
+   byte and the bytes leading up to it. */
+typedef map<pair<int, vector<uint8_t> >, vector<uint64_t> > LinearGroups;
+
+static void add_linear_value(vector<State *> &states, LinearGroups &groups, const uint8_t *bytes,
+                             int length, int state, uint64_t value) {
+  size_t j;
+
+  for (int i = 0; i < length - 1; i++) {
+    for (j = 0; j < states[state]->entries.size(); j++) {
+      if (bytes[i] >= states[state]->entries[j].low && bytes[i] <= states[state]->entries[j].high)
+        break;
+    }
+    if (j == states[state]->entries.size() || states[state]->entries[j].action != ACTION_VALID)
+      return;
+    state = states[state]->entries[j].next_state;
+  }
+
+  vector<uint64_t> &values = groups[make_pair(state, vector<uint8_t>(bytes, bytes + length - 1))];
+  if (values.empty()) values.resize(256, LINEAR_UNASSIGNED);
+  values[bytes[length - 1]] = value;
+}
+
+static bool get_linear_action(action_t action, action_t *linear_action) {
+  switch (action) {
+    case ACTION_FINAL_NOFLAGS:
+      *linear_action = ACTION_FINAL_LINEAR_NOFLAGS;
+      return true;
+    case ACTION_FINAL_LEN1_NOFLAGS:
+    case ACTION_FINAL_LEN2_NOFLAGS:
+    case ACTION_FINAL_LEN3_NOFLAGS:
+    case ACTION_FINAL_LEN4_NOFLAGS:
+      *linear_action =
+          (action_t)(ACTION_FINAL_LINEAR_LEN1_NOFLAGS + (action - ACTION_FINAL_LEN1_NOFLAGS));
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Split the final entries of a state machine into linear and non-linear ranges.
+    A byte continues a linear range if, for all sequences ending in a state, the value mapped
+    by the byte is one more than the value mapped by the previous byte. If @a allow_unassigned
+    is true, a byte which is unassigned for a sequence also continues the range if the previous
+    byte was unassigned for that sequence as well.
+*/
+static void create_linear_entries(vector<State *> &states, LinearGroups &groups,
+                                  bool allow_unassigned) {
+  vector<vector<bool> > continues(states.size(), vector<bool>(256, true));
+  action_t linear_action;
+  int i, start;
+
+  for (LinearGroups::const_iterator iter = groups.begin(); iter != groups.end(); iter++) {
+    const vector<uint64_t> &values = iter->second;
+    vector<bool> &state_continues = continues[iter->first.first];
+    for (i = 1; i < 256; i++) {
+      if (values[i - 1] == LINEAR_UNASSIGNED && values[i] == LINEAR_UNASSIGNED) {
+        if (!allow_unassigned) state_continues[i] = false;
+      } else if (values[i - 1] == LINEAR_UNASSIGNED || values[i] != values[i - 1] + 1) {
+        state_continues[i] = false;
+      }
+    }
+  }
+
+  for (size_t idx = 0; idx < states.size(); idx++) {
+    vector<Entry> new_entries;
+
+    for (vector<Entry>::const_iterator entry_iter = states[idx]->entries.begin();
+         entry_iter != states[idx]->entries.end(); entry_iter++) {
+      if (!get_linear_action(entry_iter->action, &linear_action)) {
+        new_entries.push_back(*entry_iter);
+        continue;
+      }
+
+      for (start = entry_iter->low, i = start + 1; i <= entry_iter->high + 1; i++) {
+        if (i <= entry_iter->high && continues[idx][i]) continue;
+
+        if (i - start >= LINEAR_MIN_LENGTH) {
+          new_entries.push_back(Entry(start, i - 1, entry_iter->next_state, linear_action, 0, 0));
+        } else if (!new_entries.empty() && new_entries.back().action == entry_iter->action &&
+                   new_entries.back().high == start - 1) {
+          new_entries.back().high = i - 1;
+        } else {
+          new_entries.push_back(
+              Entry(start, i - 1, entry_iter->next_state, entry_iter->action, 0, 0));
+        }
+        start = i;
+      }
+    }
+    states[idx]->entries = new_entries;
+  }
+}
+
+void Ucm::find_linear_ranges(void) {
+  LinearGroups groups;
+  uint8_t buffer[32];
+  uint32_t codepoint;
+  uint64_t value;
+  int length;
+
+  for (vector<Mapping *>::const_iterator iter = simple_mappings.begin();
+       iter != simple_mappings.end(); iter++) {
+    if ((*iter)->precision != 0 && (*iter)->precision != 3) continue;
+    length = (*iter)->codepage_bytes.size();
+    copy((*iter)->codepage_bytes.begin(), (*iter)->codepage_bytes.end(), buffer);
+    add_linear_value(codepage_states, groups, buffer, length,
+                     (flags & MULTIBYTE_START_STATE_1) && length > 1 ? 1 : 0,
+                     (*iter)->codepoints[0]);
+  }
+  create_linear_entries(codepage_states, groups, true);
+
+  groups.clear();
+  for (vector<Mapping *>::const_iterator iter = simple_mappings.begin();
+       iter != simple_mappings.end(); iter++) {
+    if ((*iter)->precision != 0 && (*iter)->precision != 1) continue;
+    /* Include the length in the value, such that sequences of different lengths never end up
+       in the same linear range. */
+    value = (*iter)->codepage_bytes.size();
+    for (vector<uint8_t>::const_iterator byte_iter = (*iter)->codepage_bytes.begin();
+         byte_iter != (*iter)->codepage_bytes.end(); byte_iter++)
+      value = (value << 8) | *byte_iter;
+    codepoint = htonl((*iter)->codepoints[0]);
+    add_linear_value(unicode_states, groups, 1 + (uint8_t *)&codepoint, 3, 0, value);
+  }
+  create_linear_entries(unicode_states, groups, false);
+}
+
 void Ucm::check_state_machine(Ucm *other, int this_state, int other_state) {
   vector<Entry>::const_iterator this_iter = codepage_states[this_state]->entries.begin();
   vector<Entry>::const_iterator other_iter = other->codepage_states[other_state]->entries.begin();
@@ -16,6 +16,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <map>
+#include <set>
 #include <transcript/transcript.h>
 
 #include "ucm2ltc.h"
@@ -251,6 +253,7 @@ void Ucm::write_to_unicode_table(FILE *output) {
   uint16_t *codepoints;
   uint8_t buffer[32];
   uint32_t idx;
+  int linear_delta;
 
   codepoints = (uint16_t *)safe_malloc(codepage_range * sizeof(uint16_t));
   memset(codepoints, 0xff, codepage_range * sizeof(uint16_t));
@@ -260,7 +263,10 @@ void Ucm::write_to_unicode_table(FILE *output) {
     if ((*iter)->precision != 0 && (*iter)->precision != 3) continue;
 
     copy((*iter)->codepage_bytes.begin(), (*iter)->codepage_bytes.end(), buffer);
-    idx = map_charseq(codepage_states, buffer, (*iter)->codepage_bytes.size(), flags);
+    idx = map_charseq(codepage_states, buffer, (*iter)->codepage_bytes.size(), flags,
+                      &linear_delta);
+    /* Linear ranges only store the codepoint for the first byte in the range. */
+    if (linear_delta != 0) continue;
     if ((*iter)->codepoints[0] > UINT32_C(0xffff)) {
       codepoints[idx] = (((*iter)->codepoints[0] - 0x10000) >> 10) + 0xd800;
       codepoints[idx + 1] = (((*iter)->codepoints[0] - 0x10000) & 0x3ff) + 0xdc00;
@@ -278,6 +284,7 @@ void Ucm::write_to_unicode_table(FILE *output) {
 void Ucm::write_from_unicode_table(FILE *output) {
   uint8_t *codepage_bytes;
   uint32_t idx, codepoint;
+  int linear_delta;
 
   codepage_bytes = (uint8_t *)safe_malloc(unicode_range * single_bytes);
   memset(codepage_bytes, 0x00, unicode_range * single_bytes);
@@ -287,7 +294,9 @@ void Ucm::write_from_unicode_table(FILE *output) {
     if ((*iter)->precision != 0 && (*iter)->precision != 1) continue;
 
     codepoint = htonl((*iter)->codepoints[0]);
-    idx = map_charseq(unicode_states, 1 + (uint8_t *)&codepoint, 3, 0);
+    idx = map_charseq(unicode_states, 1 + (uint8_t *)&codepoint, 3, 0, &linear_delta);
+    /* Linear ranges only store the bytes for the first codepoint in the range. */
+    if (linear_delta != 0) continue;
     copy((*iter)->codepage_bytes.begin(), (*iter)->codepage_bytes.end(),
          codepage_bytes + idx * single_bytes);
   }
@@ -335,7 +344,69 @@ static void fill_conversion_table(uint8_t *table, int mask) {
   }
 }
 
-#define BLOCKSIZE 16
+/* The flags trie is built with blocks of 1 << block_bits bytes. The block size is chosen per
+   table from the range below. The runtime handles 1 << DEFAULT_BLOCK_BITS bytes with fixed
+   shifts, which is also what tables store a block_bits value of 0 for. */
+#define MIN_BLOCK_BITS 2
+#define MAX_BLOCK_BITS 7
+#define DEFAULT_BLOCK_BITS 4
+#define MAX_BLOCKSIZE (1 << MAX_BLOCK_BITS)
+#define CACHE_LINE_SIZE 64
+/* Number of consecutive indices for which the cache line footprint is simulated. Indices which
+   are close together generally belong to the same script, and are likely used together. */
+#define FOOTPRINT_WINDOW 128
+
+struct flags_trie_t {
+  int block_bits;
+  vector<uint16_t> indices;
+  vector<uint8_t> blocks;
+  /* Size in cache lines of the indices and blocks, and the average number of cache lines
+     touched by all the look-ups in a window of FOOTPRINT_WINDOW indices. */
+  size_t cache_lines;
+  double footprint;
+};
+
+/** Build the trie for @a data using blocks of 1 << @a trie.block_bits bytes.
+    @return false if the number of unique blocks is too large to be addressed.
+*/
+static bool build_flags_trie(const uint8_t *data, size_t store_idx, int bits, flags_trie_t &trie) {
+  size_t blocksize = 1 << trie.block_bits;
+  size_t nr_of_blocks = (store_idx + blocksize - 1) / blocksize;
+  map<vector<uint8_t>, uint16_t> block_map;
+  map<vector<uint8_t>, uint16_t>::const_iterator block_iter;
+  size_t i, j, shift, window_lines = 0, nr_windows = 0;
+
+  // Find all unique blocks.
+  for (i = 0; i < nr_of_blocks; i++) {
+    vector<uint8_t> block(data + i * blocksize, data + (i + 1) * blocksize);
+    if ((block_iter = block_map.find(block)) == block_map.end()) {
+      if (block_map.size() > UINT16_MAX) return false;
+      block_iter = block_map.insert(make_pair(block, (uint16_t)block_map.size())).first;
+      trie.blocks.insert(trie.blocks.end(), block.begin(), block.end());
+    }
+    trie.indices.push_back(block_iter->second);
+  }
+
+  trie.cache_lines = (trie.indices.size() * 2 + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE +
+                     (trie.blocks.size() + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+
+  /* Simulate the look-ups for all indices, and count the distinct cache lines in the indices
+     (even numbers) and blocks (odd numbers) for each window. */
+  shift = trie.block_bits + popcount(8 / bits - 1);
+  for (i = 0; i < store_idx * (8 / bits); i += FOOTPRINT_WINDOW) {
+    set<size_t> lines;
+    for (j = i; j < i + FOOTPRINT_WINDOW && j < store_idx * (8 / bits); j++) {
+      lines.insert(((j >> shift) * 2 / CACHE_LINE_SIZE) * 2);
+      lines.insert(((trie.indices[j >> shift] * blocksize + (j & ((1 << shift) - 1)) * bits / 8) /
+                    CACHE_LINE_SIZE) * 2 + 1);
+    }
+    window_lines += lines.size();
+    nr_windows++;
+  }
+  trie.footprint = nr_windows == 0 ? 0 : (double)window_lines / nr_windows;
+  return true;
+}
+
 static const char *merge_and_write_flags(FILE *output, uint8_t *data, uint32_t range,
                                          uint8_t used_flags, uint8_t default_flags,
                                          const char *name) {
@@ -344,11 +415,8 @@ static const char *merge_and_write_flags(FILE *output, uint8_t *data, uint32_t r
   size_t store_idx = 0;
   uint8_t byte, mask;
   uint32_t i;
-  int j, bits;
-  uint16_t *indices;
-  uint8_t *blocks;
-  uint32_t nr_of_blocks;
-  int saved_blocks = 0;
+  int j, bits, best = -1;
+  flags_trie_t tries[MAX_BLOCK_BITS - MIN_BLOCK_BITS + 1];
   uint8_t flag_code;
 
   /*
@@ -367,28 +435,28 @@ static const char *merge_and_write_flags(FILE *output, uint8_t *data, uint32_t r
     data[store_idx++] = byte;
   }
 
-  nr_of_blocks = (store_idx + BLOCKSIZE - 1) / BLOCKSIZE;
-  indices = (uint16_t *)safe_malloc(nr_of_blocks * 2);
-  blocks = (uint8_t *)safe_malloc(nr_of_blocks * BLOCKSIZE);
-
   // Ensure that the last block is filled up with 0 bytes
-  memset(data + store_idx, 0, nr_of_blocks * BLOCKSIZE - store_idx);
-
-  // Find all unique blocks.
-  for (i = 0; i < nr_of_blocks; i++) {
-    for (j = 0; j < saved_blocks; j++) {
-      if (memcmp(data + i * BLOCKSIZE, blocks + j * BLOCKSIZE, BLOCKSIZE) == 0) break;
-    }
-    indices[i] = j;
-    if (j >= saved_blocks) {
-      memcpy(blocks + saved_blocks * BLOCKSIZE, data + i * BLOCKSIZE, BLOCKSIZE);
-      saved_blocks++;
-    }
+  memset(data + store_idx, 0, MAX_BLOCKSIZE - 1);
+
+  /* Select the block size which results in the fewest cache lines. If multiple block sizes
+     result in the same number, prefer the one with the smallest footprint. Block sizes for
+     which the number of unique blocks does not fit in the indices are skipped. */
+  for (j = 0; j <= MAX_BLOCK_BITS - MIN_BLOCK_BITS; j++) {
+    tries[j].block_bits = MIN_BLOCK_BITS + j;
+    if (!build_flags_trie(data, store_idx, bits, tries[j])) continue;
+    if (option_verbose)
+      fprintf(stderr, "Trie block size %d: size %zd, footprint %.2f cache lines\n",
+              1 << tries[j].block_bits, tries[j].indices.size() * 2 + tries[j].blocks.size(),
+              tries[j].footprint);
+    if (best < 0 || tries[j].cache_lines < tries[best].cache_lines ||
+        (tries[j].cache_lines == tries[best].cache_lines &&
+         tries[j].footprint < tries[best].footprint))
+      best = j;
   }
-
-  if (option_verbose)
-    fprintf(stderr, "Trie size: %d, flat table size: %zd\n",
-            nr_of_blocks * 2 + saved_blocks * BLOCKSIZE, store_idx);
+  if (option_verbose && best >= 0)
+    fprintf(stderr, "Trie size: %zd (block size %d), flat table size: %zd\n",
+            tries[best].indices.size() * 2 + tries[best].blocks.size(),
+            1 << tries[best].block_bits, store_idx);
 
   switch (bits) {
     case 8:
@@ -412,26 +480,26 @@ static const char *merge_and_write_flags(FILE *output, uint8_t *data, uint32_t r
     if (popcount(i) == bits) flag_code++;
   }
 
-  if (nr_of_blocks * 2 + saved_blocks * BLOCKSIZE > store_idx) {
+  if (best < 0 || tries[best].blocks.empty() ||
+      tries[best].indices.size() * 2 + tries[best].blocks.size() > store_idx) {
     fprintf(output, "static const uint8_t %s_unicode_flags_bytes_%d[] = {\n", name, unique);
     write_byte_data(output, data, store_idx, 1);
     fprintf(output, "\n};\n\n");
-    snprintf(result, sizeof(result), "{ %s_unicode_flags_bytes_%d, NULL, 0x%02x, 0x%02x }", name,
-             unique, default_flags, flag_code);
+    snprintf(result, sizeof(result), "{ %s_unicode_flags_bytes_%d, NULL, 0x%02x, 0x%02x, 0 }",
+             name, unique, default_flags, flag_code);
   } else {
     fprintf(output, "static const uint8_t %s_unicode_flags_bytes_%d[] = {\n", name, unique);
-    write_byte_data(output, blocks, saved_blocks * BLOCKSIZE, 1);
+    write_byte_data(output, &tries[best].blocks[0], tries[best].blocks.size(), 1);
     fprintf(output, "\n};\n\n");
     fprintf(output, "static const uint16_t %s_unicode_flags_indices_%d[] = {\n", name, unique);
-    write_word_data(output, indices, nr_of_blocks, 1);
+    write_word_data(output, &tries[best].indices[0], tries[best].indices.size(), 1);
     fprintf(output, "\n};\n\n");
 
     snprintf(result, sizeof(result),
-             "{ %s_unicode_flags_bytes_%d, %s_unicode_flags_indices_%d, 0x%02x, 0x%02x }", name,
-             unique, name, unique, default_flags, flag_code | 0x80);
+             "{ %s_unicode_flags_bytes_%d, %s_unicode_flags_indices_%d, 0x%02x, 0x%02x, %d }",
+             name, unique, name, unique, default_flags, flag_code | 0x80,
+             tries[best].block_bits == DEFAULT_BLOCK_BITS ? 0 : tries[best].block_bits);
   }
-  free(indices);
-  free(blocks);
   return result;
 }
 
@@ -441,8 +509,8 @@ void Ucm::write_to_unicode_flags(FILE *output) {
   uint8_t *save_flags;
   vector<Mapping *>::const_iterator mapping_iter;
 
-  save_flags = (uint8_t *)safe_malloc(codepage_range + BLOCKSIZE - 1);
-  memset(save_flags, 0, codepage_range + BLOCKSIZE - 1);
+  save_flags = (uint8_t *)safe_malloc(codepage_range + MAX_BLOCKSIZE - 1);
+  memset(save_flags, 0, codepage_range + MAX_BLOCKSIZE - 1);
 
   for (mapping_iter = simple_mappings.begin(); mapping_iter != simple_mappings.end();
        mapping_iter++) {
@@ -490,8 +558,8 @@ void Ucm::write_from_unicode_flags(FILE *output) {
   uint8_t *save_flags;
   vector<Mapping *>::const_iterator mapping_iter;
 
-  save_flags = (uint8_t *)safe_malloc(unicode_range + BLOCKSIZE - 1);
-  memset(save_flags, Mapping::FROM_UNICODE_NOT_AVAIL, unicode_range + BLOCKSIZE - 1);
+  save_flags = (uint8_t *)safe_malloc(unicode_range + MAX_BLOCKSIZE - 1);
+  memset(save_flags, Mapping::FROM_UNICODE_NOT_AVAIL, unicode_range + MAX_BLOCKSIZE - 1);
 
   for (mapping_iter = simple_mappings.begin(); mapping_iter != simple_mappings.end();
        mapping_iter++) {
@@ -534,7 +602,10 @@ void Ucm::write_from_unicode_flags(FILE *output) {
       output, save_flags, unicode_range, used_from_unicode_flags, from_unicode_flags, "from"));
   free(save_flags);
 }
-#undef BLOCKSIZE
+#undef MIN_BLOCK_BITS
+#undef MAX_BLOCK_BITS
+#undef DEFAULT_BLOCK_BITS
+#undef MAX_BLOCKSIZE
 
 void Ucm::write_interface(FILE *output, const char *normalized_name, int variant_nr) {
   fprintf(
@@ -655,11 +726,11 @@ void Ucm::write_table(FILE *output) {
   else
     fprintf(output, "shift_states_%d, ", unique);
   fprintf(output, "codepage_mappings_%d, unicode_mappings_%d,\n", unique, unique);
-  fprintf(
-      output, "\t%s,\n",
-      to_unicode_flags_initializer == NULL ? "{ NULL, NULL, 0, 0 }" : to_unicode_flags_initializer);
   fprintf(output, "\t%s,\n",
-          from_unicode_flags_initializer == NULL ? "{ NULL, NULL, 0, 0 }"
+          to_unicode_flags_initializer == NULL ? "{ NULL, NULL, 0, 0, 0 }"
+                                               : to_unicode_flags_initializer);
+  fprintf(output, "\t%s,\n",
+          from_unicode_flags_initializer == NULL ? "{ NULL, NULL, 0, 0, 0 }"
                                                  : from_unicode_flags_initializer);
   fprintf(output, "\t{ ");
   vector<uint8_t> subchar;
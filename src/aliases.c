@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /* Make sure that for us the struct members are not constant, so we can modify
    them. */
@@ -43,8 +45,14 @@ static int
     display_names_allocated, /**< The number of elements allocated in the ::display_names array. */
     display_names_used; /**< The number of elements in the ::display_names array that is currently
                            in use. */
+static int file_display_names_used; /**< The number of elements in the ::display_names array that
+                                       were added while reading the aliases.txt file. */
 /** Boolean indicating whether the @c available member of #display_names has been initialized. */
 static bool_t availability_initialized = FALSE;
+/** The converters that have been interned, indexed by atom - 1. */
+static transcript_name_desc_t **atoms;
+static int atoms_allocated, /**< The number of elements allocated in the ::atoms array. */
+    atoms_used;             /**< The number of elements in the ::atoms array that are in use. */
 
 /** Add a name to the ::display_names array, resizing the array if necessary. */
 static void add_display_name(const char *name, int available) {
@@ -113,6 +121,7 @@ static bool_t add_converter_name(const char *name) {
   converter->aliases = NULL;
   converter->next = NULL;
   converter->flags = 0;
+  converter->atom = 0;
 
   if (is_display_name) {
     add_display_name(name, 0);
@@ -234,40 +243,156 @@ transcript_name_desc_t *_transcript_get_name_desc(const char *name, int need_nor
   return NULL;
 }
 
+/** The name of the file in a database directory which caches the availability of converters. */
+#define AVAILABILITY_INDEX "availability.idx"
+/** The first line of an availability index file. */
+#define AVAILABILITY_INDEX_HEADER "# libtranscript availability index\n"
+
+/** Remove the display names which were not added while reading the aliases.txt file. */
+static void truncate_display_names(void) {
+  int i;
+
+  for (i = file_display_names_used; i < display_names_used; i++) {
+    free(display_names[i].name);
+  }
+  display_names_used = file_display_names_used;
+}
+
+/** Concatenate a directory and a file name into a newly allocated string. */
+static char *make_path(const char *dir, const char *file) {
+  char *path;
+
+  if ((path = malloc(strlen(dir) + 1 + strlen(file) + 1)) == NULL) {
+    return NULL;
+  }
+  strcpy(path, dir);
+  strcat(path, "/"); /* Even on Windows, / is recognised as directory separator internally. */
+  strcat(path, file);
+  return path;
+}
+
+/** Get the modification time of a file, or @c (time_t)-1 if it can not be determined. */
+static time_t get_mtime(const char *path) {
+  struct stat statbuf;
+  return stat(path, &statbuf) == 0 ? statbuf.st_mtime : (time_t)-1;
+}
+
 /** @internal
-    @brief Initialize the list of available converter names.
+    @brief Check whether an availability index is up to date.
+    @param dir The directory the index describes.
+    @param index_path The path of the index file.
 
-    This function tries to find all converters which are available. Unlike
-    ::_transcript_init_aliases_from_file, it actually checks the file system to
-    see which tables are available. Furthermore, it checks which converters from
-    the list built by ::init_availability is available.
+    Adding or removing converters changes the modification time of the
+    directory, so the index is only used if it is not older than the directory
+    and the aliases.txt file in it.
 */
-static void init_availability(void) {
-  DIR *dir;
-  struct dirent *entry;
-  size_t i;
+static bool_t index_is_current(const char *dir, const char *index_path) {
+  time_t index_mtime, mtime;
+  char *aliases_path;
 
-  ACQUIRE_LOCK();
-  if (!_transcript_initialized_count) {
-    RELEASE_LOCK();
-    return;
+  if ((index_mtime = get_mtime(index_path)) == (time_t)-1) {
+    return FALSE;
+  }
+  if ((mtime = get_mtime(dir)) == (time_t)-1 || mtime > index_mtime) {
+    return FALSE;
+  }
+  if ((aliases_path = make_path(dir, "aliases.txt")) == NULL) {
+    return FALSE;
   }
+  mtime = get_mtime(aliases_path);
+  free(aliases_path);
+  return mtime <= index_mtime;
+}
 
-  if (availability_initialized) {
-    RELEASE_LOCK();
-    return;
+/** @internal
+    @brief Initialize the availability of the display names from the availability index of a
+        directory.
+    @param dir The directory to read the index from.
+    @return @c TRUE if the index was up to date and could be read, @c FALSE otherwise.
+
+    Names listed in aliases.txt which are missing from the index are probed.
+*/
+static bool_t read_index(const char *dir) {
+  char line[NORMALIZE_NAME_MAX + 4];
+  FILE *index;
+  char *path;
+  int i;
+
+  if ((path = make_path(dir, AVAILABILITY_INDEX)) == NULL) {
+    return FALSE;
+  }
+  if (!index_is_current(dir, path) || (index = fopen(path, "r")) == NULL) {
+    free(path);
+    return FALSE;
+  }
+  free(path);
+
+  truncate_display_names();
+  if (fgets(line, sizeof(line), index) == NULL || strcmp(line, AVAILABILITY_INDEX_HEADER) != 0) {
+    goto end_error;
+  }
+  for (i = 0; i < display_names_used; i++) {
+    display_names[i].available = -1;
   }
 
+  /* Each line consists of a 0 or 1 indicating availability, a space and the display name. */
+  while (fgets(line, sizeof(line), index) != NULL) {
+    size_t len = strlen(line);
+    if (len < 4 || line[len - 1] != '\n' || (line[0] != '0' && line[0] != '1') || line[1] != ' ') {
+      goto end_error;
+    }
+    line[len - 1] = 0;
+
+    for (i = 0; i < file_display_names_used; i++) {
+      if (strcmp(display_names[i].name, line + 2) == 0) {
+        display_names[i].available = line[0] == '1';
+        break;
+      }
+    }
+    if (i == file_display_names_used && _transcript_get_name_desc(line + 2, 1) == NULL) {
+      add_display_name(line + 2, line[0] == '1');
+    }
+  }
+  if (ferror(index)) {
+    goto end_error;
+  }
+  fclose(index);
+
+  for (i = 0; i < file_display_names_used; i++) {
+    if (display_names[i].available < 0) {
+      display_names[i].available = transcript_probe_converter_nolock(display_names[i].name);
+    }
+  }
+  return TRUE;
+
+end_error:
+  _transcript_log("Ignoring malformed availability index in '%s'\n", dir);
+  fclose(index);
+  truncate_display_names();
+  return FALSE;
+}
+
+/** @internal
+    @brief Determine the availability of all converters by probing them.
+    @param dir The directory to search for converters not listed in aliases.txt.
+*/
+static void scan_availability(const char *dir) {
+  DIR *dir_handle;
+  struct dirent *entry;
+  int i;
+
+  truncate_display_names();
+
   /* Probe all the converters listed as aliases from the file. */
-  for (i = 0; i < (size_t)display_names_used; i++) {
+  for (i = 0; i < display_names_used; i++) {
     display_names[i].available = transcript_probe_converter_nolock(display_names[i].name);
   }
 
   /* FIXME: perhaps we should add the default links for the full-type converters here. */
 
   /* Add all the file names we can find in the DB dir, if they are not already present. */
-  if ((dir = opendir(DB_DIRECTORY)) != NULL) {
-    while ((entry = readdir(dir)) != NULL) {
+  if ((dir_handle = opendir(dir)) != NULL) {
+    while ((entry = readdir(dir_handle)) != NULL) {
       size_t entry_name_len = strlen(entry->d_name);
       if (entry_name_len < 5) {
         continue;
@@ -283,13 +408,107 @@ static void init_availability(void) {
         add_display_name(entry->d_name, transcript_probe_converter_nolock(entry->d_name));
       }
     }
-    closedir(dir);
+    closedir(dir_handle);
+  }
+}
+
+/** @internal
+    @brief Initialize the list of available converter names.
+
+    This function tries to find all converters which are available. Unlike
+    ::_transcript_init_aliases_from_file, it actually checks the file system to
+    see which tables are available. Furthermore, it checks which converters from
+    the list built by ::init_availability is available.
+
+    If only the compiled in database directory is searched and it contains an
+    up to date availability index (see ::transcript_write_index), the index is
+    used instead of probing all converters.
+*/
+static void init_availability(void) {
+  ACQUIRE_LOCK();
+  if (!_transcript_initialized_count) {
+    RELEASE_LOCK();
+    return;
+  }
+
+  if (availability_initialized) {
+    RELEASE_LOCK();
+    return;
+  }
+
+  if (_transcript_search_path[0] == NULL || _transcript_search_path[1] != NULL ||
+      !read_index(_transcript_search_path[0])) {
+    scan_availability(DB_DIRECTORY);
   }
 
   availability_initialized = TRUE;
   RELEASE_LOCK();
 }
 
+/** Write the availability index for a database directory.
+    @param dir The directory to write the index for, or @c NULL for the compiled in database
+        directory.
+    @return An error code (::TRANSCRIPT_ERRNO if the index could not be written).
+
+    The availability index records which of the converters in @a dir are
+    available, such that ::transcript_get_names does not have to load or probe
+    every converter. It is meant to be generated when installing converters, for
+    example with linkltc(1). The index is ignored once the directory or its
+    aliases.txt file have been modified after the index was written.
+*/
+transcript_error_t transcript_write_index(const char *dir) {
+  const char *search_path[2];
+  const char **saved_search_path;
+  transcript_error_t result = TRANSCRIPT_SUCCESS;
+  FILE *index;
+  char *path;
+  int i;
+
+  ACQUIRE_LOCK();
+  if (!_transcript_initialized_count) {
+    RELEASE_LOCK();
+    return TRANSCRIPT_NOT_INITIALIZED;
+  }
+
+  if (dir == NULL) {
+    dir = DB_DIRECTORY;
+  }
+  if ((path = make_path(dir, AVAILABILITY_INDEX)) == NULL) {
+    RELEASE_LOCK();
+    return TRANSCRIPT_OUT_OF_MEMORY;
+  }
+
+  /* Probe the converters in dir only, which need not be the directory we normally use. */
+  search_path[0] = dir;
+  search_path[1] = NULL;
+  saved_search_path = _transcript_search_path;
+  _transcript_search_path = search_path;
+  scan_availability(dir);
+  _transcript_search_path = saved_search_path;
+  availability_initialized = FALSE;
+
+  if ((index = fopen(path, "w")) == NULL) {
+    result = TRANSCRIPT_ERRNO;
+  } else {
+    fputs(AVAILABILITY_INDEX_HEADER, index);
+    for (i = 0; i < display_names_used; i++) {
+      if (strchr(display_names[i].name, '\n') == NULL &&
+          strlen(display_names[i].name) < NORMALIZE_NAME_MAX) {
+        fprintf(index, "%d %s\n", display_names[i].available ? 1 : 0, display_names[i].name);
+      }
+    }
+    if (ferror(index)) {
+      result = TRANSCRIPT_ERRNO;
+    }
+    if (fclose(index) != 0) {
+      result = TRANSCRIPT_ERRNO;
+    }
+  }
+  free(path);
+  RELEASE_LOCK();
+  return result;
+}
+
 /** Retrieve the list of display names known to this instantiation of the library.
     @param count A location to store the number of names returned.
     @return An array of ::transcript_name_t structures listing the known converters.
@@ -302,6 +521,167 @@ const transcript_name_t *transcript_get_names(int *count) {
   return display_names;
 }
 
+/** Assign an atom to a converter, resizing the ::atoms array if necessary. */
+static transcript_atom_t add_atom(transcript_name_desc_t *converter) {
+  if (atoms_used >= atoms_allocated) {
+    transcript_name_desc_t **tmp;
+    int new_allocated = atoms_allocated == 0 ? 64 : atoms_allocated * 2;
+
+    if ((tmp = realloc(atoms, new_allocated * sizeof(transcript_name_desc_t *))) == NULL) {
+      return 0;
+    }
+    atoms = tmp;
+    atoms_allocated = new_allocated;
+  }
+  atoms[atoms_used++] = converter;
+  converter->atom = atoms_used;
+  return converter->atom;
+}
+
+/** Create a name descriptor for a converter that is not listed in the aliases file. */
+static transcript_name_desc_t *new_interned_converter(const char *name,
+                                                      const char *normalized_name) {
+  transcript_name_desc_t *converter;
+
+  if ((converter = malloc(sizeof(transcript_name_desc_t))) == NULL) {
+    return NULL;
+  }
+  if ((converter->real_name = _transcript_strdup(name)) == NULL ||
+      (converter->name = _transcript_strdup(normalized_name)) == NULL) {
+    free(converter->real_name);
+    free(converter);
+    return NULL;
+  }
+  converter->aliases = NULL;
+  converter->next = NULL;
+  converter->flags = NAME_DESC_FLAG_INTERNED;
+  converter->atom = 0;
+  return converter;
+}
+
+/** Get the converter described by an atom. Must be called with the library lock held. */
+static transcript_name_desc_t *get_atom(transcript_atom_t atom) {
+  if (!_transcript_initialized_count || atom <= 0 || atom > atoms_used) {
+    return NULL;
+  }
+  return atoms[atom - 1];
+}
+
+/** Intern a converter name.
+    @param name The name, alias or display name of a converter.
+    @return The atom for the converter, or 0 if @a name does not describe a known converter.
+
+    The name is normalized and resolved only once. The returned atom can be
+    compared directly to determine whether two names describe the same
+    converter, and can be used with ::transcript_open_atom and
+    ::transcript_probe_atom. Atoms are valid until the final call to
+    ::transcript_finalize.
+
+    Names that are not listed in the aliases file are only interned if a
+    converter by that name is available, such that untrusted input can not
+    grow the set of atoms without bound.
+*/
+transcript_atom_t transcript_intern(const char *name) {
+  char normalized_name[NORMALIZE_NAME_MAX];
+  transcript_name_desc_t *converter;
+  transcript_atom_t result = 0;
+  int i;
+
+  transcript_normalize_name(name, normalized_name, NORMALIZE_NAME_MAX);
+
+  ACQUIRE_LOCK();
+  if (!_transcript_initialized_count) {
+    RELEASE_LOCK();
+    return 0;
+  }
+
+  if ((converter = _transcript_get_name_desc(normalized_name, 0)) != NULL) {
+    result = converter->atom != 0 ? converter->atom : add_atom(converter);
+    RELEASE_LOCK();
+    return result;
+  }
+
+  for (i = 0; i < atoms_used; i++) {
+    if ((atoms[i]->flags & NAME_DESC_FLAG_INTERNED) &&
+        strcmp(atoms[i]->name, normalized_name) == 0) {
+      RELEASE_LOCK();
+      return atoms[i]->atom;
+    }
+  }
+
+  if (transcript_probe_converter_nolock(normalized_name) &&
+      (converter = new_interned_converter(name, normalized_name)) != NULL &&
+      (result = add_atom(converter)) == 0) {
+    free(converter->real_name);
+    free(converter->name);
+    free(converter);
+  }
+  RELEASE_LOCK();
+  return result;
+}
+
+/** Get the name of an interned converter.
+    @param atom The atom for the converter.
+    @return The name of the converter, or @c NULL if @a atom is not valid.
+*/
+const char *transcript_atom_name(transcript_atom_t atom) {
+  transcript_name_desc_t *converter;
+  const char *result;
+
+  ACQUIRE_LOCK();
+  converter = get_atom(atom);
+  result = converter == NULL ? NULL : converter->real_name;
+  RELEASE_LOCK();
+  return result;
+}
+
+/** Check if an interned converter is available.
+    @param atom The atom for the converter.
+    @return 1 if the converter is available, 0 otherwise.
+*/
+int transcript_probe_atom(transcript_atom_t atom) {
+  transcript_name_desc_t *converter;
+  int result;
+
+  ACQUIRE_LOCK();
+  converter = get_atom(atom);
+  result = converter == NULL ? 0 : _transcript_probe_name_desc(converter);
+  RELEASE_LOCK();
+  return result;
+}
+
+/** Open an interned converter.
+    @param atom The atom for the converter.
+    @param utf_type The UTF type to use for representing Unicode codepoints.
+    @param flags The default flags for the converter (see ::transcript_flags_t for possible values).
+    @param error The location to store a possible error code.
+
+    This function is equivalent to ::transcript_open_converter, but skips the
+    normalization and look-up of the name.
+*/
+transcript_t *transcript_open_atom(transcript_atom_t atom, transcript_utf_t utf_type, int flags,
+                                   transcript_error_t *error) {
+  transcript_name_desc_t *converter;
+  transcript_t *result;
+
+  ACQUIRE_LOCK();
+  if (!_transcript_initialized_count) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_NOT_INITIALIZED;
+    }
+    result = NULL;
+  } else if ((converter = get_atom(atom)) == NULL) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_BAD_ARG;
+    }
+    result = NULL;
+  } else {
+    result = _transcript_open_name_desc(converter, utf_type, flags, error);
+  }
+  RELEASE_LOCK();
+  return result;
+}
+
 /** @internal
     @brief The maximum size of a name in the aliases file.
 
@@ -444,6 +824,7 @@ static void *read_alias_file(const char *name) {
 */
 void _transcript_init_aliases_from_file(void) {
   _transcript_db_open("aliases", "txt", read_alias_file, NULL);
+  file_display_names_used = display_names_used;
 }
 
 /** @internal
@@ -457,6 +838,18 @@ void _transcript_free_aliases(void) {
   int i;
 
   availability_initialized = FALSE;
+  for (i = 0; i < atoms_used; i++) {
+    if (atoms[i]->flags & NAME_DESC_FLAG_INTERNED) {
+      free(atoms[i]->real_name);
+      free(atoms[i]->name);
+      free(atoms[i]);
+    }
+  }
+  free(atoms);
+  atoms = NULL;
+  atoms_allocated = 0;
+  atoms_used = 0;
+
   for (i = 0; i < display_names_used; i++) {
     free(display_names[i].name);
   }
@@ -464,6 +857,7 @@ void _transcript_free_aliases(void) {
   display_names = NULL;
   display_names_allocated = 0;
   display_names_used = 0;
+  file_display_names_used = 0;
 
   for (desc_ptr = converters; desc_ptr != NULL; desc_ptr = converters) {
     converters = converters->next;
@@ -476,4 +870,5 @@ void _transcript_free_aliases(void) {
     }
     free(desc_ptr);
   }
+  converters_tail = NULL;
 }
@@ -28,7 +28,10 @@ typedef uint_fast32_t (*get_unicode_func_t)(const char **inbuf, const char *inbu
                                             bool_t skip);
 typedef void (*reset_func_t)(transcript_t *handle);
 typedef void (*close_func_t)(transcript_t *handle);
+typedef transcript_t *(*clone_func_t)(const transcript_t *handle, transcript_error_t *error);
 typedef void (*save_load_func_t)(transcript_t *handle, void *state);
+typedef void (*info_func_t)(const transcript_t *handle, transcript_info_t *info);
+typedef void (*encodable_func_t)(transcript_t *handle, uint32_t *bits);
 
 struct transcript_t {
   conversion_func_t convert_to;
@@ -46,10 +49,46 @@ struct transcript_t {
   save_load_func_t load;
   void *library_handle;
   int flags;
+  /* Members added in version 2 of the full module interface. They are zeroed by
+     transcript_alloc_handle_nolock. New members must be added at the end. */
+  /* Size of the converter's handle structure if all state that changes during a conversion is
+     captured by save and load, ::SHARED_HANDLE_IMMUTABLE if the handle never changes during a
+     conversion, or 0 otherwise. Converters with a non-zero value can be used through the shared
+     converter interface, which converts using a copy of the handle if necessary. */
+  size_t shared_size;
+  /* The allocator used for the handle, or NULL for malloc. */
+  const transcript_allocator_t *allocator;
+  clone_func_t clone;
+  /* Interned name of the converter for handles from transcript_acquire, or 0. */
+  transcript_atom_t cache_atom;
+  transcript_utf_t cache_utf_type;
+  /* Next handle in the per-thread cache of released handles. */
+  struct transcript_t *cache_next;
+  info_func_t get_info;
+  /* Set the bits in a bitmap of ::ENCODABLE_WORDS words for all codepoints which can be converted
+     from Unicode without fall-backs or substitutions. The bitmap is cleared by the caller. */
+  encodable_func_t get_encodable;
 };
 
+/** Maximum size of a handle that is copied for conversions through the shared interface. */
+#define SHARED_HANDLE_MAX 384
+/** Value of the @c shared_size member of ::transcript_t for converters without state. */
+#define SHARED_HANDLE_IMMUTABLE ((size_t)-1)
+/** Number of 32-bit words in a bitmap with a bit for every Unicode codepoint. */
+#define ENCODABLE_WORDS (0x110000 / 32)
+/** Set the bit for @a codepoint in a bitmap of encodable codepoints. */
+#define SET_ENCODABLE(bits, codepoint) ((bits)[(codepoint) >> 5] |= UINT32_C(1) << ((codepoint)&31))
+
 TRANSCRIPT_API transcript_t *transcript_open_converter_nolock(const char *name,
                                                               transcript_utf_t utf_type, int flags,
                                                               transcript_error_t *error);
 TRANSCRIPT_API void transcript_close_converter_nolock(transcript_t *handle);
+TRANSCRIPT_API transcript_t *transcript_clone_converter_nolock(const transcript_t *handle,
+                                                               transcript_error_t *error);
+TRANSCRIPT_API void *transcript_alloc_handle_nolock(size_t size);
+TRANSCRIPT_API void *transcript_clone_handle_nolock(const transcript_t *handle, size_t size);
+TRANSCRIPT_API void *transcript_handle_alloc(const transcript_t *handle, size_t size);
+TRANSCRIPT_API void transcript_handle_free(const transcript_t *handle, void *ptr);
+TRANSCRIPT_API const transcript_allocator_t *_transcript_set_allocator(
+    const transcript_allocator_t *allocator);
 #endif
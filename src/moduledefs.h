@@ -34,7 +34,8 @@ enum {
   TRANSCRIPT_FULL_MODULE_V1, /* Provides all functions itself. */
   TRANSCRIPT_STATE_TABLE_V1, /* Provides a set of state tables. See state_table_converter for
                                 details. */
-  TRANSCRIPT_SBCS_TABLE_V1   /* Simple set of tables for SBCSs. See sbcs_converter for details. */
+  TRANSCRIPT_SBCS_TABLE_V1,  /* Simple set of tables for SBCSs. See sbcs_converter for details. */
+  TRANSCRIPT_FULL_MODULE_V2  /* Provides all functions itself, using the extended transcript_t. */
 };
 
 enum { TRANSCRIPT_HANDLING_UNASSIGNED = (1 << 14), TRANSCRIPT_INTERNAL = (1 << 15) };
@@ -74,6 +75,9 @@ typedef struct {
   const uint16_t *indices;
   const uint8_t default_flags;
   const uint8_t flags_type;
+  /* Base-2 logarithm of the size in bytes of the trie blocks, or 0 for the default of 16 bytes.
+     This fits in the padding after flags_type, so the layout is the same as before. */
+  const uint8_t block_bits;
 } flags_v1_t;
 
 typedef struct {
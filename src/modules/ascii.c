@@ -109,6 +109,36 @@ static transcript_error_t from_unicode_conversion(converter_state_t *handle, cha
 	return TRANSCRIPT_SUCCESS;
 }
 
+/** get_info implementation for ISO-8859-1/ASCII converters. */
+static void get_info_ascii(const converter_state_t *handle, transcript_info_t *info) {
+	(void) handle;
+	info->flags = TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_ASCII_TRANSPARENT |
+		TRANSCRIPT_INFO_SELF_SYNCHRONIZING | TRANSCRIPT_INFO_SBCS;
+	info->max_char_bytes = 1;
+	info->max_from_unicode_bytes = 1;
+	info->max_to_unicode_codepoints = 1;
+}
+
+/** get_encodable implementation for ISO-8859-1/ASCII converters. */
+static void get_encodable_ascii(converter_state_t *handle, uint32_t *bits) {
+	uint_fast32_t codepoint;
+
+	for (codepoint = 0; codepoint <= handle->charmax; codepoint++)
+		SET_ENCODABLE(bits, codepoint);
+}
+
+/** clone implementation for ISO-8859-1/ASCII converters. */
+static transcript_t *clone_ascii(const converter_state_t *handle, transcript_error_t *error) {
+	converter_state_t *retval;
+
+	if ((retval = transcript_clone_handle_nolock(&handle->common, sizeof(converter_state_t))) == NULL) {
+		if (error != NULL)
+			*error = TRANSCRIPT_OUT_OF_MEMORY;
+		return NULL;
+	}
+	return &retval->common;
+}
+
 /** @internal
     @brief Open an ISO-8859-1/ASCII converter.
 */
@@ -123,7 +153,7 @@ static void *open_ascii(const char *name, transcript_utf_t utf_type, int flags,
 		return NULL;
 	}
 
-	if ((retval = malloc(sizeof(converter_state_t))) == 0) {
+	if ((retval = transcript_alloc_handle_nolock(sizeof(converter_state_t))) == NULL) {
 		if (error != NULL)
 			*error = TRANSCRIPT_OUT_OF_MEMORY;
 		return NULL;
@@ -137,16 +167,20 @@ static void *open_ascii(const char *name, transcript_utf_t utf_type, int flags,
 	retval->common.reset_to = NULL;
 	retval->common.flags = flags;
 	retval->common.close = NULL;
+	retval->common.clone = (clone_func_t) clone_ascii;
 	retval->common.save = NULL;
 	retval->common.load = NULL;
+	retval->common.get_info = (info_func_t) get_info_ascii;
+	retval->common.get_encodable = (encodable_func_t) get_encodable_ascii;
+	retval->common.shared_size = SHARED_HANDLE_IMMUTABLE;
 	retval->charmax = strcmp(name, "ascii") == 0 ? 0x7f : 0xff;
 	return retval;
 }
 
 TRANSCRIPT_ALIAS_OPEN(open_ascii, ascii)
 TRANSCRIPT_ALIAS_OPEN(open_ascii, iso88591)
-TRANSCRIPT_EXPORT int transcript_get_iface_ascii(void) { return TRANSCRIPT_FULL_MODULE_V1; }
-TRANSCRIPT_EXPORT int transcript_get_iface_iso88591(void) { return TRANSCRIPT_FULL_MODULE_V1; }
+TRANSCRIPT_EXPORT int transcript_get_iface_ascii(void) { return TRANSCRIPT_FULL_MODULE_V2; }
+TRANSCRIPT_EXPORT int transcript_get_iface_iso88591(void) { return TRANSCRIPT_FULL_MODULE_V2; }
 
 TRANSCRIPT_EXPORT const char * const *transcript_namelist_ascii(void) {
 	static const char * const namelist[] = { "ascii", "iso-8859-1", NULL };
@@ -14,11 +14,14 @@
 
 #include <string.h>
 #include <search.h>
+#include <pthread.h>
 
 #include <transcript/static_assert.h>
 #include <transcript/moduledefs.h>
 
 #define NR_OF_PLANES 16
+/** Number of characters in a 94x94 plane. */
+#define PLANE_SIZE (94 * 94)
 
 static const char *plane_names_2004[NR_OF_PLANES] = {
 	"ASCII",
@@ -66,17 +69,52 @@ static const char *plane_names_1992[NR_OF_PLANES] = {
 	"CNS-11643-1992-F"
 };
 
+enum {
+	FROM_INDEX_MAPPED = (1<<0),
+	FROM_INDEX_FALLBACK = (1<<1)
+};
+
+/** Entry in the from-Unicode index. */
+typedef struct {
+	uint8_t flags; /**< Combination of FROM_INDEX_* flags, or 0 if the codepoint is not in the index. */
+	uint8_t plane; /**< The plane in which the codepoint is encoded. */
+	uint8_t bytes[2]; /**< The (7-bit) bytes for the codepoint in @a plane. */
+} from_index_entry_t;
+
+/** Data shared between all converters using the same set of planes.
+
+    The to-Unicode tables contain, for each plane, the codepoint for all characters
+    which map to a single codepoint without requiring any of the conversion flags.
+    A value of 0 means the character has to be converted by the plane converter.
+    The from-Unicode index contains the plane and bytes of all codepoints for which
+    the first plane that encodes the codepoint does so with a single character.
+    Codepoints which are not in either table are converted by trying the plane
+    converters in order.
+*/
+typedef struct {
+	int refcount;
+	uint32_t *to_tables[NR_OF_PLANES];
+	from_index_entry_t *from_index[0x110000 >> 8];
+} shared_t;
+
+static shared_t shared_2004, shared_1992;
+/** Lock protecting the reference counts of the ::shared_t structures. */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct {
 	transcript_t common;
 	transcript_t *planes[NR_OF_PLANES];
+	shared_t *shared;
 } converter_handle_t;
 
 static void close_converter(converter_handle_t *handle);
+static transcript_t *clone_euctw(const converter_handle_t *handle, transcript_error_t *error);
+static void get_info_euctw(const converter_handle_t *handle, transcript_info_t *info);
 
 /** Simplification macro for calling put_unicode which returns automatically on error. */
-#define PUT_UNICODE(codepoint) do { int result; \
-	if ((result = handle->common.put_unicode(codepoint, outbuf, outbuflimit)) != TRANSCRIPT_SUCCESS) \
-		return result; \
+#define PUT_UNICODE(codepoint) do { int _put_result; \
+	if ((_put_result = handle->common.put_unicode(codepoint, outbuf, outbuflimit)) != TRANSCRIPT_SUCCESS) \
+		return _put_result; \
 } while (0)
 
 /** convert_to implementation for EUC-TW converter. */
@@ -121,6 +159,9 @@ static int to_unicode_conversion(converter_handle_t *handle, const uint8_t **inb
 				if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED))
 					return TRANSCRIPT_UNASSIGNED;
 				PUT_UNICODE(UINT32_C(0xfffd));
+			} else if (handle->shared->to_tables[plane][((*inbuf)[lead_bytes] - 0xa1) * 94 + (*inbuf)[lead_bytes + 1] - 0xa1] != 0) {
+				PUT_UNICODE(handle->shared->to_tables[plane][((*inbuf)[lead_bytes] - 0xa1) * 94 + (*inbuf)[lead_bytes + 1] - 0xa1]);
+				(*inbuf) += lead_bytes + 2;
 			} else {
 				conversion_bytes[0] = (*inbuf)[lead_bytes] & 0x7f;
 				conversion_bytes[1] = (*inbuf)[lead_bytes + 1] & 0x7f;
@@ -191,6 +232,17 @@ static transcript_error_t to_unicode_skip(converter_handle_t *handle, const uint
 	return TRANSCRIPT_SUCCESS;
 }
 
+/** Look up a codepoint in the from-Unicode index.
+    @return The entry for @a codepoint, or @c NULL if the codepoint is not in the index.
+*/
+static const from_index_entry_t *lookup_from_index(const shared_t *shared, uint_fast32_t codepoint) {
+	const from_index_entry_t *block;
+
+	if (codepoint > UINT32_C(0x10ffff) || (block = shared->from_index[codepoint >> 8]) == NULL)
+		return NULL;
+	return block[codepoint & 0xff].flags != 0 ? &block[codepoint & 0xff] : NULL;
+}
+
 /** convert_from implementation for EUC-TW converter. */
 static transcript_error_t from_unicode_conversion(converter_handle_t *handle, const char **inbuf, const char *inbuflimit,
 		char **outbuf, const char *outbuflimit, int flags)
@@ -203,8 +255,40 @@ static transcript_error_t from_unicode_conversion(converter_handle_t *handle, co
 	int internal_flags;
 	int fallback_converter;
 	int i;
+	/* Multi-mappings which are only used with TRANSCRIPT_NO_1N_CONVERSION or
+	   TRANSCRIPT_NO_MN_CONVERSION are not reflected in the index. */
+	bool_t use_index = !(flags & (TRANSCRIPT_NO_1N_CONVERSION | TRANSCRIPT_NO_MN_CONVERSION));
 
 	while (*inbuf < inbuflimit) {
+		if (use_index) {
+			const from_index_entry_t *entry;
+			const char *tmp_inbuf = *inbuf;
+
+			if ((entry = lookup_from_index(handle->shared, handle->common.get_unicode(&tmp_inbuf, inbuflimit, FALSE))) != NULL &&
+					(!(entry->flags & FROM_INDEX_FALLBACK) || (flags & TRANSCRIPT_ALLOW_FALLBACK)))
+			{
+				if (entry->plane == 0) {
+					if (*outbuf == outbuflimit)
+						return TRANSCRIPT_NO_SPACE;
+					*(*outbuf)++ = entry->bytes[0];
+				} else if (entry->plane == 1) {
+					if (outbuflimit - *outbuf < 2)
+						return TRANSCRIPT_NO_SPACE;
+					*(*outbuf)++ = entry->bytes[0] | 0x80;
+					*(*outbuf)++ = entry->bytes[1] | 0x80;
+				} else {
+					if (outbuflimit - *outbuf < 4)
+						return TRANSCRIPT_NO_SPACE;
+					*(*outbuf)++ = 0x8e;
+					*(*outbuf)++ = 0xa0 + entry->plane;
+					*(*outbuf)++ = entry->bytes[0] | 0x80;
+					*(*outbuf)++ = entry->bytes[1] | 0x80;
+				}
+				*inbuf = tmp_inbuf;
+				continue;
+			}
+		}
+
 		fallback_converter = -1;
 		for (i = 0; i < NR_OF_PLANES; i++) {
 			if (handle->planes[i] == NULL)
@@ -273,25 +357,181 @@ static transcript_error_t from_unicode_conversion(converter_handle_t *handle, co
 	return TRANSCRIPT_SUCCESS;
 }
 
+/** Free the tables in a ::shared_t. */
+static void free_shared(shared_t *shared) {
+	size_t i;
+
+	for (i = 0; i < NR_OF_PLANES; i++) {
+		free(shared->to_tables[i]);
+		shared->to_tables[i] = NULL;
+	}
+	for (i = 0; i < TRANSCRIPT_ARRAY_SIZE(shared->from_index); i++) {
+		free(shared->from_index[i]);
+		shared->from_index[i] = NULL;
+	}
+}
+
+/** Add a codepoint to the from-Unicode index.
+    @param planes UTF-32 converters for all planes.
+    @return FALSE if memory could not be allocated, TRUE otherwise.
+
+    The planes are tried in the same order as the from-Unicode conversion does, such
+    that the index gives the same results as trying each plane in turn.
+*/
+static bool_t add_to_from_index(shared_t *shared, transcript_t **planes, uint32_t codepoint) {
+	from_index_entry_t *entry;
+	uint_fast8_t fallback_plane = 0;
+	bool_t fallback_found = FALSE;
+	const char *codepoint_ptr;
+	char bytes[4], *bytes_ptr;
+	int i;
+
+	if (shared->from_index[codepoint >> 8] == NULL &&
+			(shared->from_index[codepoint >> 8] = calloc(256, sizeof(from_index_entry_t))) == NULL)
+		return FALSE;
+
+	entry = &shared->from_index[codepoint >> 8][codepoint & 0xff];
+	if (entry->flags != 0)
+		return TRUE;
+
+	for (i = 0; i < NR_OF_PLANES; i++) {
+		if (planes[i] == NULL)
+			continue;
+
+		/* Multi-mappings which start with codepoint will make the conversion return
+		   TRANSCRIPT_INCOMPLETE, as we don't pass TRANSCRIPT_END_OF_TEXT. Such codepoints
+		   are left to the plane converters. */
+		codepoint_ptr = (const char *) &codepoint;
+		bytes_ptr = bytes;
+		switch (planes[i]->convert_from(planes[i], &codepoint_ptr, codepoint_ptr + 4, &bytes_ptr, bytes + sizeof(bytes),
+				TRANSCRIPT_SINGLE_CONVERSION))
+		{
+			case TRANSCRIPT_SUCCESS:
+				break;
+			case TRANSCRIPT_UNASSIGNED:
+				continue;
+			case TRANSCRIPT_FALLBACK:
+				if (!fallback_found) {
+					fallback_found = TRUE;
+					fallback_plane = i;
+				}
+				continue;
+			default:
+				return TRUE;
+		}
+		if (bytes_ptr - bytes != (i == 0 ? 1 : 2))
+			return TRUE;
+		entry->flags = FROM_INDEX_MAPPED;
+		entry->plane = i;
+		memcpy(entry->bytes, bytes, bytes_ptr - bytes);
+		return TRUE;
+	}
+
+	if (!fallback_found)
+		return TRUE;
+
+	codepoint_ptr = (const char *) &codepoint;
+	bytes_ptr = bytes;
+	if (planes[fallback_plane]->convert_from(planes[fallback_plane], &codepoint_ptr, codepoint_ptr + 4, &bytes_ptr,
+			bytes + sizeof(bytes), TRANSCRIPT_SINGLE_CONVERSION | TRANSCRIPT_ALLOW_FALLBACK) != TRANSCRIPT_SUCCESS ||
+			bytes_ptr - bytes != (fallback_plane == 0 ? 1 : 2))
+		return TRUE;
+	entry->flags = FROM_INDEX_MAPPED | FROM_INDEX_FALLBACK;
+	entry->plane = fallback_plane;
+	memcpy(entry->bytes, bytes, bytes_ptr - bytes);
+	return TRUE;
+}
+
+/** Build the to-Unicode tables and the from-Unicode index for a set of planes.
+
+    The tables are built by enumerating all characters of all planes, using
+    separate UTF-32 converters. This way the result can be shared by all
+    converters using the same set of planes, regardless of their UTF type.
+*/
+static bool_t build_shared(shared_t *shared, const char **plane_names, transcript_error_t *error) {
+	const transcript_allocator_t *previous;
+	transcript_t *planes[NR_OF_PLANES];
+	bool_t success = FALSE;
+	uint32_t codepoint;
+	int i, j;
+
+	/* These converters are not part of the handle being opened, so they must not use its allocator. */
+	memset(planes, 0, sizeof(planes));
+	previous = _transcript_set_allocator(NULL);
+	for (i = 0; i < NR_OF_PLANES; i++) {
+		if (plane_names[i] == NULL)
+			continue;
+		if ((planes[i] = transcript_open_converter_nolock(plane_names[i], TRANSCRIPT_UTF32, TRANSCRIPT_INTERNAL, error)) == NULL)
+			break;
+	}
+	_transcript_set_allocator(previous);
+	if (i < NR_OF_PLANES)
+		goto end;
+
+	for (codepoint = 0; codepoint < 0x80; codepoint++) {
+		if (!add_to_from_index(shared, planes, codepoint))
+			goto end_oom;
+	}
+
+	for (i = 1; i < NR_OF_PLANES; i++) {
+		if (planes[i] == NULL)
+			continue;
+		if ((shared->to_tables[i] = calloc(PLANE_SIZE, sizeof(uint32_t))) == NULL)
+			goto end_oom;
+
+		for (j = 0; j < PLANE_SIZE; j++) {
+			uint32_t codepoints[2];
+			char bytes[2], *codepoints_ptr = (char *) codepoints;
+			const char *bytes_ptr = bytes;
+
+			bytes[0] = 0x21 + j / 94;
+			bytes[1] = 0x21 + j % 94;
+			if (planes[i]->convert_to(planes[i], &bytes_ptr, bytes + 2, &codepoints_ptr,
+					(char *) (codepoints + TRANSCRIPT_ARRAY_SIZE(codepoints)), 0) != TRANSCRIPT_SUCCESS ||
+					bytes_ptr != bytes + 2 || codepoints_ptr != (char *) (codepoints + 1))
+				continue;
+
+			shared->to_tables[i][j] = codepoints[0];
+			if (codepoints[0] <= UINT32_C(0x10ffff) && !add_to_from_index(shared, planes, codepoints[0]))
+				goto end_oom;
+		}
+	}
+	success = TRUE;
+	goto end;
+
+end_oom:
+	if (error != NULL)
+		*error = TRANSCRIPT_OUT_OF_MEMORY;
+end:
+	for (i = 0; i < NR_OF_PLANES; i++)
+		transcript_close_converter_nolock(planes[i]);
+	if (!success)
+		free_shared(shared);
+	return success;
+}
+
 /** @internal
     @brief Open the EUC-TW converter.
 */
 static void *open_euctw(const char *name, transcript_utf_t utf_type, int flags, transcript_error_t *error) {
 	converter_handle_t *retval;
 	const char **plane_names;
+	shared_t *shared;
 	int i;
 
 	if (strcmp(name, "euctw2004") == 0) {
 		plane_names = plane_names_2004;
+		shared = &shared_2004;
 	} else if (strcmp(name, "euctw") == 0 || strcmp(name, "euctw1992") == 0) {
 		plane_names = plane_names_1992;
+		shared = &shared_1992;
 	} else {
 		if (error != NULL)
 			*error = TRANSCRIPT_INTERNAL_ERROR;
 		return NULL;
 	}
 
-	if ((retval = malloc(sizeof(converter_handle_t))) == NULL) {
+	if ((retval = transcript_alloc_handle_nolock(sizeof(converter_handle_t))) == NULL) {
 		if (error != NULL)
 			*error = TRANSCRIPT_OUT_OF_MEMORY;
 		return NULL;
@@ -306,11 +546,25 @@ static void *open_euctw(const char *name, transcript_utf_t utf_type, int flags,
 		if ((retval->planes[i] = transcript_open_converter_nolock(plane_names[i], utf_type, TRANSCRIPT_INTERNAL, error)) == NULL) {
 			for (i--; i >= 0; i--)
 				transcript_close_converter_nolock(retval->planes[i]);
-			free(retval);
+			transcript_handle_free(&retval->common, retval);
 			return NULL;
 		}
 	}
 
+	/* The first converter for a set of planes builds the tables shared by all
+	   converters for that set of planes. */
+	pthread_mutex_lock(&shared_lock);
+	if (shared->refcount == 0 && !build_shared(shared, plane_names, error)) {
+		pthread_mutex_unlock(&shared_lock);
+		for (i = 0; i < NR_OF_PLANES; i++)
+			transcript_close_converter_nolock(retval->planes[i]);
+		transcript_handle_free(&retval->common, retval);
+		return NULL;
+	}
+	shared->refcount++;
+	pthread_mutex_unlock(&shared_lock);
+	retval->shared = shared;
+
 	retval->common.convert_from = (conversion_func_t) from_unicode_conversion;
 	retval->common.flush_from = NULL;
 	retval->common.reset_from = NULL;
@@ -319,12 +573,56 @@ static void *open_euctw(const char *name, transcript_utf_t utf_type, int flags,
 	retval->common.reset_to = NULL;
 	retval->common.flags = flags;
 	retval->common.close = (close_func_t) close_converter;
+	retval->common.clone = (clone_func_t) clone_euctw;
 	retval->common.save = NULL;
 	retval->common.load = NULL;
+	retval->common.get_info = (info_func_t) get_info_euctw;
+	retval->common.get_encodable = NULL;
+	/* The plane converters have their own state, which changes during conversions. */
+	retval->common.shared_size = 0;
 
 	return retval;
 }
 
+/** get_info implementation for EUC-TW converters. */
+static void get_info_euctw(const converter_handle_t *handle, transcript_info_t *info) {
+	(void) handle;
+	/* The bytes of the double byte characters are also used as trail bytes of
+	   the four byte characters, so EUC-TW is not self-synchronizing. */
+	info->flags = TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_ASCII_TRANSPARENT;
+	info->max_char_bytes = 4;
+	info->max_from_unicode_bytes = 4;
+	info->max_to_unicode_codepoints = 1;
+}
+
+/** clone implementation for EUC-TW converters. */
+static transcript_t *clone_euctw(const converter_handle_t *handle, transcript_error_t *error) {
+	converter_handle_t *retval;
+	int i;
+
+	if ((retval = transcript_clone_handle_nolock(&handle->common, sizeof(converter_handle_t))) == NULL) {
+		if (error != NULL)
+			*error = TRANSCRIPT_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	for (i = 0; i < NR_OF_PLANES; i++) {
+		if (handle->planes[i] == NULL)
+			continue;
+		if ((retval->planes[i] = transcript_clone_converter_nolock(handle->planes[i], error)) == NULL) {
+			for (i--; i >= 0; i--)
+				transcript_close_converter_nolock(retval->planes[i]);
+			transcript_handle_free(&retval->common, retval);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&shared_lock);
+	retval->shared->refcount++;
+	pthread_mutex_unlock(&shared_lock);
+	return &retval->common;
+}
+
 static bool_t probe_euctw(const char *name) {
 	const char **plane_names;
 	int i;
@@ -345,12 +643,16 @@ static bool_t probe_euctw(const char *name) {
 	return TRUE;
 }
 
-/** close implementation for ISO-2022 converters. */
+/** close implementation for EUC-TW converters. */
 static void close_converter(converter_handle_t *handle) {
 	int i;
 	for (i = 0; i < NR_OF_PLANES; i++)
 		transcript_close_converter(handle->planes[i]);
-	free(handle);
+
+	pthread_mutex_lock(&shared_lock);
+	if (--handle->shared->refcount == 0)
+		free_shared(handle->shared);
+	pthread_mutex_unlock(&shared_lock);
 }
 
 TRANSCRIPT_EXPORT const char * const *transcript_namelist_euctw(void) {
@@ -363,7 +665,7 @@ TRANSCRIPT_EXPORT const char * const *transcript_namelist_euctw(void) {
 #define DEFINE_INTERFACE(name) \
 TRANSCRIPT_ALIAS_OPEN(open_euctw, name) \
 TRANSCRIPT_ALIAS_PROBE(probe_euctw, name) \
-TRANSCRIPT_EXPORT int transcript_get_iface_##name(void) { return TRANSCRIPT_FULL_MODULE_V1; }
+TRANSCRIPT_EXPORT int transcript_get_iface_##name(void) { return TRANSCRIPT_FULL_MODULE_V2; }
 
 DEFINE_INTERFACE(euctw)
 DEFINE_INTERFACE(euctw1992)
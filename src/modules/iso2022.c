@@ -21,6 +21,7 @@
 */
 #include <string.h>
 #include <search.h>
+#include <pthread.h>
 
 #include <transcript/static_assert.h>
 #include <transcript/moduledefs.h>
@@ -80,19 +81,95 @@ static const name_to_iso2022type map[] = {
 };
 
 
+/** @struct stc_descriptor_t
+    Structure holding the information needed to instantiate a state table converter. */
+typedef struct {
+	const char *name;
+	uint_fast8_t bytes_per_char;
+	char final_byte;
+	uint_fast8_t flags;
+} stc_descriptor_t;
+
 typedef struct _transcript_iso2022_stc_handle_t stc_handle_t;
 
 /** Struct holding a state table converter and associated information. */
 struct _transcript_iso2022_stc_handle_t {
-	transcript_t *stc; /**< Handle for the table based converter. */
+	transcript_t *stc; /**< Handle for the table based converter, or @c NULL if not loaded yet. */
+	stc_descriptor_t *desc; /**< Descriptor used to load the table based converter. */
+	stc_handle_t *dup_of; /**< For duplicates, the set which owns the table based converter. */
 	uint_fast8_t bytes_per_char; /**< Bytes per character code. */
 	uint_fast8_t seq_len; /**< Length of the escape sequence used to shift. */
 	char escape_seq[7]; /**< The escape sequence itselft. */
 	uint_fast8_t flags; /**< Flags indicating how to use the state table converter. */
 	uint_fast8_t g; /**< Which graphics set should this be loaded into. */
+	uint_fast8_t index_pos; /**< Position of this set in converter_handle_t::write_sets, or NO_INDEX_POS. */
+	uint_fast8_t pos; /**< Position of this set in converter_handle_t::sets. */
 	stc_handle_t *prev, *next; /**< Doubly-linked list ptrs. */
 };
 
+/** Maximum number of sets which can be loaded for a single converter. */
+#define MAX_SETS 32
+/** Maximum number of output sets which can be recorded in a ::from_index_t. */
+#define MAX_INDEX_SETS 16
+/** Value of stc_handle_t::index_pos for sets which are not part of the ::from_index_t. */
+#define NO_INDEX_POS 0xff
+
+/** @struct from_index_entry_t
+    Structure holding the from-Unicode conversion of a single codepoint. */
+typedef struct {
+	uint16_t sets; /**< Mask of all sets which can encode the codepoint, or 0 if not indexed. */
+	uint8_t set; /**< Position of the first set in converter_handle_t::write_sets which can encode the codepoint. */
+	uint8_t len; /**< Number of bytes in @ bytes. */
+	uint8_t bytes[2]; /**< The bytes encoding the codepoint in @a set. */
+} from_index_entry_t;
+
+/** @struct from_index_t
+    Structure holding the merged from-Unicode index over all output sets of an ISO-2022 converter.
+
+    The index is a two-level table mapping each codepoint to the first output set
+    (in the order of the g_sets list) which can encode it, and the bytes in that
+    set. This allows the from-Unicode conversion to select the set to switch to
+    with a single look-up, rather than trying each output set in turn.
+*/
+typedef struct {
+	from_index_entry_t *blocks[0x110000 >> 8]; /**< Blocks of 256 entries, allocated on demand. */
+} from_index_t;
+
+/** Maximum number of nodes in the escape sequence trie. */
+#define MAX_ESCAPE_NODES 16
+
+/** @struct escape_node_t
+    Structure holding a node in the trie used for recognising escape sequences.
+
+    The root of the trie (index 0) corresponds to the ESC character. Escape
+    sequences consist of any number of intermediate bytes (0x20-0x2F) followed
+    by a single final byte (0x40-0x7F).
+*/
+typedef struct {
+	uint8_t next[16]; /**< Index of the next node for each intermediate byte, or 0 if there is none. */
+	uint8_t final[64]; /**< Position + 1 in converter_handle_t::sets of the set designated by each final byte, or 0. */
+} escape_node_t;
+
+/** @struct shared_t
+    Structure holding the data which is shared by all converters of the same ISO-2022 type.
+
+    The positions used in the escape sequence trie and the from-Unicode index refer to the
+    sets in the order in which they are loaded by do_load, which is the same for all
+    converters of a type. Access to the reference count, the table based converters and
+    publishing of the from-Unicode index is protected by ::shared_lock.
+
+    The table based converters in @a stcs are only used as templates. Converters
+    copy them when they first need a set, which does not require the library lock
+    (see load_stc).
+*/
+typedef struct {
+	int refcount; /**< Number of open converters using this structure. */
+	transcript_t *stcs[_TRANSCRIPT_UTFLAST][MAX_SETS]; /**< Table based converters by UTF type and set position. */
+	escape_node_t escape_nodes[MAX_ESCAPE_NODES]; /**< Trie for recognising escape sequences. */
+	uint_fast8_t nr_escape_nodes; /**< Number of used nodes in @a escape_nodes. */
+	from_index_t *from_index; /**< Merged from-Unicode index, or @c NULL if not built yet. */
+} shared_t;
+
 /** @struct state_t
     Structure holding the shift state of an ISO-2022 converter. */
 typedef struct {
@@ -125,21 +202,19 @@ struct converter_handle_t {
 	stc_handle_t *g_initial[4]; /**< Initial sets of the converter (for resetting purposes). */
 	stc_handle_t *g_sets; /**< Linked lists of possible tables. */
 	stc_handle_t *ascii; /**< The ASCII converter. */
+	stc_handle_t *sets[MAX_SETS]; /**< The sets in the order of the g_sets list. */
+	stc_handle_t *write_sets[MAX_INDEX_SETS]; /**< The output sets in the order of the g_sets list. */
+	uint_fast8_t nr_write_sets; /**< Number of sets in @a write_sets. */
 	reset_state_func_t reset_state; /**< Function called after a NL character is encountered. */
 	state_t state;
 	int iso2022_type;
 	int shift_types;
+	transcript_utf_t utf_type; /**< UTF type used for loading the table based converters. */
+	shared_t *shared; /**< Data shared with all other converters of the same type. */
+	const from_index_t *from_index; /**< Copy of shared_t::from_index, once it is available. */
+	bool_t from_index_done; /**< Whether @a from_index has been retrieved. */
 };
 
-/** @struct stc_descriptor_t
-    Structure holding the information needed to instantiate a state table converter. */
-typedef struct {
-	const char *name;
-	uint_fast8_t bytes_per_char;
-	char final_byte;
-	uint_fast8_t flags;
-} stc_descriptor_t;
-
 static stc_descriptor_t ascii = { "iso-2022-ascii", 1, '\x42', 0 };
 static stc_descriptor_t iso8859_1 = { "iso-2022-88591", 1, '\x41', STC_FLAG_LARGE_SET };
 static stc_descriptor_t jis_x_0201_1976_kana = { "iso-2022-jisx0201kana", 1, '\x49', 0 };
@@ -173,15 +248,23 @@ static stc_descriptor_t iso_ir_165 = { "ISO-IR-165", 2, '\x45', 0 };
 
 static const char *ls[] = { "\x0f", "\x0e", "\x1b\x6e", "\x1b\x6f", "\x1b\x4e", "\x1b\x4f" };
 
+/** Data shared by all converters of the same type, indexed by ISO-2022 type. */
+static shared_t shared[ISO2022_CNEXT + 1];
+/** Lock protecting the reference counts and from-Unicode indices in ::shared. */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void to_unicode_reset(converter_handle_t *handle);
 static void from_unicode_reset(converter_handle_t *handle);
 static void close_converter(converter_handle_t *handle);
+static transcript_t *clone_iso2022(const converter_handle_t *handle, transcript_error_t *error);
+static void get_info_iso2022(const converter_handle_t *handle, transcript_info_t *info);
 
 static void close_converter_internal(converter_handle_t *handle, bool_t lock);
 
 /** Check an escape sequence for validity within this converter. */
 static int check_escapes(converter_handle_t *handle, const uint8_t **inbuf, const uint8_t *inbuflimit, bool_t skip) {
-	stc_handle_t *ptr;
+	const escape_node_t *node = &handle->shared->escape_nodes[0];
+	stc_handle_t *stc;
 	const uint8_t *_inbuf = *inbuf + 1;
 
 	/* Limit the number of bytes to check to 5. No sequence that large has been
@@ -190,9 +273,14 @@ static int check_escapes(converter_handle_t *handle, const uint8_t **inbuf, cons
 		inbuflimit = (*inbuf) + 5;
 
 	for (; _inbuf < inbuflimit; _inbuf++) {
-		if (*_inbuf >= 0x20 && *_inbuf <= 0x2f)
+		if (*_inbuf >= 0x20 && *_inbuf <= 0x2f) {
+			/* Keep scanning after a mismatch, to find the end of the sequence. */
+			if (node != NULL)
+				node = node->next[*_inbuf - 0x20] == 0 ? NULL : &handle->shared->escape_nodes[node->next[*_inbuf - 0x20]];
 			continue;
+		}
 		if (*_inbuf >= 0x40 && *_inbuf <= 0x7f) {
+			stc = node == NULL || node->final[*_inbuf - 0x40] == 0 ? NULL : handle->sets[node->final[*_inbuf - 0x40] - 1];
 			_inbuf++;
 			goto sequence_found;
 		}
@@ -211,17 +299,8 @@ static int check_escapes(converter_handle_t *handle, const uint8_t **inbuf, cons
 
 sequence_found:
 	if (!skip) {
-		size_t len;
-
-		len = _inbuf - (*inbuf);
-		for (ptr = handle->g_sets; ptr != NULL; ptr = ptr->next) {
-			if (len != ptr->seq_len)
-				continue;
-
-			if (memcmp(*inbuf, ptr->escape_seq, ptr->seq_len) != 0)
-				continue;
-
-			handle->state.g_to[ptr->g] = ptr;
+		if (stc != NULL) {
+			handle->state.g_to[stc->g] = stc;
 			*inbuf = _inbuf;
 			return TRANSCRIPT_SUCCESS;
 		}
@@ -231,6 +310,120 @@ sequence_found:
 	return TRANSCRIPT_ILLEGAL;
 }
 
+/** Build the trie for recognising the escape sequences of all loaded sets.
+    @return FALSE if the trie requires more than ::MAX_ESCAPE_NODES nodes, TRUE otherwise.
+*/
+static bool_t build_escape_trie(converter_handle_t *handle, shared_t *shared_data) {
+	escape_node_t *node;
+	stc_handle_t *ptr;
+	uint_fast8_t i, byte, pos;
+
+	memset(shared_data->escape_nodes, 0, sizeof(shared_data->escape_nodes));
+	shared_data->nr_escape_nodes = 1;
+
+	for (ptr = handle->g_sets, pos = 0; ptr != NULL; ptr = ptr->next, pos++) {
+		node = &shared_data->escape_nodes[0];
+		for (i = 1; i < ptr->seq_len - 1; i++) {
+			byte = ptr->escape_seq[i] - 0x20;
+			if (node->next[byte] == 0) {
+				if (shared_data->nr_escape_nodes == MAX_ESCAPE_NODES)
+					return FALSE;
+				node->next[byte] = shared_data->nr_escape_nodes++;
+			}
+			node = &shared_data->escape_nodes[node->next[byte]];
+		}
+		/* If multiple sets use the same sequence, the first one in the list is used. */
+		byte = ptr->escape_seq[ptr->seq_len - 1] - 0x40;
+		if (node->final[byte] == 0)
+			node->final[byte] = pos + 1;
+	}
+	return TRUE;
+}
+
+/** Create a private copy of a table based converter.
+
+    The copy shares the tables of @a stc, which remain valid for as long as the
+    converter using the copy holds its reference to the ::shared_t. Converters
+    which do not change during a conversion are used directly. Copies are
+    allocated with malloc rather than the allocator of the converter, because
+    they are made during conversions, which ::transcript_converter_size does not
+    account for.
+*/
+static transcript_t *copy_stc(transcript_t *stc, transcript_error_t *error) {
+	transcript_t *result;
+
+	if (stc->shared_size == SHARED_HANDLE_IMMUTABLE)
+		return stc;
+	if (stc->shared_size == 0) {
+		if (error != NULL)
+			*error = TRANSCRIPT_INTERNAL_ERROR;
+		return NULL;
+	}
+	if ((result = malloc(stc->shared_size)) == NULL) {
+		if (error != NULL)
+			*error = TRANSCRIPT_OUT_OF_MEMORY;
+		return NULL;
+	}
+	memcpy(result, stc, stc->shared_size);
+	result->allocator = NULL;
+	return result;
+}
+
+/** Release a table based converter obtained through copy_stc. */
+static void free_stc(transcript_t *stc) {
+	if (stc->shared_size != SHARED_HANDLE_IMMUTABLE)
+		free(stc);
+}
+
+/** Load the table based converter for a set, if it has not been loaded yet.
+
+    The table based converters are only loaded when they are first needed for a
+    conversion, such that no per-handle memory is used for sets which never occur
+    in the text. Loading copies the converter for the set from the ::shared_t, so
+    it neither opens a converter nor takes the library lock. A failure can
+    therefore only be ::TRANSCRIPT_OUT_OF_MEMORY or ::TRANSCRIPT_INTERNAL_ERROR.
+*/
+static transcript_error_t load_stc(converter_handle_t *handle, stc_handle_t *stc) {
+	stc_handle_t *owner = stc->dup_of != NULL ? stc->dup_of : stc;
+	transcript_error_t error = TRANSCRIPT_INTERNAL_ERROR;
+	transcript_t *template_stc;
+
+	if (owner->stc == NULL) {
+		pthread_mutex_lock(&shared_lock);
+		template_stc = handle->shared->stcs[handle->utf_type][owner->pos];
+		pthread_mutex_unlock(&shared_lock);
+		if (template_stc == NULL || (owner->stc = copy_stc(template_stc, &error)) == NULL)
+			return error;
+	}
+	stc->stc = owner->stc;
+	return TRANSCRIPT_SUCCESS;
+}
+
+/** Simplification macro for calling load_stc, which returns automatically on error. */
+#define LOAD_STC(ptr) do { transcript_error_t _result; \
+	if ((ptr)->stc == NULL && (_result = load_stc(handle, (ptr))) != TRANSCRIPT_SUCCESS) \
+		return _result; \
+} while (0)
+
+/** Find the end of the run of graphic characters starting at @a inbuf.
+    @return A pointer to the first control character or byte with the high bit
+        set, or @a inbuflimit if there is none.
+*/
+static const uint8_t *find_run_end(const uint8_t *inbuf, const uint8_t *inbuflimit) {
+	uint64_t bytes;
+
+	/* Check eight bytes at a time. Subtracting 0x20 from each byte only sets the
+	   high bit of a byte (through a borrow) if there is a byte smaller than 0x20. */
+	for (; inbuflimit - inbuf >= 8; inbuf += 8) {
+		memcpy(&bytes, inbuf, 8);
+		if (((bytes - UINT64_C(0x2020202020202020)) | bytes) & UINT64_C(0x8080808080808080))
+			break;
+	}
+	while (inbuf < inbuflimit && *inbuf >= 0x20 && *inbuf < 0x80)
+		inbuf++;
+	return inbuf;
+}
+
 /** Simplification macro for calling put_unicode which returns automatically on error. */
 #define PUT_UNICODE(codepoint) do { int result; \
 	if ((result = handle->common.put_unicode(codepoint, outbuf, outbuflimit)) != TRANSCRIPT_SUCCESS) \
@@ -343,7 +536,16 @@ static int to_unicode_conversion(converter_handle_t *handle, const uint8_t **inb
 				return TRANSCRIPT_ILLEGAL;
 			}
 		} else {
-			int internal_flags = flags & ~(TRANSCRIPT_SUBST_ILLEGAL | TRANSCRIPT_SUBST_UNASSIGNED);
+			/* Pass the complete run of graphic characters to the converter for the
+			   current set in a single call. As the run does not contain any control
+			   characters, the converter can handle illegal sequences itself. */
+			const uint8_t *run_end = find_run_end(*inbuf, inbuflimit);
+			int internal_flags = flags & ~TRANSCRIPT_SUBST_UNASSIGNED;
+
+			/* A run which is terminated by a control character must not end in the
+			   middle of a character. */
+			if (run_end != inbuflimit)
+				internal_flags |= TRANSCRIPT_END_OF_TEXT;
 
 			state = handle->state.to;
 			if (state > 3) {
@@ -351,18 +553,12 @@ static int to_unicode_conversion(converter_handle_t *handle, const uint8_t **inb
 				internal_flags |= TRANSCRIPT_SINGLE_CONVERSION;
 			}
 
+			LOAD_STC(handle->state.g_to[state]);
 			if ((result = handle->state.g_to[state]->stc->convert_to(handle->state.g_to[state]->stc, (const char **) inbuf,
-					(const char *) inbuflimit, outbuf, outbuflimit, internal_flags)) != TRANSCRIPT_SUCCESS)
+					(const char *) run_end, outbuf, outbuflimit, internal_flags)) != TRANSCRIPT_SUCCESS)
 			{
-				if (result == TRANSCRIPT_ILLEGAL) {
-					if (**inbuf < 32)
-						continue;
-					if (!(flags & TRANSCRIPT_SUBST_ILLEGAL))
-						return TRANSCRIPT_ILLEGAL;
-					internal_flags |= TRANSCRIPT_SINGLE_CONVERSION | TRANSCRIPT_SUBST_ILLEGAL;
-					if ((result = handle->state.g_to[state]->stc->convert_to(handle->state.g_to[state]->stc, (const char **) inbuf,
-							(const char *) inbuflimit, outbuf, outbuflimit, internal_flags)) != TRANSCRIPT_SUCCESS)
-						return result;
+				if (result == TRANSCRIPT_ILLEGAL_END && run_end != inbuflimit) {
+					return TRANSCRIPT_ILLEGAL;
 				} else if (result == TRANSCRIPT_ILLEGAL_END || result == TRANSCRIPT_INCOMPLETE) {
 					goto incomplete_char;
 				} else if (result == TRANSCRIPT_UNASSIGNED && (flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
@@ -471,6 +667,177 @@ static transcript_error_t switch_to_set(converter_handle_t *handle, stc_handle_t
 		return TRANSCRIPT_NO_SPACE; \
 } while (0)
 
+/** Free a ::from_index_t and all its blocks. */
+static void free_from_index(from_index_t *index) {
+	size_t i;
+
+	if (index == NULL)
+		return;
+	for (i = 0; i < TRANSCRIPT_ARRAY_SIZE(index->blocks); i++)
+		free(index->blocks[i]);
+	free(index);
+}
+
+/** Convert a single codepoint using one of the output sets.
+    @param stc A UTF-32 table based converter for the output set.
+    @return The number of bytes written to @a buffer, or 0 if the set can not
+        encode @a codepoint (without using a fallback).
+*/
+static size_t probe_from_unicode(transcript_t *stc, uint32_t codepoint, char *buffer, size_t size) {
+	const char *codepoint_ptr = (const char *) &codepoint;
+	char *buffer_ptr = buffer;
+
+	/* Multi-mappings which start with codepoint will make the conversion return
+	   TRANSCRIPT_INCOMPLETE, as we don't pass TRANSCRIPT_END_OF_TEXT. Those codepoints
+	   are therefore never included in the index. */
+	if (stc->convert_from(stc, &codepoint_ptr, codepoint_ptr + sizeof(uint32_t),
+			&buffer_ptr, buffer + size, TRANSCRIPT_SINGLE_CONVERSION) != TRANSCRIPT_SUCCESS ||
+			codepoint_ptr != (const char *) (&codepoint + 1))
+		return 0;
+	return buffer_ptr - buffer;
+}
+
+/** Add a codepoint to a ::from_index_t.
+    @param stcs UTF-32 table based converters for all output sets, in order of preference.
+    @return FALSE if memory could not be allocated, TRUE otherwise.
+*/
+static bool_t add_to_from_index(from_index_t *index, transcript_t **stcs, uint_fast8_t nr_sets, uint_fast32_t codepoint) {
+	from_index_entry_t *entry;
+	char buffer[32];
+	size_t len;
+	uint_fast8_t i;
+
+	/* Control characters are handled separately by the from-Unicode conversion. */
+	if (codepoint < 0x20 || (codepoint >= 0x7f && codepoint < 0xa0) || codepoint > UINT32_C(0x10ffff))
+		return TRUE;
+
+	if (index->blocks[codepoint >> 8] == NULL &&
+			(index->blocks[codepoint >> 8] = calloc(256, sizeof(from_index_entry_t))) == NULL)
+		return FALSE;
+
+	entry = &index->blocks[codepoint >> 8][codepoint & 0xff];
+	if (entry->sets != 0)
+		return TRUE;
+
+	for (i = 0; i < nr_sets; i++) {
+		if ((len = probe_from_unicode(stcs[i], codepoint, buffer, sizeof(buffer))) == 0)
+			continue;
+
+		if (entry->sets == 0) {
+			/* Conversions which don't fit in the entry are left to the full search. */
+			if (len > sizeof(entry->bytes))
+				return TRUE;
+			entry->set = i;
+			entry->len = len;
+			memcpy(entry->bytes, buffer, len);
+		}
+		entry->sets |= 1 << i;
+	}
+	return TRUE;
+}
+
+/** Build the merged from-Unicode index for an ISO-2022 converter.
+
+    The candidate codepoints are found by converting every possible character
+    of each output set to Unicode. Each candidate is then converted back using
+    all output sets in order of preference, which ensures that the index gives
+    exactly the same results as trying each set in turn. Copies of the UTF-32
+    converters in the ::shared_t are used for this purpose, such that the result
+    can be shared by all converters of the same type, regardless of their UTF type.
+*/
+static from_index_t *build_from_index(converter_handle_t *handle) {
+	transcript_t *stcs[MAX_INDEX_SETS];
+	transcript_t *template_stc;
+	from_index_t *index;
+	uint_fast8_t i;
+
+	if ((index = calloc(1, sizeof(from_index_t))) == NULL)
+		return NULL;
+
+	memset(stcs, 0, sizeof(stcs));
+	for (i = 0; i < handle->nr_write_sets; i++) {
+		pthread_mutex_lock(&shared_lock);
+		template_stc = handle->shared->stcs[TRANSCRIPT_UTF32][handle->write_sets[i]->pos];
+		pthread_mutex_unlock(&shared_lock);
+		if (template_stc == NULL || (stcs[i] = copy_stc(template_stc, NULL)) == NULL)
+			goto error;
+	}
+
+	for (i = 0; i < handle->nr_write_sets; i++) {
+		uint_fast8_t low = handle->write_sets[i]->flags & STC_FLAG_LARGE_SET ? 0x20 : 0x21;
+		uint_fast8_t range = handle->write_sets[i]->flags & STC_FLAG_LARGE_SET ? 96 : 94;
+		uint_fast32_t count = handle->write_sets[i]->bytes_per_char > 1 ? range * range : range;
+		uint_fast32_t j;
+
+		for (j = 0; j < count; j++) {
+			uint32_t codepoints[8];
+			char bytes[2], *codepoints_ptr = (char *) codepoints;
+			const char *bytes_ptr = bytes;
+			uint32_t *codepoint_ptr;
+
+			bytes[0] = low + (handle->write_sets[i]->bytes_per_char > 1 ? j / range : j);
+			bytes[1] = low + j % range;
+			if (stcs[i]->convert_to(stcs[i], &bytes_ptr, bytes + handle->write_sets[i]->bytes_per_char, &codepoints_ptr,
+					(char *) (codepoints + TRANSCRIPT_ARRAY_SIZE(codepoints)), TRANSCRIPT_SINGLE_CONVERSION) != TRANSCRIPT_SUCCESS)
+				continue;
+
+			for (codepoint_ptr = codepoints; codepoint_ptr < (uint32_t *) codepoints_ptr; codepoint_ptr++) {
+				if (!add_to_from_index(index, stcs, handle->nr_write_sets, *codepoint_ptr))
+					goto error;
+			}
+		}
+	}
+
+	for (i = 0; i < handle->nr_write_sets; i++)
+		free_stc(stcs[i]);
+	return index;
+
+error:
+	for (i = 0; i < handle->nr_write_sets && stcs[i] != NULL; i++)
+		free_stc(stcs[i]);
+	free_from_index(index);
+	return NULL;
+}
+
+/** Retrieve the shared from-Unicode index, building it if necessary.
+
+    The index is built without holding ::shared_lock, because building it requires
+    converting all characters of all output sets. Should two converters build the
+    index at the same time, the first one to finish wins.
+*/
+static void get_from_index(converter_handle_t *handle) {
+	from_index_t *index = NULL;
+
+	pthread_mutex_lock(&shared_lock);
+	handle->from_index = handle->shared->from_index;
+	pthread_mutex_unlock(&shared_lock);
+	if (handle->from_index != NULL)
+		return;
+
+	if ((index = build_from_index(handle)) == NULL)
+		return;
+
+	pthread_mutex_lock(&shared_lock);
+	if (handle->shared->from_index == NULL) {
+		handle->shared->from_index = index;
+		index = NULL;
+	}
+	handle->from_index = handle->shared->from_index;
+	pthread_mutex_unlock(&shared_lock);
+	free_from_index(index);
+}
+
+/** Look up a codepoint in the merged from-Unicode index.
+    @return The entry for @a codepoint, or @c NULL if the codepoint is not in the index.
+*/
+static const from_index_entry_t *lookup_from_index(const from_index_t *index, uint_fast32_t codepoint) {
+	const from_index_entry_t *block;
+
+	if (codepoint > UINT32_C(0x10ffff) || (block = index->blocks[codepoint >> 8]) == NULL)
+		return NULL;
+	return block[codepoint & 0xff].sets != 0 ? &block[codepoint & 0xff] : NULL;
+}
+
 /** convert_from implementation for ISO-2022 converters. */
 static transcript_error_t from_unicode_conversion(converter_handle_t *handle, const char **inbuf, const char *inbuflimit,
 		char **outbuf, const char *outbuflimit, int flags)
@@ -493,6 +860,33 @@ static transcript_error_t from_unicode_conversion(converter_handle_t *handle, co
 
 	while ((const char *) _inbuf < inbuflimit) {
 		fallback_stc = NULL;
+
+		/* Multi-mappings which are only used with TRANSCRIPT_NO_1N_CONVERSION or
+		   TRANSCRIPT_NO_MN_CONVERSION are not reflected in the index. */
+		if (handle->from_index != NULL && !(flags & (TRANSCRIPT_NO_1N_CONVERSION | TRANSCRIPT_NO_MN_CONVERSION))) {
+			const from_index_entry_t *entry;
+			const char *tmp_inbuf = (const char *) _inbuf;
+
+			state = handle->state.from > 3 ? handle->state.from >> 2 : handle->state.from;
+			ptr = handle->state.g_from[state];
+			if ((entry = lookup_from_index(handle->from_index, handle->common.get_unicode(&tmp_inbuf, inbuflimit, FALSE))) != NULL) {
+				if (ptr == handle->write_sets[entry->set]) {
+					PUT_BYTES(entry->len, entry->bytes);
+					_inbuf = (const uint8_t *) tmp_inbuf;
+					goto converter_found;
+				} else if (ptr == NULL || ptr->index_pos == NO_INDEX_POS || !(entry->sets & (1 << ptr->index_pos))) {
+					/* The current set can not encode the character, so switch directly to
+					   the set found in the index. */
+					SWITCH_TO_SET(handle->write_sets[entry->set]);
+					PUT_BYTES(entry->len, entry->bytes);
+					_inbuf = (const uint8_t *) tmp_inbuf;
+					goto converter_found;
+				}
+				/* Otherwise the current set can encode the character as well. Keep using
+				   that set to prevent needless switching. */
+			}
+		}
+
 		/* Assume that most codepoints will come from the same character set, so just try to
 		   convert using that. If it succeeds, we're done. Otherwise, we need to search for
 		   the first set that does encode the character. */
@@ -503,8 +897,16 @@ static transcript_error_t from_unicode_conversion(converter_handle_t *handle, co
 			internal_flags |= TRANSCRIPT_SINGLE_CONVERSION;
 		}
 		ptr = handle->state.g_from[state];
-		switch ((result = ptr->stc->convert_from(ptr->stc, (const char **) &_inbuf, inbuflimit, outbuf, outbuflimit, internal_flags))) {
+		LOAD_STC(ptr);
+		result = ptr->stc->convert_from(ptr->stc, (const char **) &_inbuf, inbuflimit, outbuf, outbuflimit, internal_flags);
+		/* The characters before the one the current set stopped at have been written. */
+		*inbuf = (const char *) _inbuf;
+		switch (result) {
 			case TRANSCRIPT_SUCCESS:
+				/* If the set stopped before the end of the input without being limited to a single
+				   conversion, only an incomplete character remains. */
+				if (!(internal_flags & TRANSCRIPT_SINGLE_CONVERSION) && (const char *) _inbuf < inbuflimit)
+					return TRANSCRIPT_SUCCESS;
 				break;
 			case TRANSCRIPT_FALLBACK:
 				fallback_stc = ptr;
@@ -579,14 +981,23 @@ static transcript_error_t from_unicode_conversion(converter_handle_t *handle, co
 
 		if (result != TRANSCRIPT_SUCCESS) {
 			const char *tmp_inbuf;
+
+			if (!handle->from_index_done) {
+				get_from_index(handle);
+				handle->from_index_done = TRUE;
+			}
+
 			/* Search for a suitable character set. Note that if the conversion succeeded
-			   with the previously used character set, we never reach this point. */
+			   with the previously used character set, we never reach this point. Characters
+			   which are in the index have been handled above, so this is only reached for
+			   fallbacks, multi-mappings and unassigned characters. */
 			internal_flags = (flags & ~(TRANSCRIPT_ALLOW_FALLBACK | TRANSCRIPT_SUBST_ILLEGAL | TRANSCRIPT_SUBST_UNASSIGNED)) |
 				TRANSCRIPT_SINGLE_CONVERSION;
 			for (ptr = handle->g_sets; ptr != NULL; ptr = ptr->next) {
 				if (!(ptr->flags & STC_FLAG_WRITE))
 					continue;
 
+				LOAD_STC(ptr);
 				tmp_inbuf = *inbuf;
 				buffer_ptr = buffer;
 
@@ -622,6 +1033,7 @@ static transcript_error_t from_unicode_conversion(converter_handle_t *handle, co
 				if (!(flags & TRANSCRIPT_ALLOW_FALLBACK))
 					return TRANSCRIPT_FALLBACK;
 				SWITCH_TO_SET(fallback_stc);
+				_inbuf = (const uint8_t *) *inbuf;
 				switch (fallback_stc->stc->convert_from(fallback_stc->stc, (const char **) &_inbuf, inbuflimit, outbuf, outbuflimit,
 					flags | TRANSCRIPT_ALLOW_FALLBACK | TRANSCRIPT_SINGLE_CONVERSION))
 				{
@@ -712,17 +1124,19 @@ static void reset_state_jp2(converter_handle_t *handle) {
 	handle->state.g_from[2] = NULL;
 }
 
-/** Load a converter (as oposed to probing for it).
+/** Add a set to a converter (as oposed to probing for it).
 
-    Used internally to load the different converters used by ISO-2022.
+    Used internally to set up the different sets used by ISO-2022. The table based
+    converter for the set is only loaded when it is first needed (see load_stc).
 */
 static bool_t real_load(converter_handle_t *handle, stc_descriptor_t *desc, int g, transcript_error_t *error,
 		transcript_utf_t utf_type, uint_fast8_t flags)
 {
 	stc_handle_t *stc_handle, *extra_handle;
-	transcript_t *ext_handle;
 	uint_fast8_t idx = 0;
 
+	(void) utf_type;
+
 	flags |= desc->flags;
 
 	if ((flags & STC_FLAG_LARGE_SET) && g == 0) {
@@ -731,19 +1145,15 @@ static bool_t real_load(converter_handle_t *handle, stc_descriptor_t *desc, int
 		return FALSE;
 	}
 
-	ext_handle = transcript_open_converter_nolock(desc->name, utf_type, TRANSCRIPT_INTERNAL, error);
-
-	if (ext_handle == NULL)
-		return FALSE;
-
-	if ((stc_handle = malloc(sizeof(stc_handle_t))) == NULL) {
-		transcript_close_converter_nolock(ext_handle);
+	if ((stc_handle = transcript_handle_alloc(&handle->common, sizeof(stc_handle_t))) == NULL) {
 		if (error != NULL)
 			*error = TRANSCRIPT_OUT_OF_MEMORY;
 		return FALSE;
 	}
 
-	stc_handle->stc = ext_handle;
+	stc_handle->stc = NULL;
+	stc_handle->desc = desc;
+	stc_handle->dup_of = NULL;
 	stc_handle->bytes_per_char = desc->bytes_per_char;
 	stc_handle->escape_seq[idx++] = 0x1b;
 	if (desc->bytes_per_char > 1)
@@ -755,6 +1165,7 @@ static bool_t real_load(converter_handle_t *handle, stc_descriptor_t *desc, int
 	stc_handle->flags = flags;
 	stc_handle->prev = NULL;
 	stc_handle->g = g;
+	stc_handle->index_pos = NO_INDEX_POS;
 	stc_handle->next = handle->g_sets;
 	handle->g_sets = stc_handle;
 
@@ -762,14 +1173,13 @@ static bool_t real_load(converter_handle_t *handle, stc_descriptor_t *desc, int
 	   compliant escape sequence. Depending on the STC_FLAGS_SHORT_SEQ, either
 	   the short sequence or the long sequence is used for from-Unicode conversions. */
 	if (desc->final_byte < 0x43 && desc->bytes_per_char > 1) {
-		if ((extra_handle = malloc(sizeof(stc_handle_t))) == NULL) {
-			transcript_close_converter_nolock(ext_handle);
-			free(stc_handle);
+		if ((extra_handle = transcript_handle_alloc(&handle->common, sizeof(stc_handle_t))) == NULL) {
 			if (error != NULL)
 				*error = TRANSCRIPT_OUT_OF_MEMORY;
 			return FALSE;
 		}
 		memcpy(extra_handle, stc_handle, sizeof(stc_handle_t));
+		extra_handle->dup_of = stc_handle;
 		extra_handle->escape_seq[2] = desc->final_byte;
 		extra_handle->seq_len = 3;
 		if (flags & STC_FLAGS_SHORT_SEQ)
@@ -784,6 +1194,81 @@ static bool_t real_load(converter_handle_t *handle, stc_descriptor_t *desc, int
 	return TRUE;
 }
 
+/** Fill the position arrays of a converter from its g_sets list. */
+static bool_t init_positions(converter_handle_t *handle) {
+	stc_handle_t *ptr;
+	uint_fast8_t pos;
+
+	handle->nr_write_sets = 0;
+	for (ptr = handle->g_sets, pos = 0; ptr != NULL; ptr = ptr->next, pos++) {
+		if (pos == MAX_SETS)
+			return FALSE;
+		handle->sets[pos] = ptr;
+		ptr->pos = pos;
+		if (!(ptr->flags & STC_FLAG_WRITE))
+			continue;
+		if (handle->nr_write_sets == MAX_INDEX_SETS)
+			return FALSE;
+		ptr->index_pos = handle->nr_write_sets;
+		handle->write_sets[handle->nr_write_sets++] = ptr;
+	}
+	return TRUE;
+}
+
+/** Open the table based converters for all sets of a converter in the ::shared_t, if not open yet.
+
+    Must be called with the library lock and ::shared_lock held. This also checks
+    that all required tables are available, such that later conversions can only
+    fail to load a set if memory runs out.
+
+    All sets are opened, not only those designated by the text. Opening a set on
+    first designation would make conversions take the library lock, and could
+    make a conversion fail with any of the errors of opening a converter, such as
+    a missing table. The cost is paid by the first converter of each type and UTF
+    type only. Later converters of the same type only copy the sets they use.
+*/
+static bool_t open_shared_stcs(converter_handle_t *handle, shared_t *shared_data, transcript_utf_t utf_type,
+		transcript_error_t *error)
+{
+	const transcript_allocator_t *previous;
+	stc_handle_t *ptr;
+	bool_t success = TRUE;
+
+	/* The converters outlive the handle being opened, so they must not use its allocator. */
+	previous = _transcript_set_allocator(NULL);
+	for (ptr = handle->g_sets; ptr != NULL; ptr = ptr->next) {
+		if (ptr->dup_of != NULL || shared_data->stcs[utf_type][ptr->pos] != NULL)
+			continue;
+		if ((shared_data->stcs[utf_type][ptr->pos] = transcript_open_converter_nolock(ptr->desc->name, utf_type,
+				TRANSCRIPT_INTERNAL, error)) == NULL)
+		{
+			success = FALSE;
+			break;
+		}
+	}
+	_transcript_set_allocator(previous);
+	return success;
+}
+
+/** Close the table based converters in a ::shared_t, after the last converter using it has been closed.
+    @param stcs The converters, detached from the ::shared_t under ::shared_lock.
+    @param lock Whether the library lock must be acquired to close the converters.
+*/
+static void close_shared_stcs(transcript_t *stcs[_TRANSCRIPT_UTFLAST][MAX_SETS], bool_t lock) {
+	int i, j;
+
+	for (i = 0; i < _TRANSCRIPT_UTFLAST; i++) {
+		for (j = 0; j < MAX_SETS; j++) {
+			if (stcs[i][j] == NULL)
+				continue;
+			if (lock)
+				transcript_close_converter(stcs[i][j]);
+			else
+				transcript_close_converter_nolock(stcs[i][j]);
+		}
+	}
+}
+
 /** Probe the availability of a converter. */
 static bool_t probe(converter_handle_t *handle, stc_descriptor_t *desc, int g, transcript_error_t *error,
 		transcript_utf_t utf_type, uint_fast8_t flags)
@@ -950,12 +1435,16 @@ static void *open_iso2022(const char *name, transcript_utf_t utf_type, int flags
 		return NULL;
 	}
 
-	if ((retval = malloc(sizeof(converter_handle_t))) == NULL) {
+	if ((retval = transcript_alloc_handle_nolock(sizeof(converter_handle_t))) == NULL) {
 		if (error != NULL)
 			*error = TRANSCRIPT_OUT_OF_MEMORY;
 		return NULL;
 	}
 	retval->g_sets = NULL;
+	retval->shared = NULL;
+	retval->from_index = NULL;
+	retval->from_index_done = FALSE;
+	retval->utf_type = utf_type;
 	retval->g_initial[0] = NULL;
 	retval->g_initial[1] = NULL;
 	retval->g_initial[2] = NULL;
@@ -976,6 +1465,38 @@ static void *open_iso2022(const char *name, transcript_utf_t utf_type, int flags
 	retval->ascii = retval->g_sets;
 	retval->g_initial[0] = retval->ascii;
 
+	if (!init_positions(retval)) {
+		close_converter_internal(retval, FALSE);
+		if (error != NULL)
+			*error = TRANSCRIPT_INTERNAL_ERROR;
+		return NULL;
+	}
+
+	/* The first converter of a type builds the data shared by all converters of
+	   that type. The table based converters for all sets are opened for each UTF
+	   type in use, and for UTF-32, which is used to build the from-Unicode index
+	   (see open_shared_stcs). */
+	pthread_mutex_lock(&shared_lock);
+	if (!open_shared_stcs(retval, &shared[retval->iso2022_type], utf_type, error) ||
+			!open_shared_stcs(retval, &shared[retval->iso2022_type], TRANSCRIPT_UTF32, error))
+	{
+		pthread_mutex_unlock(&shared_lock);
+		close_converter_internal(retval, FALSE);
+		return NULL;
+	}
+	if (shared[retval->iso2022_type].refcount == 0) {
+		if (!build_escape_trie(retval, &shared[retval->iso2022_type])) {
+			pthread_mutex_unlock(&shared_lock);
+			close_converter_internal(retval, FALSE);
+			if (error != NULL)
+				*error = TRANSCRIPT_INTERNAL_ERROR;
+			return NULL;
+		}
+	}
+	shared[retval->iso2022_type].refcount++;
+	retval->shared = &shared[retval->iso2022_type];
+	pthread_mutex_unlock(&shared_lock);
+
 	retval->common.convert_from = (conversion_func_t) from_unicode_conversion;
 	retval->common.flush_from = (flush_func_t) from_unicode_flush;
 	retval->common.reset_from = (reset_func_t) from_unicode_reset;
@@ -984,14 +1505,120 @@ static void *open_iso2022(const char *name, transcript_utf_t utf_type, int flags
 	retval->common.reset_to = (reset_func_t) to_unicode_reset;
 	retval->common.flags = flags;
 	retval->common.close = (close_func_t) close_converter;
+	retval->common.clone = (clone_func_t) clone_iso2022;
 	retval->common.save = (save_load_func_t) save_iso2022_state;
 	retval->common.load = (save_load_func_t) load_iso2022_state;
+	retval->common.get_info = (info_func_t) get_info_iso2022;
+	retval->common.get_encodable = NULL;
+	retval->common.shared_size = 0;
 
 	to_unicode_reset(retval);
 	from_unicode_reset(retval);
 	return retval;
 }
 
+/** Find the set in a cloned converter corresponding to a set in the original converter. */
+static stc_handle_t *map_set(const converter_handle_t *handle, converter_handle_t *clone, uint_fast8_t nr_sets,
+		const stc_handle_t *stc)
+{
+	uint_fast8_t pos;
+
+	for (pos = 0; pos < nr_sets; pos++) {
+		if (handle->sets[pos] == stc)
+			return clone->sets[pos];
+	}
+	return NULL;
+}
+
+/** get_info implementation for ISO-2022 converters. */
+static void get_info_iso2022(const converter_handle_t *handle, transcript_info_t *info) {
+	stc_handle_t *ptr;
+	int bytes;
+
+	info->flags = 0;
+	info->max_char_bytes = 0;
+	info->max_from_unicode_bytes = 0;
+	info->max_to_unicode_codepoints = 1;
+	for (ptr = handle->g_sets; ptr != NULL; ptr = ptr->next) {
+		if (ptr->bytes_per_char > info->max_char_bytes)
+			info->max_char_bytes = ptr->bytes_per_char;
+		/* A codepoint may require the designation of a set, followed by a
+		   locking or single shift of at most two bytes. */
+		bytes = ptr->seq_len + 2 + ptr->bytes_per_char;
+		if (bytes > info->max_from_unicode_bytes)
+			info->max_from_unicode_bytes = bytes;
+	}
+}
+
+/** clone implementation for ISO-2022 converters. */
+static transcript_t *clone_iso2022(const converter_handle_t *handle, transcript_error_t *error) {
+	converter_handle_t *retval;
+	stc_handle_t *ptr, **tail;
+	uint_fast8_t nr_sets, pos;
+	int i;
+
+	if ((retval = transcript_clone_handle_nolock(&handle->common, sizeof(converter_handle_t))) == NULL) {
+		if (error != NULL)
+			*error = TRANSCRIPT_OUT_OF_MEMORY;
+		return NULL;
+	}
+	/* Make sure close_converter_internal only releases what has been copied so far. */
+	retval->g_sets = NULL;
+	retval->shared = NULL;
+
+	/* Copy the list of sets. The table based converters are copied below, once all
+	   sets exist, because duplicate sets share the converter of the set they duplicate. */
+	tail = &retval->g_sets;
+	for (ptr = handle->g_sets, nr_sets = 0; ptr != NULL; ptr = ptr->next, nr_sets++) {
+		if ((*tail = transcript_handle_alloc(&retval->common, sizeof(stc_handle_t))) == NULL) {
+			if (error != NULL)
+				*error = TRANSCRIPT_OUT_OF_MEMORY;
+			goto end_error;
+		}
+		memcpy(*tail, ptr, sizeof(stc_handle_t));
+		(*tail)->stc = NULL;
+		(*tail)->next = NULL;
+		retval->sets[nr_sets] = *tail;
+		tail = &(*tail)->next;
+	}
+
+	for (pos = 0; pos < nr_sets; pos++) {
+		ptr = retval->sets[pos];
+		ptr->dup_of = map_set(handle, retval, nr_sets, handle->sets[pos]->dup_of);
+		ptr->prev = map_set(handle, retval, nr_sets, handle->sets[pos]->prev);
+		if (!(ptr->flags & STC_FLAGS_DUPSTC) && handle->sets[pos]->stc != NULL &&
+				(ptr->stc = copy_stc(handle->sets[pos]->stc, error)) == NULL)
+			goto end_error;
+	}
+	for (pos = 0; pos < nr_sets; pos++) {
+		ptr = retval->sets[pos];
+		if ((ptr->flags & STC_FLAGS_DUPSTC) && handle->sets[pos]->stc != NULL)
+			ptr->stc = ptr->dup_of->stc;
+	}
+
+	for (i = 0; i < 4; i++) {
+		retval->g_initial[i] = map_set(handle, retval, nr_sets, handle->g_initial[i]);
+		retval->state.g_to[i] = map_set(handle, retval, nr_sets, handle->state.g_to[i]);
+		retval->state.g_from[i] = map_set(handle, retval, nr_sets, handle->state.g_from[i]);
+	}
+	retval->ascii = map_set(handle, retval, nr_sets, handle->ascii);
+	for (i = 0; i < retval->nr_write_sets; i++)
+		retval->write_sets[i] = map_set(handle, retval, nr_sets, handle->write_sets[i]);
+
+	if (handle->shared != NULL) {
+		pthread_mutex_lock(&shared_lock);
+		handle->shared->refcount++;
+		pthread_mutex_unlock(&shared_lock);
+		retval->shared = handle->shared;
+	}
+	return &retval->common;
+
+end_error:
+	close_converter_internal(retval, FALSE);
+	transcript_handle_free(&retval->common, retval);
+	return NULL;
+}
+
 static bool_t probe_iso2022(const char *name) {
 	name_to_iso2022type *ptr;
 	name_to_iso2022type key = { name, 0 };
@@ -1011,18 +1638,35 @@ static void close_converter(converter_handle_t *handle) {
 }
 
 static void close_converter_internal(converter_handle_t *handle, bool_t lock) {
+	transcript_t *stcs[_TRANSCRIPT_UTFLAST][MAX_SETS];
 	stc_handle_t *ptr, *next;
+	shared_t *shared_data;
+	bool_t last = FALSE;
 
 	for (ptr = handle->g_sets; ptr != NULL; ptr = next) {
-		if (!(ptr->flags & STC_FLAGS_DUPSTC)) {
-			if (lock)
-				transcript_close_converter(ptr->stc);
-			else
-				transcript_close_converter_nolock(ptr->stc);
-		}
+		if (!(ptr->flags & STC_FLAGS_DUPSTC) && ptr->stc != NULL)
+			free_stc(ptr->stc);
 		next = ptr->next;
-		free(ptr);
+		transcript_handle_free(&handle->common, ptr);
 	}
+
+	/* A converter which failed to open may have opened some of the table based
+	   converters without taking a reference. */
+	shared_data = handle->shared != NULL ? handle->shared : &shared[handle->iso2022_type];
+	pthread_mutex_lock(&shared_lock);
+	if (handle->shared == NULL ? shared_data->refcount == 0 : --shared_data->refcount == 0) {
+		free_from_index(shared_data->from_index);
+		shared_data->from_index = NULL;
+		memcpy(stcs, shared_data->stcs, sizeof(stcs));
+		memset(shared_data->stcs, 0, sizeof(shared_data->stcs));
+		last = TRUE;
+	}
+	pthread_mutex_unlock(&shared_lock);
+
+	/* The converters are closed without holding shared_lock, because closing them may
+	   require the library lock, which is acquired before shared_lock when opening. */
+	if (last)
+		close_shared_stcs(stcs, lock);
 }
 
 TRANSCRIPT_EXPORT const char * const *transcript_namelist_iso2022(void) {
@@ -1037,7 +1681,7 @@ TRANSCRIPT_EXPORT const char * const *transcript_namelist_iso2022(void) {
 #define DEFINE_INTERFACE(name) \
 TRANSCRIPT_ALIAS_OPEN(open_iso2022, name) \
 TRANSCRIPT_ALIAS_PROBE(probe_iso2022, name) \
-TRANSCRIPT_EXPORT int transcript_get_iface_##name(void) { return TRANSCRIPT_FULL_MODULE_V1; }
+TRANSCRIPT_EXPORT int transcript_get_iface_##name(void) { return TRANSCRIPT_FULL_MODULE_V2; }
 
 DEFINE_INTERFACE(iso2022jp)
 DEFINE_INTERFACE(iso2022jp1)
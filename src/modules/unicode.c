@@ -21,6 +21,7 @@
 #include "unicode.h"
 
 static_assert(sizeof(state_t) <= TRANSCRIPT_SAVE_STATE_SIZE);
+static_assert(sizeof(converter_state_t) <= SHARED_HANDLE_MAX);
 
 /** @internal
     @struct name_to_utftype
@@ -149,10 +150,53 @@ static transcript_error_t unicode_conversion(converter_state_t *handle, const ch
 	return TRANSCRIPT_SUCCESS;
 }
 
+/** Conversion function using a block conversion kernel.
+    @param kernel The block conversion kernel.
+    @param get_unicode The function to retrieve a Unicode codepoint from @a inbuf.
+    @param put_unicode The function to write a Unicode codepoint to @a outbuf.
+
+    Most characters are converted by @a kernel. Characters which it can not
+    handle, including illegal and incomplete sequences, are converted one at a time
+    by ::unicode_conversion.
+*/
+static transcript_error_t block_conversion(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+		char **outbuf, const char *outbuflimit, int flags, kernel_func_t kernel,
+		get_func_t get_unicode, put_func_t put_unicode)
+{
+	transcript_error_t result;
+
+	if (flags & TRANSCRIPT_SINGLE_CONVERSION)
+		return unicode_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags, get_unicode, put_unicode);
+
+	while ((result = kernel(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags)) == TRANSCRIPT_UNASSIGNED) {
+		if ((result = unicode_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit,
+				flags | TRANSCRIPT_SINGLE_CONVERSION, get_unicode, put_unicode)) != TRANSCRIPT_SUCCESS)
+			return result;
+	}
+	return result;
+}
+
+/** Retrieve the block conversion kernel for a pair of get and put functions.
+    @return The kernel, or @c NULL if there is no kernel for the combination.
+
+    The get and put functions may change between calls, for example when a byte order
+    mark is read, so the kernel is selected again if they differ from the cached ones.
+*/
+static kernel_func_t get_kernel(kernel_cache_t *cache, get_unicode_func_t get_unicode, put_unicode_func_t put_unicode) {
+	if (cache->get_unicode != get_unicode || cache->put_unicode != put_unicode) {
+		cache->get_unicode = get_unicode;
+		cache->put_unicode = put_unicode;
+		cache->kernel = _transcript_select_unicode_kernel(get_unicode, put_unicode);
+	}
+	return cache->kernel;
+}
+
 /** convert_to implementation for Unicode converters. */
 static transcript_error_t to_unicode_conversion(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
 		char **outbuf, const char *outbuflimit, int flags)
 {
+	kernel_func_t kernel;
+
 	if (flags & TRANSCRIPT_FILE_START) {
 		const uint8_t *_inbuf = (const uint8_t *) *inbuf;
 		if (handle->utf_type == TRANSCRIPT_UTF32 || handle->utf_type == TRANSCRIPT_UTF16) {
@@ -189,6 +233,15 @@ static transcript_error_t to_unicode_conversion(converter_state_t *handle, const
 		}
 	}
 
+	if (handle->utf_type == _TRANSCRIPT_GB18030)
+		return block_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags,
+			_transcript_to_unicode_gb18030, handle->to_get, put_common);
+	if (handle->utf_type == _TRANSCRIPT_UTF7)
+		return block_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags,
+			_transcript_to_unicode_utf7, handle->to_get, put_common);
+	if (handle->to_get == get_to_unicode && (kernel = get_kernel(&handle->to_kernel, handle->to_unicode_get,
+			handle->common.put_unicode)) != NULL)
+		return block_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags, kernel, handle->to_get, put_common);
 	return unicode_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags, handle->to_get, put_common);
 }
 
@@ -220,6 +273,8 @@ static void to_unicode_reset(converter_state_t *handle) {
 static int from_unicode_conversion(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
 		char **outbuf, const char *outbuflimit, int flags)
 {
+	kernel_func_t kernel;
+
 	if (inbuf == NULL || *inbuf == NULL)
 		return TRANSCRIPT_SUCCESS;
 
@@ -229,6 +284,15 @@ static int from_unicode_conversion(converter_state_t *handle, const char **inbuf
 			return TRANSCRIPT_NO_SPACE;
 	}
 
+	if (handle->utf_type == _TRANSCRIPT_GB18030)
+		return block_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags,
+			_transcript_from_unicode_gb18030, get_common, handle->from_put);
+	if (handle->utf_type == _TRANSCRIPT_UTF7)
+		return block_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags,
+			_transcript_from_unicode_utf7, get_common, handle->from_put);
+	if (handle->from_put == put_from_unicode && (kernel = get_kernel(&handle->from_kernel, handle->common.get_unicode,
+			handle->from_unicode_put)) != NULL)
+		return block_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags, kernel, get_common, handle->from_put);
 	return unicode_conversion(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags,
 		get_common, handle->from_put);
 }
@@ -251,6 +315,91 @@ static void load_state(converter_state_t *handle, void *state) {
 	memcpy(&handle->state, state, sizeof(state_t));
 }
 
+/** get_info implementation for Unicode converters. */
+static void get_info(const converter_state_t *handle, transcript_info_t *info) {
+	info->flags = TRANSCRIPT_INFO_ALL_UNICODE;
+	info->max_to_unicode_codepoints = 1;
+	switch (handle->utf_type) {
+		case TRANSCRIPT_UTF8:
+			info->flags |= TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_ASCII_TRANSPARENT |
+				TRANSCRIPT_INFO_SELF_SYNCHRONIZING;
+			info->max_char_bytes = 4;
+			info->max_from_unicode_bytes = 4;
+			break;
+		case _TRANSCRIPT_UTF8_LOOSE:
+		case _TRANSCRIPT_CESU8:
+			/* Both accept surrogate pairs encoded as two three byte sequences. */
+			info->flags |= TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_ASCII_TRANSPARENT |
+				TRANSCRIPT_INFO_SELF_SYNCHRONIZING;
+			info->max_char_bytes = 6;
+			info->max_from_unicode_bytes = handle->utf_type == _TRANSCRIPT_CESU8 ? 6 : 4;
+			break;
+		case _TRANSCRIPT_UTF8_BOM:
+			/* The BOM at the start of the output makes the converter stateful. */
+			info->flags |= TRANSCRIPT_INFO_SELF_SYNCHRONIZING;
+			info->max_char_bytes = 4;
+			info->max_from_unicode_bytes = 4;
+			break;
+		case TRANSCRIPT_UTF16BE:
+		case TRANSCRIPT_UTF16LE:
+			info->flags |= TRANSCRIPT_INFO_STATELESS;
+			/* FALLTHROUGH */
+		case TRANSCRIPT_UTF16:
+			info->max_char_bytes = 4;
+			info->max_from_unicode_bytes = 4;
+			break;
+		case TRANSCRIPT_UTF32BE:
+		case TRANSCRIPT_UTF32LE:
+			info->flags |= TRANSCRIPT_INFO_STATELESS;
+			/* FALLTHROUGH */
+		case TRANSCRIPT_UTF32:
+			info->max_char_bytes = 4;
+			info->max_from_unicode_bytes = 4;
+			break;
+		case _TRANSCRIPT_GB18030:
+			info->flags |= TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_ASCII_TRANSPARENT;
+			info->max_char_bytes = 4;
+			info->max_from_unicode_bytes = 4;
+			break;
+		default:
+			/* SCSU and UTF-7 have no fixed upper bound that is useful. */
+			info->max_char_bytes = 0;
+			info->max_from_unicode_bytes = 0;
+			break;
+	}
+}
+
+/** get_encodable implementation for Unicode converters. */
+static void get_encodable(converter_state_t *handle, uint32_t *bits) {
+	uint_fast32_t codepoint;
+
+	(void) handle;
+	/* All codepoints except the surrogates can be encoded. */
+	memset(bits, 0xff, ENCODABLE_WORDS * sizeof(uint32_t));
+	for (codepoint = UINT32_C(0xd800); codepoint <= UINT32_C(0xdfff); codepoint += 32)
+		bits[codepoint >> 5] = 0;
+}
+
+/** clone implementation for Unicode converters. */
+static transcript_t *clone_converter(const converter_state_t *handle, transcript_error_t *error) {
+	converter_state_t *retval;
+
+	if ((retval = transcript_clone_handle_nolock(&handle->common, sizeof(converter_state_t))) == NULL) {
+		if (error != NULL)
+			*error = TRANSCRIPT_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	if (retval->utf_type == _TRANSCRIPT_GB18030) {
+		if ((retval->gb18030_table_conv = transcript_clone_converter_nolock(handle->gb18030_table_conv, error)) == NULL) {
+			transcript_handle_free(&retval->common, retval);
+			return NULL;
+		}
+		_transcript_acquire_gb18030();
+	}
+	return &retval->common;
+}
+
 /** Compare function for lfind. */
 static int compare(const name_to_utftype *a, const name_to_utftype *b) {
 	return strcmp(a->name, b->name);
@@ -278,7 +427,7 @@ static transcript_t *open_unicode(const char *name, transcript_utf_t utf_type, i
 		return NULL;
 	}
 
-	if ((retval = malloc(sizeof(converter_state_t))) == 0) {
+	if ((retval = transcript_alloc_handle_nolock(sizeof(converter_state_t))) == NULL) {
 		if (error != NULL)
 			*error = TRANSCRIPT_OUT_OF_MEMORY;
 		return NULL;
@@ -292,10 +441,15 @@ static transcript_t *open_unicode(const char *name, transcript_utf_t utf_type, i
 	retval->common.reset_to = (reset_func_t) to_unicode_reset;
 	retval->common.flags = flags;
 	retval->common.close = NULL;
+	retval->common.clone = (clone_func_t) clone_converter;
 	retval->common.save = NULL;
 	retval->common.load = NULL;
+	retval->common.get_info = (info_func_t) get_info;
+	retval->common.get_encodable = (encodable_func_t) get_encodable;
 
 	retval->utf_type = ptr->utf_type;
+	memset(&retval->to_kernel, 0, sizeof(kernel_cache_t));
+	memset(&retval->from_kernel, 0, sizeof(kernel_cache_t));
 
 	switch (retval->utf_type) {
 		case TRANSCRIPT_UTF16:
@@ -347,11 +501,16 @@ static transcript_t *open_unicode(const char *name, transcript_utf_t utf_type, i
 			if ((retval->gb18030_table_conv = transcript_open_converter_nolock("gb18030table",
 					TRANSCRIPT_UTF32, flags | TRANSCRIPT_INTERNAL, error)) == NULL)
 			{
-				free(retval);
+				transcript_handle_free(&retval->common, retval);
 				return NULL;
 			}
 			retval->common.close = (close_func_t) close_converter;
 			retval->gb18030_table_conv->get_unicode = _transcript_get_get_unicode(_TRANSCRIPT_UTF32_NO_CHECK);
+			if (!_transcript_init_gb18030(retval, error)) {
+				transcript_close_converter_nolock(retval->gb18030_table_conv);
+				transcript_handle_free(&retval->common, retval);
+				return NULL;
+			}
 			retval->to_get = _transcript_get_gb18030;
 			retval->from_put = _transcript_put_gb18030;
 			break;
@@ -373,6 +532,10 @@ static transcript_t *open_unicode(const char *name, transcript_utf_t utf_type, i
 			break;
 	}
 
+	/* UTF-16 and UTF-32 select the byte order when reading the BOM, which is not part of the saved
+	   state, and GB-18030 uses a separate converter handle for its tables. */
+	retval->common.shared_size = retval->utf_type == TRANSCRIPT_UTF16 || retval->utf_type == TRANSCRIPT_UTF32 ||
+		retval->utf_type == _TRANSCRIPT_GB18030 ? 0 : sizeof(converter_state_t);
 	return (transcript_t *) retval;
 }
 
@@ -394,6 +557,7 @@ TRANSCRIPT_EXPORT int transcript_probe_gb18030(const char *name) {
 /** close implementation for Unicode converters. */
 static void close_converter(converter_state_t *handle) {
 	transcript_close_converter(handle->gb18030_table_conv);
+	_transcript_release_gb18030();
 }
 
 TRANSCRIPT_EXPORT const char * const *transcript_namelist_unicode(void) {
@@ -408,7 +572,7 @@ TRANSCRIPT_EXPORT const char * const *transcript_namelist_unicode(void) {
 
 #define DEFINE_INTERFACE(name) \
 TRANSCRIPT_ALIAS_OPEN(open_unicode, name) \
-TRANSCRIPT_EXPORT int transcript_get_iface_##name(void) { return TRANSCRIPT_FULL_MODULE_V1; }
+TRANSCRIPT_EXPORT int transcript_get_iface_##name(void) { return TRANSCRIPT_FULL_MODULE_V2; }
 
 DEFINE_INTERFACE(utf8)
 DEFINE_INTERFACE(utf16)
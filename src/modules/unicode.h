@@ -20,6 +20,15 @@ typedef struct converter_state_t converter_state_t;
 
 typedef int (*put_func_t)(converter_state_t *handle, uint_fast32_t codepoint, char **outbuf, const char *outbuflimit);
 typedef uint_fast32_t (*get_func_t)(converter_state_t *handle, const char **inbuf, const char *inbuflimit, bool_t skip);
+typedef transcript_error_t (*kernel_func_t)(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+	char **outbuf, const char *outbuflimit, int flags);
+
+/** Cache for the block conversion kernel selected for a pair of get and put functions. */
+typedef struct {
+	get_unicode_func_t get_unicode;
+	put_unicode_func_t put_unicode;
+	kernel_func_t kernel;
+} kernel_cache_t;
 
 typedef struct {
 	uint_fast32_t utf7_put_save;
@@ -39,6 +48,8 @@ struct converter_state_t {
 
 	transcript_t *gb18030_table_conv;
 	int utf_type;
+
+	kernel_cache_t to_kernel, from_kernel;
 };
 
 enum {
@@ -52,8 +63,21 @@ enum {
 TRANSCRIPT_LOCAL int _transcript_put_utf7(converter_state_t *handle, uint_fast32_t codepoint, char **outbuf, const char *outbuflimit);
 TRANSCRIPT_LOCAL uint_fast32_t _transcript_get_utf7(converter_state_t *handle, const char **inbuf, const char *inbuflimit, bool_t skip);
 TRANSCRIPT_LOCAL int _transcript_from_unicode_flush_utf7(converter_state_t *handle, char **outbuf, const char *outbuflimit);
+TRANSCRIPT_LOCAL transcript_error_t _transcript_to_unicode_utf7(converter_state_t *handle, const char **inbuf,
+	const char *inbuflimit, char **outbuf, const char *outbuflimit, int flags);
+TRANSCRIPT_LOCAL transcript_error_t _transcript_from_unicode_utf7(converter_state_t *handle, const char **inbuf,
+	const char *inbuflimit, char **outbuf, const char *outbuflimit, int flags);
+
+TRANSCRIPT_LOCAL kernel_func_t _transcript_select_unicode_kernel(get_unicode_func_t get_unicode, put_unicode_func_t put_unicode);
 
 TRANSCRIPT_LOCAL int _transcript_put_gb18030(converter_state_t *handle, uint_fast32_t codepoint, char **outbuf, const char *outbuflimit);
 TRANSCRIPT_LOCAL uint_fast32_t _transcript_get_gb18030(converter_state_t *handle, const char **inbuf, const char *inbuflimit, bool_t skip);
+TRANSCRIPT_LOCAL bool_t _transcript_init_gb18030(converter_state_t *handle, transcript_error_t *error);
+TRANSCRIPT_LOCAL void _transcript_acquire_gb18030(void);
+TRANSCRIPT_LOCAL void _transcript_release_gb18030(void);
+TRANSCRIPT_LOCAL transcript_error_t _transcript_to_unicode_gb18030(converter_state_t *handle, const char **inbuf,
+	const char *inbuflimit, char **outbuf, const char *outbuflimit, int flags);
+TRANSCRIPT_LOCAL transcript_error_t _transcript_from_unicode_gb18030(converter_state_t *handle, const char **inbuf,
+	const char *inbuflimit, char **outbuf, const char *outbuflimit, int flags);
 
 #endif
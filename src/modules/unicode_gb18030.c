@@ -14,8 +14,18 @@
 
 /* Get and put routines for GB-18030. This uses the internal gb18030table. */
 
+#include <string.h>
+#include <pthread.h>
+
 #include "unicode.h"
 
+/** Size of the part of the linear four-byte space which is used for the BMP. */
+#define GB_BMP_LINEAR_SIZE 0x99fc
+/** Start of the part of the linear four-byte space which is used for the supplementary planes. */
+#define GB_SUPPLEMENTARY_LINEAR_LOW UINT32_C(0x2e248)
+/** Number of valid trail bytes for two-byte sequences. */
+#define GB_NR_TRAIL_BYTES 190
+
 /** @internal
     @struct gb_range_map_t
     @brief A structure to hold a mapping from a range in GB-18030 format to a Unicode range.
@@ -40,6 +50,30 @@ static const gb_range_map_t gb_range_map[] = {
 	{ UINT32_C(0x99e2), UINT32_C(0x99fb), UINT32_C(0xffe6), UINT32_C(0xffff) },
 	{ UINT32_C(0x2e248), UINT32_C(0x12e247), UINT32_C(0x10000), UINT32_C(0x10ffff) }};
 
+/** @internal
+    @brief Tables for converting GB-18030 without calling the gb18030table converter.
+
+    The tables are built from the gb18030table converter and ::gb_range_map when
+    the first GB-18030 converter is opened, and are shared by all GB-18030
+    converters. Entries with value 0 are not in the table, and must be converted
+    by the generic code. The supplementary planes are mapped to a single linear
+    four-byte range, and are therefore converted arithmetically.
+*/
+static struct {
+	int refcount;
+	/** Codepoints for the two-byte sequences, indexed by (lead - 0x81) * ::GB_NR_TRAIL_BYTES + trail offset. */
+	uint16_t *to_2byte;
+	/** Codepoints for the four-byte sequences in the BMP, indexed by linear value. */
+	uint16_t *to_4byte;
+	/** Encoded bytes for the BMP. Values below 0x200 are single bytes (with bit 8 set),
+	    values below 0x10000 two-byte sequences, and other values four-byte sequences. */
+	uint32_t *from_bmp;
+	/** Whether bytes 0x00-0x7f are converted as ASCII in both directions. */
+	bool_t ascii_identity;
+} tables;
+/** Lock protecting the reference count of ::tables. */
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /** @internal
     @brief Write a Unicode codepoint in GB-18030 encoding to a buffer.
 */
@@ -171,3 +205,284 @@ uint_fast32_t _transcript_get_gb18030(converter_state_t *handle, const char **in
 	return codepoint - gb_range_map[low].low + gb_range_map[low].unicode_low;
 }
 
+
+/** Free the tables in ::tables. */
+static void free_tables(void) {
+	free(tables.to_2byte);
+	tables.to_2byte = NULL;
+	free(tables.to_4byte);
+	tables.to_4byte = NULL;
+	free(tables.from_bmp);
+	tables.from_bmp = NULL;
+}
+
+/** Build ::tables using the generic get and put routines. */
+static bool_t build_tables(converter_state_t *handle) {
+	uint_fast32_t codepoint, linear;
+	uint8_t buffer[4];
+	const char *buffer_ptr;
+	char *outbuf;
+	uint_fast32_t i;
+
+	if ((tables.to_2byte = calloc(126 * GB_NR_TRAIL_BYTES, sizeof(uint16_t))) == NULL ||
+			(tables.to_4byte = calloc(GB_BMP_LINEAR_SIZE, sizeof(uint16_t))) == NULL ||
+			(tables.from_bmp = calloc(0x10000, sizeof(uint32_t))) == NULL)
+	{
+		free_tables();
+		return FALSE;
+	}
+
+	for (codepoint = 0; codepoint < 0x10000; codepoint++) {
+		outbuf = (char *) buffer;
+		if (_transcript_put_gb18030(handle, codepoint, &outbuf, (char *) buffer + 4) != TRANSCRIPT_SUCCESS)
+			continue;
+		switch (outbuf - (char *) buffer) {
+			case 1:
+				tables.from_bmp[codepoint] = buffer[0] | 0x100;
+				break;
+			case 2:
+				tables.from_bmp[codepoint] = ((uint32_t) buffer[0] << 8) | buffer[1];
+				break;
+			case 4:
+				tables.from_bmp[codepoint] = ((uint32_t) buffer[0] << 24) | ((uint32_t) buffer[1] << 16) |
+					((uint32_t) buffer[2] << 8) | buffer[3];
+				break;
+			default:
+				break;
+		}
+	}
+
+	for (i = 0; i < 126 * GB_NR_TRAIL_BYTES; i++) {
+		buffer[0] = 0x81 + i / GB_NR_TRAIL_BYTES;
+		buffer[1] = 0x40 + i % GB_NR_TRAIL_BYTES;
+		if (buffer[1] >= 0x7f)
+			buffer[1]++;
+		buffer_ptr = (const char *) buffer;
+		codepoint = _transcript_get_gb18030(handle, &buffer_ptr, (const char *) buffer + 2, FALSE);
+		if (buffer_ptr == (const char *) buffer + 2 && codepoint > 0 && codepoint < 0x10000)
+			tables.to_2byte[i] = codepoint;
+	}
+
+	for (i = 0; i < GB_BMP_LINEAR_SIZE; i++) {
+		linear = i;
+		buffer[3] = 0x30 + linear % 10;
+		linear /= 10;
+		buffer[2] = 0x81 + linear % 126;
+		linear /= 126;
+		buffer[1] = 0x30 + linear % 10;
+		buffer[0] = 0x81 + linear / 10;
+		buffer_ptr = (const char *) buffer;
+		codepoint = _transcript_get_gb18030(handle, &buffer_ptr, (const char *) buffer + 4, FALSE);
+		if (buffer_ptr == (const char *) buffer + 4 && codepoint > 0 && codepoint < 0x10000)
+			tables.to_4byte[i] = codepoint;
+	}
+
+	tables.ascii_identity = TRUE;
+	for (i = 0; i < 0x80; i++) {
+		buffer[0] = i;
+		buffer_ptr = (const char *) buffer;
+		if (tables.from_bmp[i] != (i | 0x100) ||
+				_transcript_get_gb18030(handle, &buffer_ptr, (const char *) buffer + 1, FALSE) != i)
+			tables.ascii_identity = FALSE;
+	}
+	return TRUE;
+}
+
+/** @internal
+    @brief Initialize the tables for the table driven GB-18030 conversion.
+
+    Must be called after @c handle->gb18030_table_conv has been opened.
+*/
+bool_t _transcript_init_gb18030(converter_state_t *handle, transcript_error_t *error) {
+	pthread_mutex_lock(&tables_lock);
+	if (tables.refcount == 0 && !build_tables(handle)) {
+		pthread_mutex_unlock(&tables_lock);
+		if (error != NULL)
+			*error = TRANSCRIPT_OUT_OF_MEMORY;
+		return FALSE;
+	}
+	tables.refcount++;
+	pthread_mutex_unlock(&tables_lock);
+	return TRUE;
+}
+
+/** @internal
+    @brief Take an additional reference to the tables for the table driven GB-18030 conversion.
+
+    Used when cloning a converter, for which ::_transcript_init_gb18030 has already been called.
+*/
+void _transcript_acquire_gb18030(void) {
+	pthread_mutex_lock(&tables_lock);
+	tables.refcount++;
+	pthread_mutex_unlock(&tables_lock);
+}
+
+/** @internal
+    @brief Release the tables for the table driven GB-18030 conversion.
+*/
+void _transcript_release_gb18030(void) {
+	pthread_mutex_lock(&tables_lock);
+	if (--tables.refcount == 0)
+		free_tables();
+	pthread_mutex_unlock(&tables_lock);
+}
+
+/** Find the end of a run of ASCII bytes.
+    @return A pointer to the first byte with the high bit set, or @a limit if there is none.
+*/
+static const uint8_t *find_ascii_run_end(const uint8_t *ptr, const uint8_t *limit) {
+	uint64_t bytes;
+
+	for (; limit - ptr >= 8; ptr += 8) {
+		memcpy(&bytes, ptr, 8);
+		if (bytes & UINT64_C(0x8080808080808080))
+			break;
+	}
+	while (ptr < limit && *ptr < 0x80)
+		ptr++;
+	return ptr;
+}
+
+/** Check whether a codepoint is a private use codepoint. */
+#define IS_PRIVATE_USE(codepoint) (((codepoint) >= UINT32_C(0xe000) && (codepoint) <= UINT32_C(0xf8ff)) || \
+	((codepoint) >= UINT32_C(0xf0000) && (codepoint) <= UINT32_C(0x10ffff)))
+
+/** @internal
+    @brief Table driven GB-18030 to Unicode conversion.
+    @return ::TRANSCRIPT_UNASSIGNED if a character is found which must be converted by the generic
+        code, or the result of the conversion otherwise.
+
+    Only characters which convert without using any of the conversion flags are converted,
+    such that the result is the same as that of the generic code.
+*/
+transcript_error_t _transcript_to_unicode_gb18030(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+		char **outbuf, const char *outbuflimit, int flags)
+{
+	bool_t copy_ascii = tables.ascii_identity && !(flags & TRANSCRIPT_SINGLE_CONVERSION) &&
+		handle->common.put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF8);
+	const uint8_t *_inbuf = (const uint8_t *) *inbuf;
+	const uint8_t *_inbuflimit = (const uint8_t *) inbuflimit;
+	uint_fast32_t codepoint, linear;
+	transcript_error_t result;
+
+	while (_inbuf < _inbuflimit) {
+		if (*_inbuf < 0x80 && copy_ascii) {
+			/* Copy runs of ASCII directly to the UTF-8 output. */
+			const uint8_t *run_end = find_ascii_run_end(_inbuf, (size_t) (_inbuflimit - _inbuf) > (size_t) (outbuflimit - *outbuf) ?
+				_inbuf + (outbuflimit - *outbuf) : _inbuflimit);
+			if (run_end != _inbuf) {
+				memcpy(*outbuf, _inbuf, run_end - _inbuf);
+				*outbuf += run_end - _inbuf;
+				_inbuf = run_end;
+				*inbuf = (const char *) _inbuf;
+				continue;
+			}
+		}
+
+		if (*_inbuf < 0x80 && tables.ascii_identity) {
+			codepoint = *_inbuf;
+			_inbuf++;
+		} else if (*_inbuf < 0x81 || *_inbuf == 0xff || _inbuflimit - _inbuf < 2) {
+			return TRANSCRIPT_UNASSIGNED;
+		} else if (_inbuf[1] >= 0x40 && _inbuf[1] != 0x7f && _inbuf[1] != 0xff) {
+			if ((codepoint = tables.to_2byte[(_inbuf[0] - 0x81) * GB_NR_TRAIL_BYTES + _inbuf[1] - (_inbuf[1] > 0x7f ? 0x41 : 0x40)]) == 0)
+				return TRANSCRIPT_UNASSIGNED;
+			_inbuf += 2;
+		} else if (_inbuflimit - _inbuf >= 4 && _inbuf[1] >= 0x30 && _inbuf[1] <= 0x39 && _inbuf[2] >= 0x81 &&
+				_inbuf[2] <= 0xfe && _inbuf[3] >= 0x30 && _inbuf[3] <= 0x39)
+		{
+			linear = ((((_inbuf[0] - 0x81) * 10 + _inbuf[1] - 0x30) * 126) + _inbuf[2] - 0x81) * 10 + _inbuf[3] - 0x30;
+			if (linear < GB_BMP_LINEAR_SIZE) {
+				if ((codepoint = tables.to_4byte[linear]) == 0)
+					return TRANSCRIPT_UNASSIGNED;
+			} else if (linear >= GB_SUPPLEMENTARY_LINEAR_LOW && linear < GB_SUPPLEMENTARY_LINEAR_LOW + 0x100000) {
+				codepoint = linear - GB_SUPPLEMENTARY_LINEAR_LOW + 0x10000;
+			} else {
+				return TRANSCRIPT_UNASSIGNED;
+			}
+			_inbuf += 4;
+		} else {
+			return TRANSCRIPT_UNASSIGNED;
+		}
+
+		if (IS_PRIVATE_USE(codepoint) && !(flags & TRANSCRIPT_ALLOW_PRIVATE_USE))
+			return TRANSCRIPT_UNASSIGNED;
+
+		if ((result = handle->common.put_unicode(codepoint, outbuf, outbuflimit)) != TRANSCRIPT_SUCCESS)
+			return result;
+		*inbuf = (const char *) _inbuf;
+		if (flags & TRANSCRIPT_SINGLE_CONVERSION)
+			return TRANSCRIPT_SUCCESS;
+	}
+	return TRANSCRIPT_SUCCESS;
+}
+
+/** @internal
+    @brief Table driven Unicode to GB-18030 conversion.
+    @return ::TRANSCRIPT_UNASSIGNED if a character is found which must be converted by the generic
+        code, or the result of the conversion otherwise.
+*/
+transcript_error_t _transcript_from_unicode_gb18030(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+		char **outbuf, const char *outbuflimit, int flags)
+{
+	bool_t copy_ascii = tables.ascii_identity && !(flags & TRANSCRIPT_SINGLE_CONVERSION) &&
+		handle->common.get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF8);
+	uint_fast32_t codepoint, bytes;
+	const char *_inbuf;
+	uint8_t *_outbuf;
+
+	while (*inbuf < inbuflimit) {
+		if (copy_ascii && (uint8_t) **inbuf < 0x80) {
+			/* Copy runs of ASCII directly from the UTF-8 input. */
+			const uint8_t *run_end = find_ascii_run_end((const uint8_t *) *inbuf,
+				inbuflimit - *inbuf > outbuflimit - *outbuf ? (const uint8_t *) *inbuf + (outbuflimit - *outbuf) :
+				(const uint8_t *) inbuflimit);
+			if (run_end != (const uint8_t *) *inbuf) {
+				memcpy(*outbuf, *inbuf, (const char *) run_end - *inbuf);
+				*outbuf += (const char *) run_end - *inbuf;
+				*inbuf = (const char *) run_end;
+				continue;
+			}
+		}
+
+		_inbuf = *inbuf;
+		codepoint = handle->common.get_unicode(&_inbuf, inbuflimit, FALSE);
+		if (codepoint > UINT32_C(0x10ffff) || (IS_PRIVATE_USE(codepoint) && !(flags & TRANSCRIPT_ALLOW_PRIVATE_USE)))
+			return TRANSCRIPT_UNASSIGNED;
+
+		if (codepoint < 0x10000) {
+			if ((bytes = tables.from_bmp[codepoint]) == 0)
+				return TRANSCRIPT_UNASSIGNED;
+		} else {
+			bytes = codepoint - 0x10000 + GB_SUPPLEMENTARY_LINEAR_LOW;
+			bytes = ((0x81 + bytes / 12600) << 24) | ((0x30 + bytes / 1260 % 10) << 16) |
+				((0x81 + bytes / 10 % 126) << 8) | (0x30 + bytes % 10);
+		}
+
+		_outbuf = (uint8_t *) *outbuf;
+		if (bytes < 0x200) {
+			if (outbuflimit - *outbuf < 1)
+				return TRANSCRIPT_NO_SPACE;
+			_outbuf[0] = bytes;
+			*outbuf += 1;
+		} else if (bytes < 0x10000) {
+			if (outbuflimit - *outbuf < 2)
+				return TRANSCRIPT_NO_SPACE;
+			_outbuf[0] = bytes >> 8;
+			_outbuf[1] = bytes;
+			*outbuf += 2;
+		} else {
+			if (outbuflimit - *outbuf < 4)
+				return TRANSCRIPT_NO_SPACE;
+			_outbuf[0] = bytes >> 24;
+			_outbuf[1] = bytes >> 16;
+			_outbuf[2] = bytes >> 8;
+			_outbuf[3] = bytes;
+			*outbuf += 4;
+		}
+		*inbuf = _inbuf;
+		if (flags & TRANSCRIPT_SINGLE_CONVERSION)
+			return TRANSCRIPT_SUCCESS;
+	}
+	return TRANSCRIPT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/* Copyright (C) 2011-2012 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Template for the block conversion kernels. Before including this file, define
+   KERNEL_IN and KERNEL_OUT to one of utf8, utf16le, utf16be, utf32le or utf32be.
+   This defines the function kernel_<KERNEL_IN>_<KERNEL_OUT>, which uses the
+   decode_<KERNEL_IN> and encode_<KERNEL_OUT> functions, and the ascii_mask_<KERNEL_IN>,
+   ascii_offset_<KERNEL_IN> and unit_<KERNEL_IN> constants. */
+#if defined(KERNEL_IN) && defined(KERNEL_OUT)
+#define __KERNEL_CAT(x, y) x##y
+#define _KERNEL_CAT(x, y) __KERNEL_CAT(x, y)
+#define KERNEL_NAME _KERNEL_CAT(_KERNEL_CAT(_KERNEL_CAT(kernel_, KERNEL_IN), _), KERNEL_OUT)
+#define KERNEL_IN_NAME(x) _KERNEL_CAT(x, KERNEL_IN)
+#define KERNEL_OUT_NAME(x) _KERNEL_CAT(x, KERNEL_OUT)
+
+/** Block conversion kernel.
+    @return ::TRANSCRIPT_UNASSIGNED if a character is found which must be converted by
+        the generic code, or the result of the conversion otherwise.
+*/
+static transcript_error_t KERNEL_NAME(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+		char **outbuf, const char *outbuflimit, int flags)
+{
+	const uint8_t *_inbuf = (const uint8_t *) *inbuf, *next;
+	const uint8_t *_inbuflimit = (const uint8_t *) inbuflimit;
+	uint8_t *_outbuf = (uint8_t *) *outbuf;
+	const uint8_t *_outbuflimit = (const uint8_t *) outbuflimit;
+	transcript_error_t result = TRANSCRIPT_SUCCESS;
+	uint_fast32_t codepoint;
+	uint64_t ascii_mask, bytes;
+	int i;
+
+	(void) handle;
+	memcpy(&ascii_mask, KERNEL_IN_NAME(ascii_mask_), 8);
+
+	while (_inbuf < _inbuflimit) {
+		/* Check eight bytes at a time for ASCII characters, which can be converted
+		   without any further checks. */
+		while (_inbuflimit - _inbuf >= 8 && (_outbuflimit - _outbuf) >= (8 / KERNEL_IN_NAME(unit_)) * 4) {
+			memcpy(&bytes, _inbuf, 8);
+			if (bytes & ascii_mask)
+				break;
+			for (i = 0; i < 8; i += KERNEL_IN_NAME(unit_))
+				KERNEL_OUT_NAME(encode_)(_inbuf[i + KERNEL_IN_NAME(ascii_offset_)], &_outbuf, _outbuflimit);
+			_inbuf += 8;
+		}
+
+		next = _inbuf;
+		if (next == _inbuflimit)
+			break;
+		if (!KERNEL_IN_NAME(decode_)(&next, _inbuflimit, &codepoint) ||
+				(codepoint >= UINT32_C(0xe000) && !check_codepoint(codepoint, flags)))
+		{
+			result = TRANSCRIPT_UNASSIGNED;
+			break;
+		}
+		if (!KERNEL_OUT_NAME(encode_)(codepoint, &_outbuf, _outbuflimit)) {
+			result = TRANSCRIPT_NO_SPACE;
+			break;
+		}
+		_inbuf = next;
+	}
+
+	*inbuf = (const char *) _inbuf;
+	*outbuf = (char *) _outbuf;
+	return result;
+}
+
+#undef KERNEL_OUT_NAME
+#undef KERNEL_IN_NAME
+#undef KERNEL_NAME
+#undef _KERNEL_CAT
+#undef __KERNEL_CAT
+#endif
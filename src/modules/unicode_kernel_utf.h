@@ -0,0 +1,93 @@
+/* Copyright (C) 2011-2012 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Decoders and encoders for UTF-16 and UTF-32 for the block conversion kernels.
+   Before including this file, define UTF_SUFFIX to the byte order (le or be), and
+   GET16, PUT16, GET32 and PUT32 to read and write values in that byte order. */
+#ifdef UTF_SUFFIX
+#define __UTF_CAT(x, y) x##y
+#define _UTF_CAT(x, y) __UTF_CAT(x, y)
+#define UTF_NAME(x) _UTF_CAT(x, UTF_SUFFIX)
+
+/** Decode a valid UTF-16 character.
+    @return FALSE if the input is incomplete or contains an unpaired surrogate.
+*/
+static bool_t UTF_NAME(decode_utf16)(const uint8_t **inbuf, const uint8_t *inbuflimit, uint_fast32_t *codepoint) {
+	uint_fast32_t next_codepoint;
+
+	if (inbuflimit - *inbuf < 2)
+		return FALSE;
+	*codepoint = GET16(*inbuf);
+	if ((*codepoint & UINT32_C(0xf800)) != UINT32_C(0xd800)) {
+		*inbuf += 2;
+		return TRUE;
+	}
+	if ((*codepoint & UINT32_C(0xfc00)) != UINT32_C(0xd800) || inbuflimit - *inbuf < 4)
+		return FALSE;
+	next_codepoint = GET16(*inbuf + 2);
+	if ((next_codepoint & UINT32_C(0xfc00)) != UINT32_C(0xdc00))
+		return FALSE;
+	*codepoint = ((*codepoint - UINT32_C(0xd800)) << 10) + next_codepoint - UINT32_C(0xdc00) + UINT32_C(0x10000);
+	*inbuf += 4;
+	return TRUE;
+}
+
+/** Encode a codepoint as UTF-16.
+    @return FALSE if there is not enough space in the output.
+*/
+static bool_t UTF_NAME(encode_utf16)(uint_fast32_t codepoint, uint8_t **outbuf, const uint8_t *outbuflimit) {
+	if (codepoint < UINT32_C(0x10000)) {
+		if (outbuflimit - *outbuf < 2)
+			return FALSE;
+		PUT16(*outbuf, codepoint);
+		*outbuf += 2;
+	} else {
+		if (outbuflimit - *outbuf < 4)
+			return FALSE;
+		codepoint -= UINT32_C(0x10000);
+		PUT16(*outbuf, UINT32_C(0xd800) + (codepoint >> 10));
+		PUT16(*outbuf + 2, UINT32_C(0xdc00) + (codepoint & 0x3ff));
+		*outbuf += 4;
+	}
+	return TRUE;
+}
+
+/** Decode a valid UTF-32 character.
+    @return FALSE if the input is incomplete, out of range or a surrogate.
+*/
+static bool_t UTF_NAME(decode_utf32)(const uint8_t **inbuf, const uint8_t *inbuflimit, uint_fast32_t *codepoint) {
+	if (inbuflimit - *inbuf < 4)
+		return FALSE;
+	*codepoint = GET32(*inbuf);
+	if (*codepoint > UINT32_C(0x10ffff) || (*codepoint >= UINT32_C(0xd800) && *codepoint <= UINT32_C(0xdfff)))
+		return FALSE;
+	*inbuf += 4;
+	return TRUE;
+}
+
+/** Encode a codepoint as UTF-32.
+    @return FALSE if there is not enough space in the output.
+*/
+static bool_t UTF_NAME(encode_utf32)(uint_fast32_t codepoint, uint8_t **outbuf, const uint8_t *outbuflimit) {
+	if (outbuflimit - *outbuf < 4)
+		return FALSE;
+	PUT32(*outbuf, codepoint);
+	*outbuf += 4;
+	return TRUE;
+}
+
+#undef UTF_NAME
+#undef _UTF_CAT
+#undef __UTF_CAT
+#endif
@@ -0,0 +1,316 @@
+/* Copyright (C) 2011-2012 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Block conversion kernels for conversions between UTF-8, UTF-16 and UTF-32.
+
+   The generic conversion in unicode.c calls a get and a put function through
+   function pointers for every codepoint. The kernels in this file combine
+   the decoding and encoding in a single loop. They only handle characters
+   which convert without any of the conversion flags: everything else,
+   including illegal and incomplete input, is left to the generic code. */
+#include <string.h>
+
+#include "unicode.h"
+
+/** Check whether a codepoint of at least 0xe000 can be converted by the kernels.
+    @return FALSE for non-characters, and for private use characters unless
+        ::TRANSCRIPT_ALLOW_PRIVATE_USE is set.
+*/
+static bool_t check_codepoint(uint_fast32_t codepoint, int flags) {
+	if (codepoint >= UINT32_C(0xfdd0) && ((codepoint & UINT32_C(0xfffe)) == UINT32_C(0xfffe) || codepoint < UINT32_C(0xfdf0)))
+		return FALSE;
+	if ((codepoint <= UINT32_C(0xf8ff) || codepoint >= UINT32_C(0xf0000)) && !(flags & TRANSCRIPT_ALLOW_PRIVATE_USE))
+		return FALSE;
+	return TRUE;
+}
+
+/* Masks for checking whether eight bytes of input only contain ASCII characters,
+   the offset of the ASCII byte in each unit, and the size of a unit. */
+static const uint8_t ascii_mask_utf8[8] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 };
+static const uint8_t ascii_mask_utf16le[8] = { 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff };
+static const uint8_t ascii_mask_utf16be[8] = { 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80 };
+static const uint8_t ascii_mask_utf32le[8] = { 0x80, 0xff, 0xff, 0xff, 0x80, 0xff, 0xff, 0xff };
+static const uint8_t ascii_mask_utf32be[8] = { 0xff, 0xff, 0xff, 0x80, 0xff, 0xff, 0xff, 0x80 };
+enum {
+	ascii_offset_utf8 = 0, unit_utf8 = 1,
+	ascii_offset_utf16le = 0, unit_utf16le = 2,
+	ascii_offset_utf16be = 1, unit_utf16be = 2,
+	ascii_offset_utf32le = 0, unit_utf32le = 4,
+	ascii_offset_utf32be = 3, unit_utf32be = 4
+};
+
+/** Decode a well-formed UTF-8 sequence.
+    @return FALSE if the input is incomplete, not well-formed or an overlong or surrogate
+        encoding. The latter are accepted by the loose decoder, and are therefore left
+        to the generic code.
+*/
+static bool_t decode_utf8(const uint8_t **inbuf, const uint8_t *inbuflimit, uint_fast32_t *codepoint) {
+	const uint8_t *_inbuf = *inbuf;
+
+	if (_inbuf[0] < 0x80) {
+		*codepoint = _inbuf[0];
+		*inbuf += 1;
+	} else if (_inbuf[0] < 0xc2) {
+		return FALSE;
+	} else if (_inbuf[0] < 0xe0) {
+		if (inbuflimit - _inbuf < 2 || (_inbuf[1] & 0xc0) != 0x80)
+			return FALSE;
+		*codepoint = ((uint_fast32_t) (_inbuf[0] & 0x1f) << 6) | (_inbuf[1] & 0x3f);
+		*inbuf += 2;
+	} else if (_inbuf[0] < 0xf0) {
+		if (inbuflimit - _inbuf < 3 || (_inbuf[1] & 0xc0) != 0x80 || (_inbuf[2] & 0xc0) != 0x80)
+			return FALSE;
+		*codepoint = ((uint_fast32_t) (_inbuf[0] & 0x0f) << 12) | ((uint_fast32_t) (_inbuf[1] & 0x3f) << 6) |
+			(_inbuf[2] & 0x3f);
+		if (*codepoint < 0x800 || (*codepoint >= UINT32_C(0xd800) && *codepoint <= UINT32_C(0xdfff)))
+			return FALSE;
+		*inbuf += 3;
+	} else if (_inbuf[0] < 0xf5) {
+		if (inbuflimit - _inbuf < 4 || (_inbuf[1] & 0xc0) != 0x80 || (_inbuf[2] & 0xc0) != 0x80 ||
+				(_inbuf[3] & 0xc0) != 0x80)
+			return FALSE;
+		*codepoint = ((uint_fast32_t) (_inbuf[0] & 0x07) << 18) | ((uint_fast32_t) (_inbuf[1] & 0x3f) << 12) |
+			((uint_fast32_t) (_inbuf[2] & 0x3f) << 6) | (_inbuf[3] & 0x3f);
+		if (*codepoint < UINT32_C(0x10000) || *codepoint > UINT32_C(0x10ffff))
+			return FALSE;
+		*inbuf += 4;
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/** Encode a codepoint as UTF-8.
+    @return FALSE if there is not enough space in the output.
+*/
+static bool_t encode_utf8(uint_fast32_t codepoint, uint8_t **outbuf, const uint8_t *outbuflimit) {
+	uint8_t *_outbuf = *outbuf;
+
+	if (codepoint < 0x80) {
+		if (outbuflimit - _outbuf < 1)
+			return FALSE;
+		_outbuf[0] = codepoint;
+		*outbuf += 1;
+	} else if (codepoint < 0x800) {
+		if (outbuflimit - _outbuf < 2)
+			return FALSE;
+		_outbuf[0] = (codepoint >> 6) | 0xc0;
+		_outbuf[1] = (codepoint & 0x3f) | 0x80;
+		*outbuf += 2;
+	} else if (codepoint < 0x10000) {
+		if (outbuflimit - _outbuf < 3)
+			return FALSE;
+		_outbuf[0] = (codepoint >> 12) | 0xe0;
+		_outbuf[1] = ((codepoint >> 6) & 0x3f) | 0x80;
+		_outbuf[2] = (codepoint & 0x3f) | 0x80;
+		*outbuf += 3;
+	} else {
+		if (outbuflimit - _outbuf < 4)
+			return FALSE;
+		_outbuf[0] = (codepoint >> 18) | 0xf0;
+		_outbuf[1] = ((codepoint >> 12) & 0x3f) | 0x80;
+		_outbuf[2] = ((codepoint >> 6) & 0x3f) | 0x80;
+		_outbuf[3] = (codepoint & 0x3f) | 0x80;
+		*outbuf += 4;
+	}
+	return TRUE;
+}
+
+/* Decoders and encoders for UTF-16 and UTF-32. The GET16/PUT16/GET32/PUT32 macros
+   are redefined for each byte order. */
+#define GET16(p) (((uint_fast32_t) (p)[0]) | ((uint_fast32_t) (p)[1] << 8))
+#define PUT16(p, v) do { (p)[0] = (v); (p)[1] = (v) >> 8; } while (0)
+#define GET32(p) (((uint_fast32_t) (p)[0]) | ((uint_fast32_t) (p)[1] << 8) | \
+	((uint_fast32_t) (p)[2] << 16) | ((uint_fast32_t) (p)[3] << 24))
+#define PUT32(p, v) do { (p)[0] = (v); (p)[1] = (v) >> 8; (p)[2] = (v) >> 16; (p)[3] = (v) >> 24; } while (0)
+#define UTF_SUFFIX le
+#include "unicode_kernel_utf.h"
+#undef UTF_SUFFIX
+#undef GET16
+#undef PUT16
+#undef GET32
+#undef PUT32
+
+#define GET16(p) (((uint_fast32_t) (p)[0] << 8) | ((uint_fast32_t) (p)[1]))
+#define PUT16(p, v) do { (p)[0] = (v) >> 8; (p)[1] = (v); } while (0)
+#define GET32(p) (((uint_fast32_t) (p)[0] << 24) | ((uint_fast32_t) (p)[1] << 16) | \
+	((uint_fast32_t) (p)[2] << 8) | ((uint_fast32_t) (p)[3]))
+#define PUT32(p, v) do { (p)[0] = (v) >> 24; (p)[1] = (v) >> 16; (p)[2] = (v) >> 8; (p)[3] = (v); } while (0)
+#define UTF_SUFFIX be
+#include "unicode_kernel_utf.h"
+#undef UTF_SUFFIX
+#undef GET16
+#undef PUT16
+#undef GET32
+#undef PUT32
+
+/* Instantiate the kernels for all combinations. */
+#define KERNEL_IN utf8
+#define KERNEL_OUT utf8
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#undef KERNEL_IN
+
+#define KERNEL_IN utf16le
+#define KERNEL_OUT utf8
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#undef KERNEL_IN
+
+#define KERNEL_IN utf16be
+#define KERNEL_OUT utf8
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#undef KERNEL_IN
+
+#define KERNEL_IN utf32le
+#define KERNEL_OUT utf8
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#undef KERNEL_IN
+
+#define KERNEL_IN utf32be
+#define KERNEL_OUT utf8
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf16be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32le
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#define KERNEL_OUT utf32be
+#include "unicode_kernel.h"
+#undef KERNEL_OUT
+#undef KERNEL_IN
+
+enum { KERNEL_UTF8, KERNEL_UTF16LE, KERNEL_UTF16BE, KERNEL_UTF32LE, KERNEL_UTF32BE, KERNEL_NONE };
+
+/** The kernels, indexed by input and output encoding. */
+static const kernel_func_t kernels[KERNEL_NONE][KERNEL_NONE] = {
+	{ kernel_utf8_utf8, kernel_utf8_utf16le, kernel_utf8_utf16be, kernel_utf8_utf32le, kernel_utf8_utf32be },
+	{ kernel_utf16le_utf8, kernel_utf16le_utf16le, kernel_utf16le_utf16be, kernel_utf16le_utf32le, kernel_utf16le_utf32be },
+	{ kernel_utf16be_utf8, kernel_utf16be_utf16le, kernel_utf16be_utf16be, kernel_utf16be_utf32le, kernel_utf16be_utf32be },
+	{ kernel_utf32le_utf8, kernel_utf32le_utf16le, kernel_utf32le_utf16be, kernel_utf32le_utf32le, kernel_utf32le_utf32be },
+	{ kernel_utf32be_utf8, kernel_utf32be_utf16le, kernel_utf32be_utf16be, kernel_utf32be_utf32le, kernel_utf32be_utf32be }
+};
+
+/** Determine which kernel encoding corresponds to a get function. */
+static int get_kernel_type(get_unicode_func_t get_unicode) {
+	static const uint16_t endian_test = 1;
+	bool_t little_endian = *(const uint8_t *) &endian_test == 1;
+
+	if (get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF8) ||
+			get_unicode == _transcript_get_get_unicode(_TRANSCRIPT_UTF8_LOOSE))
+		return KERNEL_UTF8;
+	if (get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF16LE) ||
+			(little_endian && get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF16)))
+		return KERNEL_UTF16LE;
+	if (get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF16BE) ||
+			(!little_endian && get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF16)))
+		return KERNEL_UTF16BE;
+	if (get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF32LE) ||
+			(little_endian && get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF32)))
+		return KERNEL_UTF32LE;
+	if (get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF32BE) ||
+			(!little_endian && get_unicode == _transcript_get_get_unicode(TRANSCRIPT_UTF32)))
+		return KERNEL_UTF32BE;
+	return KERNEL_NONE;
+}
+
+/** Determine which kernel encoding corresponds to a put function. */
+static int put_kernel_type(put_unicode_func_t put_unicode) {
+	static const uint16_t endian_test = 1;
+	bool_t little_endian = *(const uint8_t *) &endian_test == 1;
+
+	/* Note that the CESU-8 put function is not the same as the UTF-8 put function. */
+	if (put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF8))
+		return KERNEL_UTF8;
+	if (put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF16LE) ||
+			(little_endian && put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF16)))
+		return KERNEL_UTF16LE;
+	if (put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF16BE) ||
+			(!little_endian && put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF16)))
+		return KERNEL_UTF16BE;
+	if (put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF32LE) ||
+			(little_endian && put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF32)))
+		return KERNEL_UTF32LE;
+	if (put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF32BE) ||
+			(!little_endian && put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF32)))
+		return KERNEL_UTF32BE;
+	return KERNEL_NONE;
+}
+
+/** @internal
+    @brief Select the block conversion kernel for a pair of get and put functions.
+    @return The kernel, or @c NULL if there is no kernel for the combination.
+*/
+kernel_func_t _transcript_select_unicode_kernel(get_unicode_func_t get_unicode, put_unicode_func_t put_unicode) {
+	int in = get_kernel_type(get_unicode), out = put_kernel_type(put_unicode);
+
+	if (in == KERNEL_NONE || out == KERNEL_NONE)
+		return NULL;
+	return kernels[in][out];
+}
@@ -14,6 +14,8 @@
 
 /* Get/put routines for UTF-7. */
 
+#include <string.h>
+
 #include "unicode.h"
 
 #define PLUS 43
@@ -109,6 +111,7 @@ static const uint8_t value_to_base64[64] = {
 	*(*outbuf)++ = value_to_base64[handle->state.utf7_put_save | (codepoint >> (16 - bits_left))]; \
 	*(*outbuf)++ = value_to_base64[(codepoint >> (16 - bits_left - 6)) & 0x3f]; \
 	if (bits_left == 4) { \
+		*(*outbuf)++ = value_to_base64[codepoint & 0x3f]; \
 		handle->state.utf7_put_save = 0; \
 		handle->state.utf7_put_mode = UTF7_MODE_BASE64_0; \
 	} else if (bits_left == 2) { \
@@ -196,6 +199,8 @@ int _transcript_from_unicode_flush_utf7(converter_state_t *handle, char **outbuf
 uint_fast32_t _transcript_get_utf7(converter_state_t *handle, const char **inbuf, const char *inbuflimit, bool_t skip) {
 	uint_fast32_t codepoint, high_surrogate = 0;
 	const uint8_t *_inbuf = (const uint8_t *) *inbuf;
+	const char *start = *inbuf;
+	uint_fast8_t start_mode = handle->state.utf7_get_mode;
 	uint_fast8_t next_mode;
 	int handled, i, extra_skip;
 
@@ -230,7 +235,7 @@ uint_fast32_t _transcript_get_utf7(converter_state_t *handle, const char **inbuf
 			case UTF7_MODE_BASE64_0:
 				if (is_base64(*_inbuf)) {
 					if ((const char *) _inbuf + 3 > inbuflimit)
-						return TRANSCRIPT_UTF_INCOMPLETE;
+						goto incomplete;
 
 					if (!is_base64(_inbuf[1]) || !is_base64(_inbuf[2])) {
 						handled = 3;
@@ -254,10 +259,10 @@ uint_fast32_t _transcript_get_utf7(converter_state_t *handle, const char **inbuf
 				goto switch_to_direct;
 			case UTF7_MODE_BASE64_2:
 				if ((const char *) _inbuf + 2 > inbuflimit)
-					return TRANSCRIPT_UTF_INCOMPLETE;
+					goto incomplete;
 				if (is_base64(_inbuf[1])) {
 					if ((const char *) _inbuf + 4 > inbuflimit)
-						return TRANSCRIPT_INCOMPLETE;
+						goto incomplete;
 
 					if (!is_base64(_inbuf[2]) || !is_base64(_inbuf[3])) {
 						handled = 4;
@@ -292,21 +297,21 @@ uint_fast32_t _transcript_get_utf7(converter_state_t *handle, const char **inbuf
 
 			case UTF7_MODE_BASE64_4:
 				if ((const char *) _inbuf + 2 > inbuflimit)
-					return TRANSCRIPT_UTF_INCOMPLETE;
+					goto incomplete;
 				if (is_base64(_inbuf[1])) {
 					if ((const char *) _inbuf + 3 > inbuflimit)
-						return TRANSCRIPT_INCOMPLETE;
+						goto incomplete;
 
 					if (!is_base64(_inbuf[2])) {
 						handled = 3;
 						goto skip_non_base64;
 					}
 
-					codepoint = base64_to_value[*_inbuf++] & 3;
+					codepoint = base64_to_value[*_inbuf++] & 15;
 					codepoint <<= 6;
 					codepoint |= base64_to_value[*_inbuf++];
 					codepoint <<= 6;
-					codepoint |= base64_to_value[*_inbuf];
+					codepoint |= base64_to_value[*_inbuf++];
 
 					next_mode = UTF7_MODE_BASE64_0;
 					goto handle_surrogates;
@@ -370,7 +375,15 @@ uint_fast32_t _transcript_get_utf7(converter_state_t *handle, const char **inbuf
 				return TRANSCRIPT_UTF_INTERNAL_ERROR;
 		}
 	}
-	return handle->state.utf7_get_mode == UTF7_MODE_DIRECT ? TRANSCRIPT_UTF_NO_VALUE : TRANSCRIPT_UTF_INCOMPLETE;
+	if (handle->state.utf7_get_mode == UTF7_MODE_DIRECT)
+		return TRANSCRIPT_UTF_NO_VALUE;
+
+incomplete:
+	/* The caller presents the incomplete character again with more input, so both the input
+	   and the mode go back to where reading the character started. */
+	*inbuf = start;
+	handle->state.utf7_get_mode = start_mode;
+	return TRANSCRIPT_UTF_INCOMPLETE;
 
 skip_non_base64:
 	if (!skip)
@@ -386,3 +399,153 @@ skip_non_base64:
 	*inbuf = (const char *) (_inbuf + i + extra_skip);
 	return TRANSCRIPT_UTF_ILLEGAL;
 }
+
+/** Check whether a codepoint decoded from a base64 block can be converted by the block
+    conversion functions. Surrogates and private use characters (unless allowed) are
+    left to the generic code. */
+#define IS_SIMPLE_UNIT(unit, flags) (((unit) < UINT32_C(0xd800) || (unit) > UINT32_C(0xf8ff) || \
+	((unit) > UINT32_C(0xdfff) && ((unit) < UINT32_C(0xe000) || ((flags) & TRANSCRIPT_ALLOW_PRIVATE_USE)))))
+
+/** Decode eight base64 characters into three UTF-16 units.
+    @return FALSE if not all characters are base64 characters.
+*/
+static bool_t decode_base64_block(const uint8_t *inbuf, uint_fast32_t *units) {
+	uint64_t bits = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (!is_base64(inbuf[i]))
+			return FALSE;
+		bits = (bits << 6) | base64_to_value[inbuf[i]];
+	}
+	units[0] = (bits >> 32) & 0xffff;
+	units[1] = (bits >> 16) & 0xffff;
+	units[2] = bits & 0xffff;
+	return TRUE;
+}
+
+/** Encode three UTF-16 units as eight base64 characters. */
+static void encode_base64_block(const uint_fast32_t *units, uint8_t *outbuf) {
+	uint64_t bits = ((uint64_t) units[0] << 32) | ((uint64_t) units[1] << 16) | units[2];
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		outbuf[i] = value_to_base64[bits & 0x3f];
+		bits >>= 6;
+	}
+}
+
+/** @internal
+    @brief Block conversion from UTF-7.
+    @return ::TRANSCRIPT_UNASSIGNED if input is found which must be converted by the generic
+        code, or the result of the conversion otherwise.
+
+    Runs of directly encoded characters are converted as a whole, and base64 segments
+    are converted eight characters (three UTF-16 units) at a time. Mode switches,
+    surrogates, partial blocks and illegal input are left to ::_transcript_get_utf7.
+*/
+transcript_error_t _transcript_to_unicode_utf7(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+		char **outbuf, const char *outbuflimit, int flags)
+{
+	static const uint_fast8_t unit_end[3] = { 2, 5, 8 };
+	static const uint_fast8_t unit_mode[3] = { UTF7_MODE_BASE64_2, UTF7_MODE_BASE64_4, UTF7_MODE_BASE64_0 };
+	bool_t copy_direct = handle->common.put_unicode == _transcript_get_put_unicode(TRANSCRIPT_UTF8);
+	const uint8_t *_inbuf = (const uint8_t *) *inbuf;
+	const uint8_t *_inbuflimit = (const uint8_t *) inbuflimit;
+	uint_fast32_t units[3];
+	transcript_error_t result;
+	int i;
+
+	while (_inbuf < _inbuflimit) {
+		if (handle->state.utf7_get_mode == UTF7_MODE_DIRECT) {
+			const uint8_t *run_end;
+
+			for (run_end = _inbuf; run_end < _inbuflimit && *run_end != PLUS && is_optionally_direct(*run_end); run_end++) {}
+			if (run_end == _inbuf)
+				return TRANSCRIPT_UNASSIGNED;
+
+			if (copy_direct) {
+				/* Directly encoded characters are ASCII, so they can be copied to UTF-8 output. */
+				if (run_end - _inbuf > outbuflimit - *outbuf)
+					run_end = _inbuf + (outbuflimit - *outbuf);
+				memcpy(*outbuf, _inbuf, run_end - _inbuf);
+				*outbuf += run_end - _inbuf;
+				*inbuf = (const char *) (_inbuf = run_end);
+				if (_inbuf < _inbuflimit && *_inbuf != PLUS && is_optionally_direct(*_inbuf))
+					return TRANSCRIPT_NO_SPACE;
+			} else {
+				for (; _inbuf < run_end; _inbuf++) {
+					if ((result = handle->common.put_unicode(*_inbuf, outbuf, outbuflimit)) != TRANSCRIPT_SUCCESS)
+						return result;
+					*inbuf = (const char *) (_inbuf + 1);
+				}
+			}
+		} else if (handle->state.utf7_get_mode == UTF7_MODE_BASE64_0) {
+			if (_inbuflimit - _inbuf < 8 || !decode_base64_block(_inbuf, units) || !IS_SIMPLE_UNIT(units[0], flags) ||
+					!IS_SIMPLE_UNIT(units[1], flags) || !IS_SIMPLE_UNIT(units[2], flags))
+				return TRANSCRIPT_UNASSIGNED;
+
+			/* The state after each unit is the same as if it had been decoded by _transcript_get_utf7. */
+			for (i = 0; i < 3; i++) {
+				if ((result = handle->common.put_unicode(units[i], outbuf, outbuflimit)) != TRANSCRIPT_SUCCESS)
+					return result;
+				*inbuf = (const char *) (_inbuf + unit_end[i]);
+				handle->state.utf7_get_mode = unit_mode[i];
+			}
+			_inbuf += 8;
+		} else {
+			return TRANSCRIPT_UNASSIGNED;
+		}
+	}
+	return TRANSCRIPT_SUCCESS;
+}
+
+/** @internal
+    @brief Block conversion to UTF-7.
+    @return ::TRANSCRIPT_UNASSIGNED if input is found which must be converted by the generic
+        code, or the result of the conversion otherwise.
+
+    Runs of directly encoded characters are converted one after another without mode
+    checks, and base64 segments are written three UTF-16 units (eight characters) at a
+    time. Mode switches, surrogates and partial blocks are left to ::_transcript_put_utf7.
+*/
+transcript_error_t _transcript_from_unicode_utf7(converter_state_t *handle, const char **inbuf, const char *inbuflimit,
+		char **outbuf, const char *outbuflimit, int flags)
+{
+	uint_fast32_t codepoint, units[3];
+	const char *_inbuf;
+	int i;
+
+	while (*inbuf < inbuflimit) {
+		if (handle->state.utf7_put_mode == UTF7_MODE_DIRECT) {
+			_inbuf = *inbuf;
+			codepoint = handle->common.get_unicode(&_inbuf, inbuflimit, FALSE);
+			if (!is_direct(codepoint))
+				return TRANSCRIPT_UNASSIGNED;
+			if (*outbuf == outbuflimit)
+				return TRANSCRIPT_NO_SPACE;
+			*(*outbuf)++ = codepoint;
+			*inbuf = _inbuf;
+		} else if (handle->state.utf7_put_mode == UTF7_MODE_BASE64_0) {
+			if (outbuflimit - *outbuf < 8)
+				return TRANSCRIPT_UNASSIGNED;
+
+			_inbuf = *inbuf;
+			for (i = 0; i < 3; i++) {
+				/* A segment ending within the block is left to the generic code. */
+				if (_inbuf == inbuflimit)
+					return TRANSCRIPT_UNASSIGNED;
+				/* Directly encoded characters end the base64 segment, which is left to the generic code. */
+				units[i] = handle->common.get_unicode(&_inbuf, inbuflimit, FALSE);
+				if (units[i] > UINT32_C(0xffff) || is_direct(units[i]) || !IS_SIMPLE_UNIT(units[i], flags))
+					return TRANSCRIPT_UNASSIGNED;
+			}
+			encode_base64_block(units, (uint8_t *) *outbuf);
+			*outbuf += 8;
+			*inbuf = _inbuf;
+		} else {
+			return TRANSCRIPT_UNASSIGNED;
+		}
+	}
+	return TRANSCRIPT_SUCCESS;
+}
@@ -14,17 +14,37 @@
 #include "static_assert.h"
 #include "transcript_internal.h"
 #include "utf.h"
+#include <pthread.h>
 #include <string.h>
 
 enum { INTERNAL_TABLE = (1 << 0) };
 
+/** @struct expanded_table_t
+    Flat from-Unicode table for the BMP, shared by all handles using the same table.
+
+    Each entry holds the byte for the codepoint, or 0 if the codepoint is unassigned,
+    is only mapped as a fallback or maps to byte 0. Those cases use the regular
+    tables.
+*/
+typedef struct expanded_table_t {
+  struct expanded_table_t *next;
+  const sbcs_converter_v1_t *tables;
+  int refcount;
+  uint8_t codepoint_to_byte[0x10000];
+} expanded_table_t;
+
 /** @struct converter_state_t
     Structure holding the pointers to the data and the state of a state table converter. */
 typedef struct {
   transcript_t common;
   sbcs_converter_v1_t tables;
+  expanded_table_t *expanded;
 } converter_state_t;
 
+/* The list of expanded tables. */
+static expanded_table_t *expanded_tables;
+static pthread_mutex_t expanded_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static transcript_error_t to_unicode_skip(converter_state_t *handle, const char **inbuf,
                                           const char *inbuflimit);
 
@@ -128,7 +148,10 @@ static transcript_error_t from_unicode_conversion(converter_state_t *handle, con
       continue;
     }
 
-    if (codepoint < UINT32_C(0x10000)) {
+    if (handle->expanded != NULL && codepoint < UINT32_C(0x10000) &&
+        handle->expanded->codepoint_to_byte[codepoint] != 0) {
+      PUT_BYTE(handle->expanded->codepoint_to_byte[codepoint]);
+    } else if (codepoint < UINT32_C(0x10000)) {
       unsigned int idx = LOOKUP_IDX(codepoint);
       uint8_t byte = handle->tables.codepoint_to_byte_data[idx][codepoint & 0x1f];
       if (byte != 0 || codepoint == 0) {
@@ -178,6 +201,128 @@ static transcript_error_t from_unicode_conversion(converter_state_t *handle, con
   return TRANSCRIPT_SUCCESS;
 }
 
+/** Get the expanded table for the table of a handle, creating it if necessary. */
+static bool_t acquire_expanded_table(converter_state_t *handle, const sbcs_converter_v1_t *tables) {
+  expanded_table_t *ptr;
+  uint_fast32_t codepoint;
+  unsigned int idx;
+
+  pthread_mutex_lock(&expanded_tables_lock);
+  for (ptr = expanded_tables; ptr != NULL && ptr->tables != tables; ptr = ptr->next) {
+  }
+
+  if (ptr == NULL) {
+    if ((ptr = malloc(sizeof(expanded_table_t))) == NULL) {
+      pthread_mutex_unlock(&expanded_tables_lock);
+      return FALSE;
+    }
+    ptr->tables = tables;
+    ptr->refcount = 0;
+    for (codepoint = 0; codepoint < UINT32_C(0x10000); codepoint++) {
+      idx = LOOKUP_IDX(codepoint);
+      ptr->codepoint_to_byte[codepoint] =
+          handle->tables.codepoint_to_byte_data[idx][codepoint & 0x1f];
+      if (handle->tables.codepoint_to_byte_flags != NULL &&
+          (handle->tables.codepoint_to_byte_flags[((idx << 5) + (codepoint & 0x1f)) >> 3] &
+           (1 << (codepoint & 7)))) {
+        ptr->codepoint_to_byte[codepoint] = 0;
+      }
+    }
+    ptr->next = expanded_tables;
+    expanded_tables = ptr;
+  }
+
+  ptr->refcount++;
+  handle->expanded = ptr;
+  pthread_mutex_unlock(&expanded_tables_lock);
+  return TRUE;
+}
+
+/** close implementation for SBCS table converters. */
+static void close_converter(converter_state_t *handle) {
+  expanded_table_t **ptr;
+
+  if (handle->expanded == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&expanded_tables_lock);
+  if (--handle->expanded->refcount == 0) {
+    for (ptr = &expanded_tables; *ptr != handle->expanded; ptr = &(*ptr)->next) {
+    }
+    *ptr = handle->expanded->next;
+    free(handle->expanded);
+  }
+  pthread_mutex_unlock(&expanded_tables_lock);
+}
+
+/** get_info implementation for SBCS table converters. */
+static void get_info(const converter_state_t *handle, transcript_info_t *info) {
+  uint_fast32_t codepoint;
+
+  info->flags =
+      TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_SELF_SYNCHRONIZING | TRANSCRIPT_INFO_SBCS;
+  info->max_char_bytes = 1;
+  info->max_from_unicode_bytes = 1;
+  info->max_to_unicode_codepoints = 1;
+
+  for (codepoint = 0; codepoint < 0x80; codepoint++) {
+    unsigned int idx = LOOKUP_IDX(codepoint);
+    if (handle->tables.byte_to_codepoint[codepoint] != codepoint ||
+        handle->tables.codepoint_to_byte_data[idx][codepoint & 0x1f] != codepoint) {
+      return;
+    }
+    if (handle->tables.byte_to_codepoint_flags[codepoint >> 3] & (1 << (codepoint & 7))) {
+      return;
+    }
+    if (handle->tables.codepoint_to_byte_flags != NULL &&
+        (handle->tables.codepoint_to_byte_flags[((idx << 5) + (codepoint & 0x1f)) >> 3] &
+         (1 << (codepoint & 7)))) {
+      return;
+    }
+  }
+  info->flags |= TRANSCRIPT_INFO_ASCII_TRANSPARENT;
+}
+
+/** get_encodable implementation for SBCS table converters. */
+static void get_encodable(converter_state_t *handle, uint32_t *bits) {
+  uint_fast32_t codepoint;
+  unsigned int idx;
+
+  for (codepoint = 0; codepoint < UINT32_C(0x10000); codepoint++) {
+    idx = LOOKUP_IDX(codepoint);
+    if (handle->tables.codepoint_to_byte_data[idx][codepoint & 0x1f] == 0 && codepoint != 0) {
+      continue;
+    }
+    if (handle->tables.codepoint_to_byte_flags != NULL &&
+        (handle->tables.codepoint_to_byte_flags[((idx << 5) + (codepoint & 0x1f)) >> 3] &
+         (1 << (codepoint & 7)))) {
+      continue;
+    }
+    SET_ENCODABLE(bits, codepoint);
+  }
+}
+
+/** clone implementation for SBCS table converters. */
+static transcript_t *clone_converter(const converter_state_t *handle, transcript_error_t *error) {
+  converter_state_t *retval;
+
+  if ((retval = transcript_clone_handle_nolock(&handle->common, sizeof(converter_state_t))) ==
+      NULL) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+
+  if (retval->expanded != NULL) {
+    pthread_mutex_lock(&expanded_tables_lock);
+    retval->expanded->refcount++;
+    pthread_mutex_unlock(&expanded_tables_lock);
+  }
+  return &retval->common;
+}
+
 /** @internal
     @brief Create a converter handle from an SBCS table handle.
     @param tables The SBCS table handle
@@ -195,7 +340,7 @@ void *_transcript_open_sbcs_table_converter(const sbcs_converter_v1_t *tables, i
     return NULL;
   }
 
-  if ((retval = malloc(sizeof(converter_state_t))) == NULL) {
+  if ((retval = transcript_alloc_handle_nolock(sizeof(converter_state_t))) == NULL) {
     if (error != NULL) {
       *error = TRANSCRIPT_OUT_OF_MEMORY;
     }
@@ -212,8 +357,21 @@ void *_transcript_open_sbcs_table_converter(const sbcs_converter_v1_t *tables, i
   retval->common.skip_to = (skip_func_t)to_unicode_skip;
   retval->common.reset_to = NULL;
   retval->common.flags = flags;
-  retval->common.close = NULL;
+  retval->common.close = (close_func_t)close_converter;
+  retval->common.clone = (clone_func_t)clone_converter;
   retval->common.save = NULL;
   retval->common.load = NULL;
+  retval->common.get_info = (info_func_t)get_info;
+  retval->common.get_encodable = (encodable_func_t)get_encodable;
+  retval->common.shared_size = SHARED_HANDLE_IMMUTABLE;
+
+  retval->expanded = NULL;
+  if ((flags & TRANSCRIPT_EXPANDED_TABLES) && !acquire_expanded_table(retval, tables)) {
+    transcript_handle_free(&retval->common, retval);
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
   return retval;
 }
@@ -14,6 +14,7 @@
 #include "static_assert.h"
 #include "transcript_internal.h"
 #include "utf.h"
+#include <pthread.h>
 #include <string.h>
 
 enum {
@@ -23,8 +24,15 @@ enum {
   SUBCHAR1_VALID = (1 << 3),
   MULTIBYTE_START_STATE_1 = (1 << 4),
   INTERNAL_TABLE = (1 << 5),
-  VARIANTS_AVAILABLE = (1 << 6)
+  VARIANTS_AVAILABLE = (1 << 6),
+  /* Structural properties computed by ucm2ltc. Tables written by older versions of ucm2ltc have
+     none of these bits set, and therefore report a maximum character length of 0 (unknown). */
+  INFO_STATELESS = (1 << 7),
+  INFO_ASCII_TRANSPARENT = (1 << 8),
+  INFO_SELF_SYNCHRONIZING = (1 << 9),
+  INFO_MAX_CHAR_BYTES_MASK = (7 << 10)
 };
+#define INFO_MAX_CHAR_BYTES_SHIFT 10
 
 enum action_t {
   ACTION_FINAL,
@@ -43,6 +51,13 @@ enum action_t {
   ACTION_UNASSIGNED,
   ACTION_SHIFT,
   ACTION_ILLEGAL,
+  /* Linear actions map a range of bytes to a range of consecutive values. The
+     mapping table only contains the value for the first byte of the range. */
+  ACTION_FINAL_LINEAR_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN1_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN2_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN3_NOFLAGS,
+  ACTION_FINAL_LINEAR_LEN4_NOFLAGS,
 
   ACTION_FLAG_PAIR = (1 << 7),
   ACTION_FINAL_PAIR = ACTION_FINAL | ACTION_FLAG_PAIR,
@@ -79,6 +94,48 @@ typedef struct {
   const uint8_t *bits2flags;
 } flag_handler_t;
 
+/** @struct generic_fallback_t
+    A generic fall-back, resolved against the from-Unicode table of a converter. */
+typedef struct {
+  uint16_t codepoint;
+  uint8_t conv_flags;
+  uint8_t bytes[MAX_CHAR_BYTES_V1];
+} generic_fallback_t;
+
+/** @struct generic_fallbacks_t
+    The resolved generic fall-backs for a table, shared by all handles using the table. */
+typedef struct generic_fallbacks_t {
+  struct generic_fallbacks_t *next;
+  const converter_v1_t *converter;
+  const variant_v1_t *variant;
+  int refcount;
+  size_t nr_fallbacks;
+  generic_fallback_t *fallbacks;
+} generic_fallbacks_t;
+
+/** @struct flat_entry_t
+    An entry of a flattened state, with the index offset precomputed for a single byte. */
+typedef struct {
+  uint32_t offset;
+  uint8_t next_state, action, delta;
+} flat_entry_t;
+
+/** @struct flat_state_t
+    A state with an entry for every byte value. */
+typedef struct {
+  flat_entry_t entries[256];
+} flat_state_t;
+
+/** @struct flat_tables_t
+    The flattened states of a converter, shared by all handles using the converter. */
+typedef struct flat_tables_t {
+  struct flat_tables_t *next;
+  const converter_v1_t *converter;
+  int refcount;
+  flat_state_t *codepage_states;
+  flat_state_t *unicode_states;
+} flat_tables_t;
+
 /** @struct converter_state_t
     Structure holding the pointers to the data and the state of a state table converter. */
 typedef struct {
@@ -86,12 +143,29 @@ typedef struct {
   converter_tables_v1_t tables;
   flag_handler_t codepage_flags;
   flag_handler_t unicode_flags;
+  generic_fallbacks_t *generic_fallbacks;
+  /* Flattened states, only available if the converter was opened with
+     TRANSCRIPT_EXPANDED_TABLES. Otherwise these are NULL. */
+  flat_tables_t *flat_tables;
+  const flat_state_t *flat_codepage_states;
+  const flat_state_t *flat_unicode_states;
   save_state_t state;
 } converter_state_t;
 
+static_assert(sizeof(converter_state_t) <= SHARED_HANDLE_MAX);
+
+/* The list of resolved generic fall-backs. Tables are only shared between handles
+   that use the same converter and variant. */
+static generic_fallbacks_t *generic_fallbacks_list;
+static pthread_mutex_t generic_fallbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The list of flattened state tables. */
+static flat_tables_t *flat_tables_list;
+static pthread_mutex_t flat_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static transcript_error_t to_unicode_skip(converter_state_t *handle, const char **inbuf,
                                           const char *inbuflimit);
-static bool_t init_flag_handler(flag_handler_t *flags, uint8_t flag_info);
+static bool_t init_flag_handler(flag_handler_t *flags, const flags_v1_t *table);
 
 /** Simplification macro for calling put_unicode which returns automatically on error. */
 #define PUT_UNICODE(codepoint)                                                   \
@@ -102,6 +176,35 @@ static bool_t init_flag_handler(flag_handler_t *flags, uint8_t flag_info);
       return result;                                                             \
   } while (0)
 
+/** Look up the entry for @a byte in @a state, using the flattened states if available.
+    This adds the index offset to @c idx, and stores the action and next state in
+    @c action and @c next_state.
+*/
+#define LOOKUP_ENTRY(states, flat_states, state, byte)                                     \
+  do {                                                                                     \
+    if ((flat_states) != NULL) {                                                           \
+      const flat_entry_t *_entry = &(flat_states)[state].entries[byte];                    \
+      idx += _entry->offset;                                                               \
+      action = _entry->action;                                                             \
+      next_state = _entry->next_state;                                                     \
+    } else {                                                                               \
+      const entry_v1_t *_entry = &(states)[state].entries[(states)[state].map[byte]];      \
+      idx += _entry->base + (uint_fast32_t)((byte) - _entry->low) * _entry->mul;           \
+      action = _entry->action;                                                             \
+      next_state = _entry->next_state;                                                     \
+    }                                                                                      \
+  } while (0)
+
+/** Get the offset of @a byte in the range of a linear entry. */
+static _TRANSCRIPT_INLINE uint_fast8_t get_linear_delta(const state_v1_t *states,
+                                                        const flat_state_t *flat_states,
+                                                        uint_fast8_t state, uint_fast8_t byte) {
+  if (flat_states != NULL) {
+    return flat_states[state].entries[byte].delta;
+  }
+  return byte - states[state].entries[states[state].map[byte]].low;
+}
+
 /** Get the minimum of two @c size_t values. */
 static _TRANSCRIPT_INLINE size_t min(size_t a, size_t b) { return a < b ? a : b; }
 
@@ -162,30 +265,40 @@ static transcript_error_t to_unicode_conversion(converter_state_t *handle, const
   uint_fast8_t state = handle->state.to;
   uint_fast32_t idx = handle->tables.converter->codepage_states[handle->state.to].base;
   uint_fast32_t codepoint;
-  const entry_v1_t *entry;
+  uint_fast8_t action, next_state;
   uint_fast8_t conv_flags;
 
   while (_inbuf < (const uint8_t *)inbuflimit) {
-    entry = &handle->tables.converter->codepage_states[state]
-                 .entries[handle->tables.converter->codepage_states[state].map[*_inbuf]];
-
-    idx += entry->base + (uint_fast32_t)(*_inbuf - entry->low) * entry->mul;
+    LOOKUP_ENTRY(handle->tables.converter->codepage_states, handle->flat_codepage_states, state,
+                 *_inbuf);
     _inbuf++;
 
-    if (entry->action == ACTION_FINAL_NOFLAGS) {
+    if (action == ACTION_FINAL_NOFLAGS) {
+      codepoint = handle->tables.converter->codepage_mappings[idx];
+      if (codepoint == UINT32_C(0xffff)) {
+        if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
+          return TRANSCRIPT_UNASSIGNED;
+        }
+        codepoint = UINT32_C(0xfffd);
+      }
+      PUT_UNICODE(codepoint);
+    } else if (action == ACTION_FINAL_LINEAR_NOFLAGS) {
       codepoint = handle->tables.converter->codepage_mappings[idx];
       if (codepoint == UINT32_C(0xffff)) {
         if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
           return TRANSCRIPT_UNASSIGNED;
         }
         codepoint = UINT32_C(0xfffd);
+      } else {
+        codepoint += get_linear_delta(handle->tables.converter->codepage_states,
+                                      handle->flat_codepage_states, state, _inbuf[-1]);
       }
       PUT_UNICODE(codepoint);
-    } else if (entry->action == ACTION_VALID) {
+    } else if (action == ACTION_VALID) {
       /* Sequence not complete yet... */
-      state = entry->next_state;
+      state = next_state;
       continue;
-    } else if (entry->action == ACTION_FINAL_PAIR_NOFLAGS) {
+    } else if (action == ACTION_FINAL_PAIR_NOFLAGS) {
       codepoint = handle->tables.converter->codepage_mappings[idx];
       if (codepoint == UINT32_C(0xffff)) {
         if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
@@ -199,7 +312,7 @@ static transcript_error_t to_unicode_conversion(converter_state_t *handle, const
         codepoint += 0x10000;
       }
       PUT_UNICODE(codepoint);
-    } else if (entry->action == ACTION_FINAL) {
+    } else if (action == ACTION_FINAL) {
       /* NOTE: we don't check for FINAL_PAIR, because that was converted when loading. */
       conv_flags = handle->codepage_flags.get_flags(&handle->tables.converter->codepage_flags,
                                                     handle->codepage_flags.bits2flags, idx);
@@ -262,7 +375,7 @@ static transcript_error_t to_unicode_conversion(converter_state_t *handle, const
              to the correct next input state we need to "parse" the
              input, so we use to_unicode_skip to update *inbuf. */
           _inbuf = (const uint8_t *)((*inbuf) + check_len);
-          handle->state.to = state = entry->next_state;
+          handle->state.to = state = next_state;
           while ((const uint8_t *)*inbuf < _inbuf) {
             if (to_unicode_skip(handle, inbuf, inbuflimit) != 0) {
               return TRANSCRIPT_INTERNAL_ERROR;
@@ -304,22 +417,22 @@ static transcript_error_t to_unicode_conversion(converter_state_t *handle, const
         }
         PUT_UNICODE(codepoint);
       }
-    } else if (entry->action == ACTION_ILLEGAL) {
+    } else if (action == ACTION_ILLEGAL) {
       if (!(flags & TRANSCRIPT_SUBST_ILLEGAL)) {
         return TRANSCRIPT_ILLEGAL;
       }
       PUT_UNICODE(UINT32_C(0xfffd));
-    } else if (entry->action == ACTION_UNASSIGNED) {
+    } else if (action == ACTION_UNASSIGNED) {
       if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
         return TRANSCRIPT_UNASSIGNED;
       }
       PUT_UNICODE(UINT32_C(0xfffd));
-    } else if (entry->action != ACTION_SHIFT) {
+    } else if (action != ACTION_SHIFT) {
       return TRANSCRIPT_INTERNAL_ERROR;
     }
     /* Update state. */
     *inbuf = (const char *)_inbuf;
-    handle->state.to = state = entry->next_state;
+    handle->state.to = state = next_state;
     idx = handle->tables.converter->codepage_states[handle->state.to].base;
 
     if (flags & TRANSCRIPT_SINGLE_CONVERSION) {
@@ -348,28 +461,27 @@ static transcript_error_t to_unicode_skip(converter_state_t *handle, const char
   const uint8_t *_inbuf = (const uint8_t *)*inbuf;
   uint_fast8_t state = handle->state.to;
   uint_fast32_t idx = handle->tables.converter->codepage_states[handle->state.to].base;
-  const entry_v1_t *entry;
+  uint_fast8_t action, next_state;
 
   while (_inbuf < (const uint8_t *)inbuflimit) {
-    entry = &handle->tables.converter->codepage_states[state]
-                 .entries[handle->tables.converter->codepage_states[state].map[*_inbuf]];
-
-    idx += entry->base + (uint_fast32_t)(*_inbuf - entry->low) * entry->mul;
+    LOOKUP_ENTRY(handle->tables.converter->codepage_states, handle->flat_codepage_states, state,
+                 *_inbuf);
     _inbuf++;
 
-    switch (entry->action) {
+    switch (action) {
       case ACTION_SHIFT:
       case ACTION_VALID:
-        state = entry->next_state;
+        state = next_state;
         break;
       case ACTION_FINAL:
       case ACTION_FINAL_PAIR:
       case ACTION_FINAL_NOFLAGS:
       case ACTION_FINAL_PAIR_NOFLAGS:
+      case ACTION_FINAL_LINEAR_NOFLAGS:
       case ACTION_ILLEGAL:
       case ACTION_UNASSIGNED:
         *inbuf = (const char *)_inbuf;
-        handle->state.to = state = entry->next_state;
+        handle->state.to = state = next_state;
         return TRANSCRIPT_SUCCESS;
       default:
         return TRANSCRIPT_INTERNAL_ERROR;
@@ -455,6 +567,24 @@ write_bytes:
   return TRANSCRIPT_SUCCESS;
 }
 
+/** Compute the bytes for a linear from-Unicode entry.
+    @param result The location to store the bytes.
+    @param bytes The bytes for the first codepoint in the range, in big-endian order.
+    @param length The number of bytes.
+    @param delta The offset of the codepoint in the range.
+*/
+static void get_linear_bytes(uint8_t *result, const uint8_t *bytes, size_t length,
+                             uint_fast8_t delta) {
+  uint_fast16_t sum = delta;
+
+  while (length > 0) {
+    length--;
+    sum += bytes[length];
+    result[length] = sum & 0xff;
+    sum >>= 8;
+  }
+}
+
 /** Check if the current input is a multi-mapping for a from-Unicode conversion. */
 static int from_unicode_check_multi_mappings(converter_state_t *handle, const char **inbuf,
                                              const char *inbuflimit, char **outbuf,
@@ -596,6 +726,64 @@ static void find_from_unicode_variant(const variant_v1_t *variant, uint32_t code
   *bytes = (uint8_t *)&mapping->codepage_bytes;
 }
 
+/** Find the generic fall-back for a codepoint which is unassigned in the table. */
+static const generic_fallback_t *find_generic_fallback(const generic_fallbacks_t *generic_fallbacks,
+                                                       uint_fast32_t codepoint) {
+  size_t low, high, mid;
+
+  low = 0;
+  high = generic_fallbacks->nr_fallbacks;
+  while (low < high) {
+    mid = low + ((high - low) / 2);
+    if (generic_fallbacks->fallbacks[mid].codepoint < codepoint) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == generic_fallbacks->nr_fallbacks ||
+      generic_fallbacks->fallbacks[low].codepoint != codepoint) {
+    return NULL;
+  }
+  return &generic_fallbacks->fallbacks[low];
+}
+
+/** Handle an unassigned codepoint in a from-Unicode conversion.
+    @param conv_flags The flags for @a codepoint, used to select the substitution character.
+
+    This applies the generic fall-back for @a codepoint if one exists, using the
+    pre-resolved generic fall-backs. This avoids the reentrant conversion
+    ::transcript_handle_unassigned would use.
+*/
+static transcript_error_t handle_unassigned(converter_state_t *handle, uint_fast32_t codepoint,
+                                            uint_fast8_t conv_flags, char **outbuf,
+                                            const char *outbuflimit, int flags) {
+  const generic_fallback_t *fallback;
+
+  if (!(flags & TRANSCRIPT_HANDLING_UNASSIGNED) && codepoint <= UINT32_C(0xffff) &&
+      (fallback = find_generic_fallback(handle->generic_fallbacks, codepoint)) != NULL) {
+    if (!(flags & TRANSCRIPT_ALLOW_FALLBACK)) {
+      return TRANSCRIPT_FALLBACK;
+    }
+    if (!(fallback->conv_flags & FROM_UNICODE_NOT_AVAIL)) {
+      return put_bytes(handle, outbuf, outbuflimit,
+                       (fallback->conv_flags & FROM_UNICODE_LENGTH_MASK) + 1, fallback->bytes);
+    }
+    /* The target of the fall-back is not available either, so the substitution
+       character is determined by the target. */
+    conv_flags = fallback->conv_flags;
+  }
+
+  if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
+    return TRANSCRIPT_UNASSIGNED;
+  }
+  if (conv_flags & FROM_UNICODE_SUBCHAR1) {
+    return put_bytes(handle, outbuf, outbuflimit, 1, &handle->tables.converter->subchar1);
+  }
+  return put_bytes(handle, outbuf, outbuflimit, handle->tables.converter->subchar_len,
+                   handle->tables.converter->subchar);
+}
+
 /** convert_from implementation for state table converters. */
 static transcript_error_t from_unicode_conversion(converter_state_t *handle, const char **inbuf,
                                                   const char *inbuflimit, char **outbuf,
@@ -604,16 +792,18 @@ static transcript_error_t from_unicode_conversion(converter_state_t *handle, con
   uint_fast8_t state, state_16_bit;
   uint_fast32_t idx;
   uint_fast32_t codepoint;
-  const entry_v1_t *entry;
+  uint_fast8_t action, next_state;
   uint_fast8_t byte;
   uint_fast8_t conv_flags;
   const uint8_t *bytes;
+  uint8_t linear_bytes[MAX_CHAR_BYTES_V1];
+  transcript_error_t result;
 
   _inbuf = (const uint8_t *)*inbuf;
 
-  entry = &handle->tables.converter->unicode_states[0]
-               .entries[handle->tables.converter->unicode_states[0].map[0]];
-  state_16_bit = entry->next_state;
+  idx = 0;
+  LOOKUP_ENTRY(handle->tables.converter->unicode_states, handle->flat_unicode_states, 0, 0);
+  state_16_bit = next_state;
 
   while (*inbuf < inbuflimit) {
     GET_UNICODE();
@@ -635,34 +825,40 @@ static transcript_error_t from_unicode_conversion(converter_state_t *handle, con
        byte-by-byte loop. */
 
     /* Optimize common case by not doing an actual lookup when the first byte is 0. */
+    idx = 0;
     if (codepoint > UINT32_C(0xffff)) {
       byte = (codepoint >> 16) & 0xff;
-      entry = &handle->tables.converter->unicode_states[0]
-                   .entries[handle->tables.converter->unicode_states[0].map[byte]];
-      idx = entry->base + (byte - entry->low) * entry->mul;
-      state = entry->next_state;
+      LOOKUP_ENTRY(handle->tables.converter->unicode_states, handle->flat_unicode_states, 0,
+                   byte);
+      state = next_state;
     } else {
-      idx = 0;
       state = state_16_bit;
     }
 
     byte = (codepoint >> 8) & 0xff;
-    entry = &handle->tables.converter->unicode_states[state]
-                 .entries[handle->tables.converter->unicode_states[state].map[byte]];
-    idx += entry->base + (byte - entry->low) * entry->mul;
-    state = entry->next_state;
+    LOOKUP_ENTRY(handle->tables.converter->unicode_states, handle->flat_unicode_states, state,
+                 byte);
+    state = next_state;
 
     byte = codepoint & 0xff;
-    entry = &handle->tables.converter->unicode_states[state]
-                 .entries[handle->tables.converter->unicode_states[state].map[byte]];
-    idx += entry->base + (byte - entry->low) * entry->mul;
+    LOOKUP_ENTRY(handle->tables.converter->unicode_states, handle->flat_unicode_states, state,
+                 byte);
 
     /* First check for the most common case: a simple conversion without any special flags. */
-    if (entry->action >= ACTION_FINAL_LEN1_NOFLAGS && entry->action <= ACTION_FINAL_LEN4_NOFLAGS) {
+    if (action >= ACTION_FINAL_LEN1_NOFLAGS && action <= ACTION_FINAL_LEN4_NOFLAGS) {
       bytes =
           &handle->tables.converter->unicode_mappings[idx * handle->tables.converter->single_size];
-      PUT_BYTES(entry->action - ACTION_FINAL_LEN1_NOFLAGS + 1, bytes);
-    } else if (entry->action == ACTION_FINAL) {
+      PUT_BYTES(action - ACTION_FINAL_LEN1_NOFLAGS + 1, bytes);
+    } else if (action >= ACTION_FINAL_LINEAR_LEN1_NOFLAGS &&
+               action <= ACTION_FINAL_LINEAR_LEN4_NOFLAGS) {
+      get_linear_bytes(
+          linear_bytes,
+          &handle->tables.converter->unicode_mappings[idx * handle->tables.converter->single_size],
+          action - ACTION_FINAL_LINEAR_LEN1_NOFLAGS + 1,
+          get_linear_delta(handle->tables.converter->unicode_states, handle->flat_unicode_states,
+                           state, byte));
+      PUT_BYTES(action - ACTION_FINAL_LINEAR_LEN1_NOFLAGS + 1, linear_bytes);
+    } else if (action == ACTION_FINAL) {
       conv_flags = handle->unicode_flags.get_flags(&handle->tables.converter->unicode_flags,
                                                    handle->unicode_flags.bits2flags, idx);
       if ((conv_flags & FROM_UNICODE_MULTI_START) &&
@@ -702,27 +898,23 @@ static transcript_error_t from_unicode_conversion(converter_state_t *handle, con
       }
 
       if (conv_flags & FROM_UNICODE_NOT_AVAIL) {
-        /* The HANDLE_UNASSIGNED macro first checks for generic call-backs, and
-           uses the code in parentheses when even that doesn't result in a mapping. */
-        HANDLE_UNASSIGNED(if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) return TRANSCRIPT_UNASSIGNED;
-                          if (conv_flags & FROM_UNICODE_SUBCHAR1)
-                              PUT_BYTES(1, &handle->tables.converter->subchar1);
-                          else PUT_BYTES(handle->tables.converter->subchar_len,
-                                         handle->tables.converter->subchar);)
+        if ((result = handle_unassigned(handle, codepoint, conv_flags, outbuf, outbuflimit,
+                                        flags)) != TRANSCRIPT_SUCCESS) {
+          return result;
+        }
       } else {
         PUT_BYTES((conv_flags & FROM_UNICODE_LENGTH_MASK) + 1, bytes);
       }
-    } else if (entry->action == ACTION_ILLEGAL) {
+    } else if (action == ACTION_ILLEGAL) {
       if (!(flags & TRANSCRIPT_SUBST_ILLEGAL)) {
         return TRANSCRIPT_ILLEGAL;
       }
       PUT_BYTES(handle->tables.converter->subchar_len, handle->tables.converter->subchar);
-    } else if (entry->action == ACTION_UNASSIGNED) {
-      /* The HANDLE_UNASSIGNED macro first checks for generic call-backs, and
-         uses the code in parentheses when even that doesn't result in a mapping. */
-      HANDLE_UNASSIGNED(
-          if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) return TRANSCRIPT_UNASSIGNED;
-          PUT_BYTES(handle->tables.converter->subchar_len, handle->tables.converter->subchar);)
+    } else if (action == ACTION_UNASSIGNED) {
+      if ((result = handle_unassigned(handle, codepoint, 0, outbuf, outbuflimit, flags)) !=
+          TRANSCRIPT_SUCCESS) {
+        return result;
+      }
     } else {
       return TRANSCRIPT_INTERNAL_ERROR;
     }
@@ -769,6 +961,318 @@ static void load_state_table_state(converter_state_t *handle, save_state_t *save
   memcpy(&handle->state, save, sizeof(save_state_t));
 }
 
+/** Look up a codepoint in the from-Unicode table.
+    @param conv_flags The location to store the flags of the mapping.
+    @param bytes The location to store the bytes of the mapping, which must have room
+        for ::MAX_CHAR_BYTES_V1 bytes.
+
+    Unassigned and illegal codepoints are reported with ::FROM_UNICODE_NOT_AVAIL
+    set in @a conv_flags. Multi-mappings are not considered.
+*/
+static void lookup_codepoint(converter_state_t *handle, uint_fast32_t codepoint,
+                             uint_fast8_t *conv_flags, uint8_t *bytes) {
+  const converter_v1_t *converter = handle->tables.converter;
+  const entry_v1_t *entry;
+  const uint8_t *mapping_bytes;
+  uint_fast32_t idx;
+  uint_fast8_t state, byte;
+
+  byte = (codepoint >> 16) & 0xff;
+  entry = &converter->unicode_states[0].entries[converter->unicode_states[0].map[byte]];
+  /* Like in from_unicode_conversion, the first byte only contributes to the index for
+     codepoints outside the BMP. */
+  idx = codepoint > UINT32_C(0xffff) ? entry->base + (byte - entry->low) * entry->mul : 0;
+  state = entry->next_state;
+
+  byte = (codepoint >> 8) & 0xff;
+  entry = &converter->unicode_states[state].entries[converter->unicode_states[state].map[byte]];
+  idx += entry->base + (byte - entry->low) * entry->mul;
+  state = entry->next_state;
+
+  byte = codepoint & 0xff;
+  entry = &converter->unicode_states[state].entries[converter->unicode_states[state].map[byte]];
+  idx += entry->base + (byte - entry->low) * entry->mul;
+
+  mapping_bytes = &converter->unicode_mappings[idx * converter->single_size];
+  if (entry->action >= ACTION_FINAL_LEN1_NOFLAGS && entry->action <= ACTION_FINAL_LEN4_NOFLAGS) {
+    *conv_flags = entry->action - ACTION_FINAL_LEN1_NOFLAGS;
+  } else if (entry->action >= ACTION_FINAL_LINEAR_LEN1_NOFLAGS &&
+             entry->action <= ACTION_FINAL_LINEAR_LEN4_NOFLAGS) {
+    *conv_flags = entry->action - ACTION_FINAL_LINEAR_LEN1_NOFLAGS;
+    get_linear_bytes(bytes, mapping_bytes, *conv_flags + 1, byte - entry->low);
+    return;
+  } else if (entry->action == ACTION_FINAL) {
+    *conv_flags = handle->unicode_flags.get_flags(&converter->unicode_flags,
+                                                  handle->unicode_flags.bits2flags, idx);
+    if (*conv_flags & FROM_UNICODE_VARIANT) {
+      find_from_unicode_variant(handle->tables.variant, codepoint, conv_flags, &mapping_bytes);
+    }
+  } else {
+    *conv_flags = FROM_UNICODE_NOT_AVAIL;
+    return;
+  }
+  memcpy(bytes, mapping_bytes, (*conv_flags & FROM_UNICODE_LENGTH_MASK) + 1);
+}
+
+/** Get the resolved generic fall-backs for the table of a handle, creating them if necessary.
+
+    For each codepoint with a generic fall-back which is not mapped by the table,
+    the mapping of the fall-back target is stored. This allows the conversion to
+    handle generic fall-backs in the main loop.
+*/
+static bool_t acquire_generic_fallbacks(converter_state_t *handle) {
+  generic_fallbacks_t *ptr;
+  const uint16_t *sources;
+  size_t nr_sources, i;
+  uint_fast8_t conv_flags;
+  uint8_t bytes[MAX_CHAR_BYTES_V1];
+
+  pthread_mutex_lock(&generic_fallbacks_lock);
+  for (ptr = generic_fallbacks_list; ptr != NULL; ptr = ptr->next) {
+    if (ptr->converter == handle->tables.converter && ptr->variant == handle->tables.variant) {
+      break;
+    }
+  }
+
+  if (ptr == NULL) {
+    nr_sources = _transcript_get_generic_fallback_sources(&sources);
+    if ((ptr = malloc(sizeof(generic_fallbacks_t) + nr_sources * sizeof(generic_fallback_t))) ==
+        NULL) {
+      pthread_mutex_unlock(&generic_fallbacks_lock);
+      return FALSE;
+    }
+    ptr->converter = handle->tables.converter;
+    ptr->variant = handle->tables.variant;
+    ptr->refcount = 0;
+    ptr->nr_fallbacks = 0;
+    ptr->fallbacks = (generic_fallback_t *)(ptr + 1);
+
+    for (i = 0; i < nr_sources; i++) {
+      lookup_codepoint(handle, sources[i], &conv_flags, bytes);
+      if (!(conv_flags & FROM_UNICODE_NOT_AVAIL)) {
+        continue;
+      }
+      lookup_codepoint(handle, transcript_get_generic_fallback(sources[i]), &conv_flags, bytes);
+      ptr->fallbacks[ptr->nr_fallbacks].codepoint = sources[i];
+      ptr->fallbacks[ptr->nr_fallbacks].conv_flags =
+          conv_flags & (FROM_UNICODE_LENGTH_MASK | FROM_UNICODE_NOT_AVAIL | FROM_UNICODE_SUBCHAR1);
+      if (!(conv_flags & FROM_UNICODE_NOT_AVAIL)) {
+        memcpy(ptr->fallbacks[ptr->nr_fallbacks].bytes, bytes,
+               (conv_flags & FROM_UNICODE_LENGTH_MASK) + 1);
+      }
+      ptr->nr_fallbacks++;
+    }
+    ptr->next = generic_fallbacks_list;
+    generic_fallbacks_list = ptr;
+  }
+
+  ptr->refcount++;
+  handle->generic_fallbacks = ptr;
+  pthread_mutex_unlock(&generic_fallbacks_lock);
+  return TRUE;
+}
+
+/** Flatten the states reachable from state 0 into arrays with an entry for every byte. */
+static flat_state_t *flatten_states(const state_v1_t *states) {
+  bool_t reachable[256];
+  uint8_t todo[256];
+  int nr_todo = 0, max_state = 0, state, byte;
+  const entry_v1_t *entry;
+  flat_state_t *flat_states;
+
+  memset(reachable, 0, sizeof(reachable));
+  reachable[0] = TRUE;
+  todo[nr_todo++] = 0;
+  while (nr_todo > 0) {
+    state = todo[--nr_todo];
+    for (byte = 0; byte < 256; byte++) {
+      entry = &states[state].entries[states[state].map[byte]];
+      if (!reachable[entry->next_state]) {
+        reachable[entry->next_state] = TRUE;
+        todo[nr_todo++] = entry->next_state;
+        if (entry->next_state > max_state) {
+          max_state = entry->next_state;
+        }
+      }
+    }
+  }
+
+  if ((flat_states = calloc(max_state + 1, sizeof(flat_state_t))) == NULL) {
+    return NULL;
+  }
+
+  for (state = 0; state <= max_state; state++) {
+    if (!reachable[state]) {
+      continue;
+    }
+    for (byte = 0; byte < 256; byte++) {
+      entry = &states[state].entries[states[state].map[byte]];
+      flat_states[state].entries[byte].offset = entry->base + (byte - entry->low) * entry->mul;
+      flat_states[state].entries[byte].next_state = entry->next_state;
+      flat_states[state].entries[byte].action = entry->action;
+      flat_states[state].entries[byte].delta = byte - entry->low;
+    }
+  }
+  return flat_states;
+}
+
+/** Get the flattened states for the converter of a handle, creating them if necessary. */
+static bool_t acquire_flat_tables(converter_state_t *handle) {
+  flat_tables_t *ptr;
+
+  pthread_mutex_lock(&flat_tables_lock);
+  for (ptr = flat_tables_list; ptr != NULL && ptr->converter != handle->tables.converter;
+       ptr = ptr->next) {
+  }
+
+  if (ptr == NULL) {
+    if ((ptr = malloc(sizeof(flat_tables_t))) == NULL) {
+      goto end_error;
+    }
+    ptr->converter = handle->tables.converter;
+    ptr->refcount = 0;
+    ptr->unicode_states = NULL;
+    if ((ptr->codepage_states = flatten_states(handle->tables.converter->codepage_states)) ==
+            NULL ||
+        (ptr->unicode_states = flatten_states(handle->tables.converter->unicode_states)) == NULL) {
+      free(ptr->codepage_states);
+      free(ptr);
+      goto end_error;
+    }
+    ptr->next = flat_tables_list;
+    flat_tables_list = ptr;
+  }
+
+  ptr->refcount++;
+  handle->flat_tables = ptr;
+  handle->flat_codepage_states = ptr->codepage_states;
+  handle->flat_unicode_states = ptr->unicode_states;
+  pthread_mutex_unlock(&flat_tables_lock);
+  return TRUE;
+
+end_error:
+  pthread_mutex_unlock(&flat_tables_lock);
+  return FALSE;
+}
+
+/** close implementation for state table converters. */
+static void close_converter(converter_state_t *handle) {
+  generic_fallbacks_t **ptr;
+  flat_tables_t **flat_ptr;
+
+  pthread_mutex_lock(&generic_fallbacks_lock);
+  if (--handle->generic_fallbacks->refcount == 0) {
+    for (ptr = &generic_fallbacks_list; *ptr != handle->generic_fallbacks; ptr = &(*ptr)->next) {
+    }
+    *ptr = handle->generic_fallbacks->next;
+    free(handle->generic_fallbacks);
+  }
+  pthread_mutex_unlock(&generic_fallbacks_lock);
+
+  if (handle->flat_tables == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&flat_tables_lock);
+  if (--handle->flat_tables->refcount == 0) {
+    for (flat_ptr = &flat_tables_list; *flat_ptr != handle->flat_tables;
+         flat_ptr = &(*flat_ptr)->next) {
+    }
+    *flat_ptr = handle->flat_tables->next;
+    free(handle->flat_tables->codepage_states);
+    free(handle->flat_tables->unicode_states);
+    free(handle->flat_tables);
+  }
+  pthread_mutex_unlock(&flat_tables_lock);
+}
+
+/** get_info implementation for state table converters. */
+static void get_info(const converter_state_t *handle, transcript_info_t *info) {
+  const converter_v1_t *converter = handle->tables.converter;
+  int max_shift_bytes = 0;
+  uint_fast32_t i;
+
+  info->flags = 0;
+  if (converter->flags & INFO_STATELESS) {
+    info->flags |= TRANSCRIPT_INFO_STATELESS;
+  }
+  if (converter->flags & INFO_ASCII_TRANSPARENT) {
+    info->flags |= TRANSCRIPT_INFO_ASCII_TRANSPARENT;
+  }
+  if (converter->flags & INFO_SELF_SYNCHRONIZING) {
+    info->flags |= TRANSCRIPT_INFO_SELF_SYNCHRONIZING;
+  }
+  if (handle->tables.variant != NULL) {
+    info->flags |= TRANSCRIPT_INFO_VARIANTS;
+  }
+  info->max_char_bytes = (converter->flags & INFO_MAX_CHAR_BYTES_MASK) >> INFO_MAX_CHAR_BYTES_SHIFT;
+  if (info->max_char_bytes == 1) {
+    info->flags |= TRANSCRIPT_INFO_SBCS;
+  }
+
+  for (i = 0; i < converter->nr_shift_states; i++) {
+    if (converter->shift_states[i].len > max_shift_bytes) {
+      max_shift_bytes = converter->shift_states[i].len;
+    }
+  }
+  info->max_from_unicode_bytes = info->max_char_bytes == 0 ? 0 : info->max_char_bytes +
+                                                                      max_shift_bytes;
+  info->max_to_unicode_codepoints = 1;
+
+  if (handle->tables.nr_multi_mappings != 0) {
+    info->flags |= TRANSCRIPT_INFO_MULTI_MAPPINGS;
+    info->flags &= ~TRANSCRIPT_INFO_SBCS;
+  }
+  for (i = 0; i < handle->tables.nr_multi_mappings; i++) {
+    const multi_mapping_v1_t *mapping = handle->tables.codepage_sorted_multi_mappings[i];
+    if (mapping->codepoints_length > info->max_to_unicode_codepoints) {
+      info->max_to_unicode_codepoints = mapping->codepoints_length;
+    }
+    if (info->max_from_unicode_bytes != 0 &&
+        mapping->bytes_length + max_shift_bytes > info->max_from_unicode_bytes) {
+      info->max_from_unicode_bytes = mapping->bytes_length + max_shift_bytes;
+    }
+  }
+}
+
+/** get_encodable implementation for state table converters. */
+static void get_encodable(converter_state_t *handle, uint32_t *bits) {
+  uint8_t bytes[MAX_CHAR_BYTES_V1];
+  uint_fast32_t codepoint;
+  uint_fast8_t conv_flags;
+
+  for (codepoint = 0; codepoint < UINT32_C(0x110000); codepoint++) {
+    lookup_codepoint(handle, codepoint, &conv_flags, bytes);
+    if (!(conv_flags & (FROM_UNICODE_NOT_AVAIL | FROM_UNICODE_FALLBACK))) {
+      SET_ENCODABLE(bits, codepoint);
+    }
+  }
+}
+
+/** clone implementation for state table converters. */
+static transcript_t *clone_converter(const converter_state_t *handle, transcript_error_t *error) {
+  converter_state_t *retval;
+
+  if ((retval = transcript_clone_handle_nolock(&handle->common, sizeof(converter_state_t))) ==
+      NULL) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+
+  pthread_mutex_lock(&generic_fallbacks_lock);
+  retval->generic_fallbacks->refcount++;
+  pthread_mutex_unlock(&generic_fallbacks_lock);
+
+  if (retval->flat_tables != NULL) {
+    pthread_mutex_lock(&flat_tables_lock);
+    retval->flat_tables->refcount++;
+    pthread_mutex_unlock(&flat_tables_lock);
+  }
+  return &retval->common;
+}
+
 /** @internal
     @brief Load a state table table and create a converter handle from it.
     @param name The name of the converter, which must correspond to a file name.
@@ -788,7 +1292,7 @@ void *_transcript_open_state_table_converter(const converter_tables_v1_t *tables
     return NULL;
   }
 
-  if ((retval = malloc(sizeof(converter_state_t))) == NULL) {
+  if ((retval = transcript_alloc_handle_nolock(sizeof(converter_state_t))) == NULL) {
     if (error != NULL) {
       *error = TRANSCRIPT_OUT_OF_MEMORY;
     }
@@ -806,12 +1310,42 @@ void *_transcript_open_state_table_converter(const converter_tables_v1_t *tables
   retval->common.skip_to = (skip_func_t)to_unicode_skip;
   retval->common.reset_to = (reset_func_t)to_unicode_reset;
   retval->common.flags = flags;
-  retval->common.close = NULL;
+  retval->common.close = (close_func_t)close_converter;
+  retval->common.clone = (clone_func_t)clone_converter;
   retval->common.save = (save_load_func_t)save_state_table_state;
   retval->common.load = (save_load_func_t)load_state_table_state;
+  retval->common.get_info = (info_func_t)get_info;
+  retval->common.get_encodable = (encodable_func_t)get_encodable;
+  retval->common.shared_size = sizeof(converter_state_t);
 
-  init_flag_handler(&retval->codepage_flags, tables->converter->codepage_flags.flags_type);
-  init_flag_handler(&retval->unicode_flags, tables->converter->unicode_flags.flags_type);
+  if (!init_flag_handler(&retval->codepage_flags, &tables->converter->codepage_flags) ||
+      !init_flag_handler(&retval->unicode_flags, &tables->converter->unicode_flags)) {
+    transcript_handle_free(&retval->common, retval);
+    if (error != NULL) {
+      *error = TRANSCRIPT_INVALID_FORMAT;
+    }
+    return NULL;
+  }
+
+  retval->flat_tables = NULL;
+  retval->flat_codepage_states = NULL;
+  retval->flat_unicode_states = NULL;
+
+  if (!acquire_generic_fallbacks(retval)) {
+    transcript_handle_free(&retval->common, retval);
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+  if ((flags & TRANSCRIPT_EXPANDED_TABLES) && !acquire_flat_tables(retval)) {
+    close_converter(retval);
+    transcript_handle_free(&retval->common, retval);
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
   return retval;
 }
 
@@ -854,24 +1388,51 @@ static uint8_t get_flags_8_trie(const flags_v1_t *flags, const uint8_t *bits2fla
   return get_flags_8(flags, bits2flags, (idx & 15) + (flags->indices[idx >> 4] << 4));
 }
 
-static bool_t init_flag_handler(flag_handler_t *flags, uint8_t flag_info) {
-  bool_t trie;
+/* Versions of the trie look-up functions for tables which use a block size other than the
+   default of 16 bytes. The number of flags per block is 1 << (block_bits + log2(8 / bits)). */
+#define GET_TRIE_IDX(flags, idx, shift)       \
+  (((idx) & ((UINT32_C(1) << (shift)) - 1)) + \
+   ((uint_fast32_t)(flags)->indices[(idx) >> (shift)] << (shift)))
+
+static uint8_t get_flags_1_trie_sized(const flags_v1_t *flags, const uint8_t *bits2flags,
+                                      uint_fast32_t idx) {
+  return get_flags_1(flags, bits2flags, GET_TRIE_IDX(flags, idx, flags->block_bits + 3));
+}
+static uint8_t get_flags_2_trie_sized(const flags_v1_t *flags, const uint8_t *bits2flags,
+                                      uint_fast32_t idx) {
+  return get_flags_2(flags, bits2flags, GET_TRIE_IDX(flags, idx, flags->block_bits + 2));
+}
+static uint8_t get_flags_4_trie_sized(const flags_v1_t *flags, const uint8_t *bits2flags,
+                                      uint_fast32_t idx) {
+  return get_flags_4(flags, bits2flags, GET_TRIE_IDX(flags, idx, flags->block_bits + 1));
+}
+static uint8_t get_flags_8_trie_sized(const flags_v1_t *flags, const uint8_t *bits2flags,
+                                      uint_fast32_t idx) {
+  return get_flags_8(flags, bits2flags, GET_TRIE_IDX(flags, idx, flags->block_bits));
+}
+#undef GET_TRIE_IDX
+
+static bool_t init_flag_handler(flag_handler_t *flags, const flags_v1_t *table) {
+  uint8_t flag_info = table->flags_type;
+  bool_t trie, sized;
 
   trie = (flag_info & 0x80) != 0;
+  /* A block size of 16 bytes is handled by the functions with fixed shifts. */
+  sized = trie && table->block_bits != 0 && table->block_bits != 4;
   flag_info &= 0x7f;
-  if (flag_info > 106) {
+  if (flag_info > 106 || table->block_bits > 7) {
     return FALSE;
   } else if (flag_info > 98) {
     flags->bits2flags = bits2flags1[flag_info - 99];
-    flags->get_flags = trie ? get_flags_1_trie : get_flags_1;
+    flags->get_flags = sized ? get_flags_1_trie_sized : trie ? get_flags_1_trie : get_flags_1;
   } else if (flag_info > 70) {
     flags->bits2flags = bits2flags2[flag_info - 71];
-    flags->get_flags = trie ? get_flags_2_trie : get_flags_2;
+    flags->get_flags = sized ? get_flags_2_trie_sized : trie ? get_flags_2_trie : get_flags_2;
   } else if (flag_info > 0) {
     flags->bits2flags = bits2flags4[flag_info - 1];
-    flags->get_flags = trie ? get_flags_4_trie : get_flags_4;
+    flags->get_flags = sized ? get_flags_4_trie_sized : trie ? get_flags_4_trie : get_flags_4;
   } else {
-    flags->get_flags = trie ? get_flags_8_trie : get_flags_8;
+    flags->get_flags = sized ? get_flags_8_trie_sized : trie ? get_flags_8_trie : get_flags_8;
   }
   return TRUE;
 }
@@ -57,10 +57,13 @@ const char **_transcript_search_path;
 static const char path_sep[] = {LT_PATHSEP_CHAR, '\0'};
 static char *transcript_path;
 int _transcript_initialized_count = 0;
+static uint16_t *generic_fallback_sources;
+static size_t nr_generic_fallback_sources;
 
 static void init_char_info(void);
 static char *ts_strtok(char *string, const char *separators, char **state);
 static void add_search_dir(const char *dir);
+static transcript_error_t init_generic_fallback_sources(void);
 
 /*================ API functions ===============*/
 /** Check if a named converter is available.
@@ -120,12 +123,196 @@ void transcript_close_converter(transcript_t *handle) {
       handle->close(handle);
     }
     ACQUIRE_LOCK();
-    lt_dlclose(handle->library_handle);
+    _transcript_release_library(handle->library_handle);
     RELEASE_LOCK();
-    free(handle);
+    transcript_handle_free(handle, handle);
   }
 }
 
+/** Create a copy of a converter.
+    @param handle The converter to copy.
+    @param error The location to store a possible error code.
+    @return A new converter, or @c NULL on failure.
+
+    The new converter starts in the same state as @a handle, but is otherwise
+    independent of it. It shares all tables with @a handle, so cloning avoids the
+    name look-up, plugin loading and table set-up of ::transcript_open_converter.
+    The clone uses the same allocator as @a handle (see
+    ::transcript_open_converter_with_allocator). Like any other converter, it
+    must be closed with ::transcript_close_converter.
+*/
+transcript_t *transcript_clone_converter(const transcript_t *handle, transcript_error_t *error) {
+  transcript_t *result;
+
+  ACQUIRE_LOCK();
+  result = transcript_clone_converter_nolock(handle, error);
+  RELEASE_LOCK();
+  return result;
+}
+
+/** Open a converter, using the specified allocator for its memory.
+    @param name The name of the converter to open.
+    @param utf_type The UTF type to use for representing Unicode codepoints.
+    @param flags The default flags for the converter (see ::transcript_flags_t for possible values).
+    @param allocator The allocator to use, or @c NULL to use malloc.
+    @param error The location to store a possible error code.
+
+    The allocator is used for the handle and for any memory the converter needs
+    for this handle only, including the handles of sub-converters which belong to
+    this handle alone, such as the plane converters of EUC-TW. Tables and
+    sub-converters which are shared between handles, such as the character set
+    converters of ISO-2022, are still allocated with malloc, as is any memory
+    which is only allocated when a conversion first needs it. The converter must
+    still be closed with
+    ::transcript_close_converter, which releases the memory through
+    @c allocator->free if it is not @c NULL.
+*/
+transcript_t *transcript_open_converter_with_allocator(const char *name, transcript_utf_t utf_type,
+                                                       int flags,
+                                                       const transcript_allocator_t *allocator,
+                                                       transcript_error_t *error) {
+  const transcript_allocator_t *previous;
+  transcript_t *result;
+
+  ACQUIRE_LOCK();
+  if (!_transcript_initialized_count) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_NOT_INITIALIZED;
+    }
+    result = NULL;
+  } else {
+    previous = _transcript_set_allocator(allocator);
+    result = transcript_open_converter_nolock(name, utf_type, flags, error);
+    _transcript_set_allocator(previous);
+  }
+  RELEASE_LOCK();
+  return result;
+}
+
+/** @internal Alignment of the blocks handed out by ::transcript_open_converter_at. */
+#define PLACEMENT_ALIGN 16
+/** @internal Round @a size up to a multiple of ::PLACEMENT_ALIGN. */
+#define ALIGN_SIZE(size) (((size) + PLACEMENT_ALIGN - 1) & ~(size_t)(PLACEMENT_ALIGN - 1))
+
+/** @internal
+    @brief Allocator which hands out consecutive blocks from caller-provided memory.
+*/
+typedef struct {
+  transcript_allocator_t allocator;
+  char *next;
+  char *limit;
+} placement_t;
+
+/** @internal
+    @brief Allocator which counts the memory required by a converter.
+*/
+typedef struct {
+  transcript_allocator_t allocator;
+  size_t total;
+} size_query_t;
+
+/** @internal */
+static void *placement_alloc(void *data, size_t size) {
+  placement_t *placement = data;
+  void *result;
+
+  size = ALIGN_SIZE(size);
+  if ((size_t)(placement->limit - placement->next) < size) {
+    return NULL;
+  }
+  result = placement->next;
+  placement->next += size;
+  return result;
+}
+
+/** @internal */
+static void *size_query_alloc(void *data, size_t size) {
+  ((size_query_t *)data)->total += ALIGN_SIZE(size);
+  return malloc(size);
+}
+
+/** @internal */
+static void size_query_free(void *data, void *ptr) {
+  (void)data;
+  free(ptr);
+}
+
+/** Determine how much memory ::transcript_open_converter_at needs for a converter.
+    @param name The name of the converter.
+    @param utf_type The UTF type to use for representing Unicode codepoints.
+    @param flags The default flags for the converter (see ::transcript_flags_t for possible values).
+    @param error The location to store a possible error code.
+    @return The required number of bytes, or 0 if the converter could not be opened.
+
+    The size is determined by opening and closing the converter, so this should
+    be done once for each set of arguments and the result reused.
+*/
+size_t transcript_converter_size(const char *name, transcript_utf_t utf_type, int flags,
+                                 transcript_error_t *error) {
+  size_query_t query;
+  transcript_t *handle;
+
+  query.allocator.alloc = size_query_alloc;
+  query.allocator.free = size_query_free;
+  query.allocator.data = &query;
+  query.total = 0;
+
+  if ((handle = transcript_open_converter_with_allocator(name, utf_type, flags, &query.allocator,
+                                                         error)) == NULL) {
+    return 0;
+  }
+  transcript_close_converter(handle);
+  return query.total + ALIGN_SIZE(sizeof(placement_t)) + PLACEMENT_ALIGN - 1;
+}
+
+/** Open a converter in caller-provided memory.
+    @param name The name of the converter to open.
+    @param utf_type The UTF type to use for representing Unicode codepoints.
+    @param flags The default flags for the converter (see ::transcript_flags_t for possible values).
+    @param memory The memory to use for the converter.
+    @param size The size of @a memory, as returned by ::transcript_converter_size.
+    @param error The location to store a possible error code.
+
+    If @a memory is too small, ::TRANSCRIPT_OUT_OF_MEMORY is returned. The
+    converter must be closed with ::transcript_close_converter to release shared
+    resources, after which @a memory may be reused or released by the caller.
+*/
+transcript_t *transcript_open_converter_at(const char *name, transcript_utf_t utf_type, int flags,
+                                           void *memory, size_t size, transcript_error_t *error) {
+  placement_t *placement;
+  char *start = memory;
+
+  start += ALIGN_SIZE((uintptr_t)start) - (uintptr_t)start;
+  if (memory == NULL ||
+      size < (size_t)(start - (char *)memory) + ALIGN_SIZE(sizeof(placement_t))) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+
+  placement = (placement_t *)start;
+  placement->allocator.alloc = placement_alloc;
+  placement->allocator.free = NULL;
+  placement->allocator.data = placement;
+  placement->next = start + ALIGN_SIZE(sizeof(placement_t));
+  placement->limit = (char *)memory + size;
+  return transcript_open_converter_with_allocator(name, utf_type, flags, &placement->allocator,
+                                                  error);
+}
+
+/** Retrieve the structural properties of a converter.
+    @param handle The converter to describe.
+    @param info The location to store the properties.
+
+    The properties allow choosing buffer sizes, splitting input for parallel
+    conversion and using fast paths without trial conversions. They describe
+    the converter as opened, and do not depend on its current state.
+*/
+void transcript_get_info(const transcript_t *handle, transcript_info_t *info) {
+  handle->get_info(handle, info);
+}
+
 /** Check if two names describe the same converter.
     @param name_a
     @param name_b
@@ -308,7 +495,173 @@ void transcript_save_state(transcript_t *handle, void *state) { handle->save(han
     @param handle The converter to restore the state for.
     @param state A pointer to a buffer of at least ::TRANSCRIPT_SAVE_STATE_SIZE bytes.
 */
-void transcript_load_state(transcript_t *handle, void *state) { handle->save(handle, state); }
+void transcript_load_state(transcript_t *handle, void *state) { handle->load(handle, state); }
+
+/** @internal
+    @brief Storage for a copy of a shared converter handle.
+*/
+typedef union {
+  transcript_t common;
+  char data[SHARED_HANDLE_MAX];
+  void *align_ptr;
+  double align_double;
+} shared_handle_copy_t;
+
+/** @internal
+    @brief Create a working copy of a shared converter, with the state loaded from @a state.
+
+    Converters without state don't change the handle, so these are used directly.
+*/
+static transcript_t *copy_shared_handle(const transcript_t *handle, shared_handle_copy_t *copy,
+                                        transcript_state_t *state) {
+  if (handle->shared_size == SHARED_HANDLE_IMMUTABLE) {
+    return (transcript_t *)handle;
+  }
+  memcpy(copy, handle, handle->shared_size);
+  copy->common.load(&copy->common, state);
+  return &copy->common;
+}
+
+/** Open a converter which can be shared between threads and streams.
+    @param name The name of the converter to open.
+    @param utf_type The UTF type to use for representing Unicode codepoints.
+    @param flags The default flags for the converter (see ::transcript_flags_t for possible values).
+    @param error The location to store a possible error code.
+    @return A handle for use with the @c _shared conversion functions, or @c NULL on failure.
+
+    The returned handle is never modified by the conversion functions taking a
+    ::transcript_state_t argument. It can therefore be used concurrently by any
+    number of threads, with each stream keeping its state in its own
+    ::transcript_state_t. The state must be initialized with
+    ::transcript_init_shared_state before first use.
+
+    Not all converters support this mode of operation. For those converters, the
+    error ::TRANSCRIPT_NOT_SHAREABLE is returned. The handle must be closed with
+    ::transcript_close_converter, and must not be used with the functions that
+    keep the state in the handle.
+*/
+transcript_t *transcript_open_shared_converter(const char *name, transcript_utf_t utf_type,
+                                               int flags, transcript_error_t *error) {
+  transcript_t *result;
+
+  if ((result = transcript_open_converter(name, utf_type, flags, error)) == NULL) {
+    return NULL;
+  }
+  if (result->shared_size == 0 ||
+      (result->shared_size > SHARED_HANDLE_MAX && result->shared_size != SHARED_HANDLE_IMMUTABLE)) {
+    transcript_close_converter(result);
+    if (error != NULL) {
+      *error = TRANSCRIPT_NOT_SHAREABLE;
+    }
+    return NULL;
+  }
+  return result;
+}
+
+/** Initialize a conversion state for a shared converter.
+    @param handle The shared converter the state will be used with.
+    @param state The state to initialize.
+
+    After initialization, both the to-Unicode and the from-Unicode conversion
+    are in the initial state.
+*/
+void transcript_init_shared_state(const transcript_t *handle, transcript_state_t *state) {
+  shared_handle_copy_t copy;
+  transcript_t *working;
+
+  memset(state, 0, sizeof(transcript_state_t));
+  working = copy_shared_handle(handle, &copy, state);
+  working->reset_to(working);
+  working->reset_from(working);
+  working->save(working, state);
+}
+
+/** Convert a buffer from a chararcter set to Unicode, using a shared converter.
+    @param handle The shared converter to use.
+    @param state The conversion state for the stream.
+    @param inbuf A double pointer to the start of the input buffer.
+    @param inbuflimit A pointer to the end of the input buffer.
+    @param outbuf A double pointer to the start of the output buffer.
+    @param outbuflimit A pointer to the end of the output buffer.
+    @param flags Flags for this conversion (see ::transcript_flags_t for possible values).
+    @return See ::transcript_to_unicode.
+*/
+transcript_error_t transcript_to_unicode_shared(const transcript_t *handle,
+                                                transcript_state_t *state, const char **inbuf,
+                                                const char *inbuflimit, char **outbuf,
+                                                const char *outbuflimit, int flags) {
+  shared_handle_copy_t copy;
+  transcript_t *working = copy_shared_handle(handle, &copy, state);
+  transcript_error_t result;
+
+  result = working->convert_to(working, inbuf, inbuflimit, outbuf, outbuflimit,
+                               flags | (working->flags & 0xff));
+  working->save(working, state);
+  return result;
+}
+
+/** Convert a buffer from Unicode to a chararcter set, using a shared converter.
+    @param handle The shared converter to use.
+    @param state The conversion state for the stream.
+    @param inbuf A double pointer to the start of the input buffer.
+    @param inbuflimit A pointer to the end of the input buffer.
+    @param outbuf A double pointer to the start of the output buffer.
+    @param outbuflimit A pointer to the end of the output buffer.
+    @param flags Flags for this conversion (see ::transcript_flags_t for possible values).
+    @return See ::transcript_from_unicode.
+*/
+transcript_error_t transcript_from_unicode_shared(const transcript_t *handle,
+                                                  transcript_state_t *state, const char **inbuf,
+                                                  const char *inbuflimit, char **outbuf,
+                                                  const char *outbuflimit, int flags) {
+  shared_handle_copy_t copy;
+  transcript_t *working = copy_shared_handle(handle, &copy, state);
+  transcript_error_t result;
+
+  result = working->convert_from(working, inbuf, inbuflimit, outbuf, outbuflimit,
+                                 flags | (working->flags & 0xff));
+  working->save(working, state);
+  return result;
+}
+
+/** Skip the next character in character set encoding, using a shared converter.
+    @param handle The shared converter to use.
+    @param state The conversion state for the stream.
+    @param inbuf A double pointer to the start of the input buffer.
+    @param inbuflimit A pointer to the end of the input buffer.
+    @return See ::transcript_to_unicode_skip.
+*/
+transcript_error_t transcript_to_unicode_skip_shared(const transcript_t *handle,
+                                                     transcript_state_t *state, const char **inbuf,
+                                                     const char *inbuflimit) {
+  shared_handle_copy_t copy;
+  transcript_t *working = copy_shared_handle(handle, &copy, state);
+  transcript_error_t result;
+
+  result = working->skip_to(working, inbuf, inbuflimit);
+  working->save(working, state);
+  return result;
+}
+
+/** Write out any bytes required to create a legal output in a character set, using a shared
+    converter.
+    @param handle The shared converter to use.
+    @param state The conversion state for the stream.
+    @param outbuf A double pointer to the start of the output buffer.
+    @param outbuflimit A pointer to the end of the output buffer.
+    @return See ::transcript_from_unicode_flush.
+*/
+transcript_error_t transcript_from_unicode_flush_shared(const transcript_t *handle,
+                                                        transcript_state_t *state, char **outbuf,
+                                                        const char *outbuflimit) {
+  shared_handle_copy_t copy;
+  transcript_t *working = copy_shared_handle(handle, &copy, state);
+  transcript_error_t result;
+
+  result = transcript_from_unicode_flush(working, outbuf, outbuflimit);
+  working->save(working, state);
+  return result;
+}
 
 /** Get a localized descriptive string for an error code.
     @param error The error code to retrieve the descriptive string for.
@@ -359,6 +712,8 @@ const char *transcript_strerror(transcript_error_t error) {
       return _("Could not initialize dynamic module loading functionality");
     case TRANSCRIPT_NOT_INITIALIZED:
       return _("The transcript library has not been initialized yet");
+    case TRANSCRIPT_NOT_SHAREABLE:
+      return _("Converter can not be used as a shared converter");
   }
 }
 
@@ -445,6 +800,10 @@ transcript_error_t transcript_init(void) {
     bindtextdomain("libtranscript", LOCALEDIR);
 #endif
     init_char_info();
+    if (init_generic_fallback_sources() != TRANSCRIPT_SUCCESS) {
+      RELEASE_LOCK();
+      return TRANSCRIPT_OUT_OF_MEMORY;
+    }
     if (lt_dlinit() != 0) {
       RELEASE_LOCK();
       return TRANSCRIPT_INIT_DLFCN;
@@ -496,6 +855,10 @@ transcript_error_t transcript_init(void) {
 */
 void transcript_finalize(void) {
   ACQUIRE_LOCK();
+  /* Closing the preloaded converters temporarily releases the lock, so it is done before the
+     count is decremented. Converters preloaded in the mean time are closed as well. */
+  while (_transcript_initialized_count == 1 && _transcript_free_preloaded()) {
+  }
   if (_transcript_initialized_count == INT_MAX || _transcript_initialized_count == 0 ||
       --_transcript_initialized_count != 0) {
     RELEASE_LOCK();
@@ -504,7 +867,12 @@ void transcript_finalize(void) {
 
   free(transcript_path);
   free(_transcript_search_path);
+  free(generic_fallback_sources);
+  generic_fallback_sources = NULL;
+  nr_generic_fallback_sources = 0;
+  _transcript_free_encodable_sets();
   _transcript_free_aliases();
+  _transcript_free_db_listings();
   lt_dlexit();
   RELEASE_LOCK();
 }
@@ -585,6 +953,42 @@ uint32_t transcript_get_generic_fallback(uint32_t codepoint) {
   return codepoint < UINT32_C(0x10000) ? get_generic_fallback(codepoint) : UINT32_C(0xffff);
 }
 
+/** @internal
+    @brief Build the list of codepoints for which a generic fall-back exists.
+*/
+static transcript_error_t init_generic_fallback_sources(void) {
+  uint32_t codepoint;
+  size_t count = 0;
+
+  for (codepoint = 0; codepoint < UINT32_C(0x10000); codepoint++) {
+    if (get_generic_fallback(codepoint) != UINT32_C(0xffff)) {
+      count++;
+    }
+  }
+  if ((generic_fallback_sources = malloc(count * sizeof(uint16_t))) == NULL) {
+    return TRANSCRIPT_OUT_OF_MEMORY;
+  }
+  for (codepoint = 0; codepoint < UINT32_C(0x10000); codepoint++) {
+    if (get_generic_fallback(codepoint) != UINT32_C(0xffff)) {
+      generic_fallback_sources[nr_generic_fallback_sources++] = codepoint;
+    }
+  }
+  return TRANSCRIPT_SUCCESS;
+}
+
+/** @internal
+    @brief Get the sorted list of codepoints for which a generic fall-back exists.
+    @param sources The location to store the list.
+    @return The number of codepoints in the list.
+
+    Converters use this list to resolve the generic fall-backs into their own
+    tables, such that they don't need ::transcript_handle_unassigned.
+*/
+size_t _transcript_get_generic_fallback_sources(const uint16_t **sources) {
+  *sources = generic_fallback_sources;
+  return nr_generic_fallback_sources;
+}
+
 /** Handle an unassigned codepoint in a from-Unicode conversion.
 
     This function does a lookup in the generic fall-back table. If no generic
@@ -709,8 +1113,8 @@ void transcript_close_converter_nolock(transcript_t *handle) {
     if (handle->close != NULL) {
       handle->close(handle);
     }
-    lt_dlclose(handle->library_handle);
-    free(handle);
+    _transcript_release_library(handle->library_handle);
+    transcript_handle_free(handle, handle);
   }
 }
 
@@ -60,6 +60,13 @@ enum transcript_flags_t {
   TRANSCRIPT_ALLOW_PRIVATE_USE =
       (1 << 3), /**< Allow private-use mappings. If not allowed, they are handled like unassigned
                    sequences, with the exception that they return a different error.. */
+  TRANSCRIPT_EXPANDED_TABLES =
+      (1 << 4), /**< Trade memory for speed by expanding the conversion tables when opening the
+                   converter. Converters which don't have expanded tables ignore this flag. */
+
+  /** Read the tables of the converters into memory. This flag is only valid when passed to
+      ::transcript_preload. */
+  TRANSCRIPT_PRELOAD_PREFAULT = (1 << 7),
 
   /* These are only valid as argument to transcript_from_unicode and transcript_to_unicode. */
   TRANSCRIPT_FILE_START = (1 << 8), /**< The begining of the input buffer is the begining of a file
@@ -121,6 +128,7 @@ typedef enum {
                                     actual converter. */
   TRANSCRIPT_INIT_DLFCN,         /**< Could not initialize dynamic module loading functionality. */
   TRANSCRIPT_NOT_INITIALIZED,    /**< ::transcript_init has not been called yet. */
+  TRANSCRIPT_NOT_SHAREABLE,      /**< The converter can not be opened as a shared converter. */
 
   TRANSCRIPT_PART_SUCCESS_MAX =
       TRANSCRIPT_INCOMPLETE /**< Highest error code which indicates success or end-of-buffer. */
@@ -154,16 +162,116 @@ typedef struct {
   int available;
 } transcript_name_t;
 
+/** Flags describing the structure of a converter (see ::transcript_info_t). */
+enum transcript_info_flags_t {
+  /** The converter has no shift states, so each character is converted independently of the
+      characters before it. */
+  TRANSCRIPT_INFO_STATELESS = (1 << 0),
+  /** In the initial state, bytes 0x00-0x7F and U+0000-U+007F convert one to one into each other,
+      and converting them does not change the state. */
+  TRANSCRIPT_INFO_ASCII_TRANSPARENT = (1 << 1),
+  /** No byte which can start a character can occur inside a character, so character boundaries
+      can be found from any position in the input. */
+  TRANSCRIPT_INFO_SELF_SYNCHRONIZING = (1 << 2),
+  /** The converter has M:N mappings. */
+  TRANSCRIPT_INFO_MULTI_MAPPINGS = (1 << 3),
+  /** The converter is one of several variants of a single conversion table. */
+  TRANSCRIPT_INFO_VARIANTS = (1 << 4),
+  /** Every character is a single byte. */
+  TRANSCRIPT_INFO_SBCS = (1 << 5),
+  /** The converter can represent all Unicode codepoints. */
+  TRANSCRIPT_INFO_ALL_UNICODE = (1 << 6)
+};
+
+/** @struct transcript_info_t
+    Structural properties of a converter, as returned by ::transcript_get_info.
+
+    Sizes which are not known for a converter are reported as 0.
+*/
+typedef struct {
+  int flags;          /**< A combination of ::transcript_info_flags_t values. */
+  int max_char_bytes; /**< The maximum number of bytes of a single character. */
+  /** The maximum number of bytes ::transcript_from_unicode writes for a single codepoint,
+      including any shift sequence, but not a header or BOM at the start of a file. */
+  int max_from_unicode_bytes;
+  /** The maximum number of codepoints ::transcript_to_unicode writes for a single character. */
+  int max_to_unicode_codepoints;
+} transcript_info_t;
+
+/** An interned converter name (see ::transcript_intern).
+
+    Two atoms are equal if and only if they describe the same converter. The
+    value 0 is never a valid atom.
+*/
+typedef int transcript_atom_t;
+
 /** Required size of a buffer for saving converter state. */
 #define TRANSCRIPT_SAVE_STATE_SIZE 32
 
+/** @struct transcript_state_t
+    Caller-owned conversion state for use with a shared converter.
+
+    A shared converter (see ::transcript_open_shared_converter) does not change
+    during conversions, and can therefore be used by multiple threads at the same
+    time. The state of each stream is kept in a ::transcript_state_t instead,
+    which can be allocated on the stack or embedded in other structures.
+*/
+typedef union {
+  char data[TRANSCRIPT_SAVE_STATE_SIZE];
+  /** @internal Forces suitable alignment for the converters' save state. */
+  uint_fast32_t align_int;
+  /** @internal Forces suitable alignment for the converters' save state. */
+  void *align_ptr;
+} transcript_state_t;
+
+/** @struct transcript_allocator_t
+    Memory allocation functions for converter handles.
+
+    An allocator passed to ::transcript_open_converter_with_allocator is used for
+    the converter handle and for all memory the converter allocates for that
+    handle alone. The allocator must remain valid until the converter is closed.
+*/
+typedef struct {
+  /** Allocate @a size bytes, suitably aligned for any type. Returns @c NULL on failure. */
+  void *(*alloc)(void *data, size_t size);
+  /** Release memory returned by @c alloc. May be @c NULL if individual blocks are never released,
+      for example when all memory is released at once by the owner of an arena. */
+  void (*free)(void *data, void *ptr);
+  /** Data passed as first argument to @c alloc and @c free. */
+  void *data;
+} transcript_allocator_t;
+
 TRANSCRIPT_API transcript_error_t transcript_init(void);
 TRANSCRIPT_API void transcript_finalize(void);
 TRANSCRIPT_API int transcript_probe_converter(const char *name);
 TRANSCRIPT_API transcript_t *transcript_open_converter(const char *name, transcript_utf_t utf_type,
                                                        int flags, transcript_error_t *error);
 TRANSCRIPT_API void transcript_close_converter(transcript_t *handle);
+TRANSCRIPT_API transcript_t *transcript_acquire(const char *name, transcript_utf_t utf_type,
+                                                int flags, transcript_error_t *error);
+TRANSCRIPT_API void transcript_release(transcript_t *handle);
+TRANSCRIPT_API void transcript_flush_cache(void);
+TRANSCRIPT_API transcript_error_t transcript_preload(const char **names, int flags);
+TRANSCRIPT_API int transcript_select_charset(const char *text, size_t length,
+                                             const char **candidates, transcript_error_t *error);
+TRANSCRIPT_API transcript_t *transcript_clone_converter(const transcript_t *handle,
+                                                        transcript_error_t *error);
+TRANSCRIPT_API transcript_t *transcript_open_converter_with_allocator(
+    const char *name, transcript_utf_t utf_type, int flags, const transcript_allocator_t *allocator,
+    transcript_error_t *error);
+TRANSCRIPT_API size_t transcript_converter_size(const char *name, transcript_utf_t utf_type,
+                                                int flags, transcript_error_t *error);
+TRANSCRIPT_API transcript_t *transcript_open_converter_at(const char *name,
+                                                          transcript_utf_t utf_type, int flags,
+                                                          void *memory, size_t size,
+                                                          transcript_error_t *error);
+TRANSCRIPT_API void transcript_get_info(const transcript_t *handle, transcript_info_t *info);
 TRANSCRIPT_API int transcript_equal(const char *name_a, const char *name_b);
+TRANSCRIPT_API transcript_atom_t transcript_intern(const char *name);
+TRANSCRIPT_API const char *transcript_atom_name(transcript_atom_t atom);
+TRANSCRIPT_API int transcript_probe_atom(transcript_atom_t atom);
+TRANSCRIPT_API transcript_t *transcript_open_atom(transcript_atom_t atom, transcript_utf_t utf_type,
+                                                  int flags, transcript_error_t *error);
 TRANSCRIPT_API transcript_error_t transcript_to_unicode(transcript_t *handle, const char **inbuf,
                                                         const char *inbuflimit, char **outbuf,
                                                         const char *outbuflimit, int flags);
@@ -183,8 +291,28 @@ TRANSCRIPT_API void transcript_from_unicode_reset(transcript_t *handle);
 TRANSCRIPT_API void transcript_save_state(transcript_t *handle, void *state);
 /*FIXME: should we do loading (and perhaps saving) per direction?*/
 TRANSCRIPT_API void transcript_load_state(transcript_t *handle, void *state);
+TRANSCRIPT_API transcript_t *transcript_open_shared_converter(const char *name,
+                                                              transcript_utf_t utf_type, int flags,
+                                                              transcript_error_t *error);
+TRANSCRIPT_API void transcript_init_shared_state(const transcript_t *handle,
+                                                 transcript_state_t *state);
+TRANSCRIPT_API transcript_error_t transcript_to_unicode_shared(
+    const transcript_t *handle, transcript_state_t *state, const char **inbuf,
+    const char *inbuflimit, char **outbuf, const char *outbuflimit, int flags);
+TRANSCRIPT_API transcript_error_t transcript_from_unicode_shared(
+    const transcript_t *handle, transcript_state_t *state, const char **inbuf,
+    const char *inbuflimit, char **outbuf, const char *outbuflimit, int flags);
+TRANSCRIPT_API transcript_error_t transcript_to_unicode_skip_shared(const transcript_t *handle,
+                                                                    transcript_state_t *state,
+                                                                    const char **inbuf,
+                                                                    const char *inbuflimit);
+TRANSCRIPT_API transcript_error_t transcript_from_unicode_flush_shared(const transcript_t *handle,
+                                                                       transcript_state_t *state,
+                                                                       char **outbuf,
+                                                                       const char *outbuflimit);
 TRANSCRIPT_API const char *transcript_strerror(transcript_error_t error);
 TRANSCRIPT_API const transcript_name_t *transcript_get_names(int *count);
+TRANSCRIPT_API transcript_error_t transcript_write_index(const char *dir);
 TRANSCRIPT_API void transcript_normalize_name(const char *name, char *normalized_name,
                                               size_t normalized_name_max);
 TRANSCRIPT_API const char *transcript_get_codeset(void);
@@ -223,6 +351,8 @@ TRANSCRIPT_API transcript_iconv_t transcript_iconv_open(const char *tocode, cons
 TRANSCRIPT_API int transcript_iconv_close(transcript_iconv_t cd);
 TRANSCRIPT_API size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft,
                                        char **outbuf, size_t *outbytesleft);
+TRANSCRIPT_API size_t transcript_iconv_passthrough(transcript_iconv_t cd, const char *inbuf,
+                                                   size_t inbytesleft);
 
 /** @} */
 
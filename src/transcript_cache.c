@@ -0,0 +1,172 @@
+/* Copyright (C) 2013 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @file */
+
+#include <pthread.h>
+
+#include "transcript_internal.h"
+
+/** @addtogroup transcript */
+/** @{ */
+
+/** @internal Maximum number of released handles kept by a single thread. */
+#define MAX_CACHED_HANDLES 64
+
+/** @struct handle_cache_t
+    The released handles of a single thread, linked through transcript_t::cache_next. */
+typedef struct {
+  transcript_t *handles;
+  int count;
+} handle_cache_t;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static bool_t cache_key_valid;
+
+/** @internal
+    @brief Close all handles in a thread's cache. Used as destructor for ::cache_key.
+*/
+static void free_cache(void *data) {
+  handle_cache_t *cache = data;
+  transcript_t *next;
+
+  for (; cache->handles != NULL; cache->handles = next) {
+    next = cache->handles->cache_next;
+    transcript_close_converter(cache->handles);
+  }
+  free(cache);
+}
+
+/** @internal */
+static void create_cache_key(void) {
+  cache_key_valid = pthread_key_create(&cache_key, free_cache) == 0;
+}
+
+/** @internal
+    @brief Get the handle cache of the calling thread.
+    @param create Whether to create the cache if the thread does not have one yet.
+*/
+static handle_cache_t *get_cache(bool_t create) {
+  handle_cache_t *cache;
+
+  pthread_once(&cache_key_once, create_cache_key);
+  if (!cache_key_valid) {
+    return NULL;
+  }
+  if ((cache = pthread_getspecific(cache_key)) != NULL || !create) {
+    return cache;
+  }
+  if ((cache = malloc(sizeof(handle_cache_t))) == NULL) {
+    return NULL;
+  }
+  cache->handles = NULL;
+  cache->count = 0;
+  if (pthread_setspecific(cache_key, cache) != 0) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/** Get a converter handle, reusing a handle released by the calling thread if possible.
+    @param name The name of the converter to open.
+    @param utf_type The UTF type to use for representing Unicode codepoints.
+    @param flags The default flags for the converter (see ::transcript_flags_t for possible values).
+    @param error The location to store a possible error code.
+    @return A converter in its initial state, or @c NULL on failure.
+
+    Handles returned by this function should be returned with ::transcript_release,
+    which keeps them in a per-thread cache. A later call for the same converter,
+    UTF type and flags in the same thread reuses a cached handle. This only
+    takes the library lock to look up the name (see ::transcript_intern), and
+    does not allocate memory. If no cached handle is available, the converter is
+    opened as with ::transcript_open_converter.
+
+    Before calling ::transcript_finalize, all threads which used this function must
+    either have exited or called ::transcript_flush_cache.
+*/
+transcript_t *transcript_acquire(const char *name, transcript_utf_t utf_type, int flags,
+                                 transcript_error_t *error) {
+  transcript_atom_t atom;
+  handle_cache_t *cache;
+  transcript_t **ptr, *result;
+
+  /* Interning resolves the name under the library lock, and also identifies converters which
+     are not listed in the aliases file. */
+  atom = transcript_intern(name);
+
+  if (atom != 0 && (cache = get_cache(FALSE)) != NULL) {
+    for (ptr = &cache->handles; *ptr != NULL; ptr = &(*ptr)->cache_next) {
+      if ((*ptr)->cache_atom == atom && (*ptr)->cache_utf_type == utf_type &&
+          (*ptr)->flags == flags) {
+        result = *ptr;
+        *ptr = result->cache_next;
+        cache->count--;
+        return result;
+      }
+    }
+  }
+
+  if ((result = transcript_open_converter(name, utf_type, flags, error)) != NULL) {
+    result->cache_atom = atom;
+    result->cache_utf_type = utf_type;
+  }
+  return result;
+}
+
+/** Release a converter handle obtained from ::transcript_acquire.
+    @param handle The converter to release. May be @c NULL.
+
+    The converter is reset and kept for reuse by the calling thread. If the
+    cache of the thread is full, the converter is closed instead.
+*/
+void transcript_release(transcript_t *handle) {
+  handle_cache_t *cache;
+
+  if (handle == NULL) {
+    return;
+  }
+  if (handle->cache_atom == 0 || (cache = get_cache(TRUE)) == NULL ||
+      cache->count >= MAX_CACHED_HANDLES) {
+    transcript_close_converter(handle);
+    return;
+  }
+
+  handle->reset_to(handle);
+  handle->reset_from(handle);
+  handle->cache_next = cache->handles;
+  cache->handles = handle;
+  cache->count++;
+}
+
+/** Close all converter handles cached by the calling thread.
+
+    See ::transcript_acquire.
+*/
+void transcript_flush_cache(void) {
+  handle_cache_t *cache;
+  transcript_t *next;
+
+  if ((cache = get_cache(FALSE)) == NULL) {
+    return;
+  }
+  for (; cache->handles != NULL; cache->handles = next) {
+    next = cache->handles->cache_next;
+    transcript_close_converter(cache->handles);
+  }
+  cache->count = 0;
+}
+
+/** @} */
@@ -0,0 +1,302 @@
+/* Copyright (C) 2013 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @file */
+
+#include <string.h>
+
+#include "transcript_internal.h"
+#include "utf.h"
+
+/** @addtogroup transcript */
+/** @{ */
+
+/** @internal Number of codepoints in a block of an ::encodable_set_t. */
+#define BLOCK_SIZE 256
+/** @internal Number of 32-bit words in a block of an ::encodable_set_t. */
+#define BLOCK_WORDS (BLOCK_SIZE / 32)
+/** @internal Number of blocks needed to cover all Unicode codepoints. */
+#define NR_BLOCKS (0x110000 / BLOCK_SIZE)
+
+/** The blocks which are present in every ::encodable_set_t. */
+enum { EMPTY_BLOCK, FULL_BLOCK, NR_FIXED_BLOCKS };
+
+/** @struct encodable_set_t
+    The codepoints a converter can encode, stored as a two level bitmap.
+
+    Blocks in which none or all of the codepoints can be encoded are shared,
+    which makes the sets for most converters only a few kilobytes in size.
+*/
+typedef struct encodable_set_t {
+  struct encodable_set_t *next;
+  char *name;                /**< The normalized name of the converter. */
+  uint16_t index[NR_BLOCKS]; /**< The index in @c blocks for each block of codepoints. */
+  uint32_t (*blocks)[BLOCK_WORDS];
+} encodable_set_t;
+
+/** The encodable sets computed so far. Protected by the library lock. */
+static encodable_set_t *encodable_sets;
+
+/** @internal
+    @brief Default get_encodable implementation, which tries to convert every codepoint.
+
+    The handle must have been opened with ::TRANSCRIPT_UTF32. This is slow, but
+    it is only done once for each converter.
+*/
+void _transcript_trial_encodable(transcript_t *handle, uint32_t *bits) {
+  uint32_t codepoint;
+  const char *inbuf;
+  char output[32], *outbuf;
+
+  for (codepoint = 0; codepoint < UINT32_C(0x110000); codepoint++) {
+    inbuf = (const char *)&codepoint;
+    outbuf = output;
+    if (transcript_from_unicode(handle, &inbuf, inbuf + sizeof(codepoint), &outbuf,
+                                output + sizeof(output),
+                                TRANSCRIPT_SINGLE_CONVERSION | TRANSCRIPT_NO_1N_CONVERSION |
+                                    TRANSCRIPT_END_OF_TEXT) == TRANSCRIPT_SUCCESS) {
+      SET_ENCODABLE(bits, codepoint);
+    }
+    transcript_from_unicode_reset(handle);
+  }
+}
+
+/** Check whether all bits of a block are equal to @a value. */
+static bool_t block_equals(const uint32_t *block, uint32_t value) {
+  int i;
+
+  for (i = 0; i < BLOCK_WORDS; i++) {
+    if (block[i] != value) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+/** Free an ::encodable_set_t. */
+static void free_set(encodable_set_t *set) {
+  free(set->name);
+  free(set->blocks);
+  free(set);
+}
+
+/** @internal
+    @brief Create an ::encodable_set_t from a bitmap of ::ENCODABLE_WORDS words.
+*/
+static encodable_set_t *compress_bitmap(const uint32_t *bits) {
+  encodable_set_t *set;
+  size_t nr_blocks = NR_FIXED_BLOCKS;
+  int i;
+
+  for (i = 0; i < NR_BLOCKS; i++) {
+    if (!block_equals(bits + i * BLOCK_WORDS, 0) &&
+        !block_equals(bits + i * BLOCK_WORDS, UINT32_C(0xffffffff))) {
+      nr_blocks++;
+    }
+  }
+
+  if ((set = malloc(sizeof(encodable_set_t))) == NULL) {
+    return NULL;
+  }
+  set->name = NULL;
+  if ((set->blocks = malloc(nr_blocks * sizeof(set->blocks[0]))) == NULL) {
+    free(set);
+    return NULL;
+  }
+  memset(set->blocks[EMPTY_BLOCK], 0, sizeof(set->blocks[0]));
+  memset(set->blocks[FULL_BLOCK], 0xff, sizeof(set->blocks[0]));
+
+  nr_blocks = NR_FIXED_BLOCKS;
+  for (i = 0; i < NR_BLOCKS; i++) {
+    if (block_equals(bits + i * BLOCK_WORDS, 0)) {
+      set->index[i] = EMPTY_BLOCK;
+    } else if (block_equals(bits + i * BLOCK_WORDS, UINT32_C(0xffffffff))) {
+      set->index[i] = FULL_BLOCK;
+    } else {
+      memcpy(set->blocks[nr_blocks], bits + i * BLOCK_WORDS, sizeof(set->blocks[0]));
+      set->index[i] = nr_blocks++;
+    }
+  }
+  return set;
+}
+
+/** @internal
+    @brief Get the set of encodable codepoints of a converter, computing it if necessary.
+    @param name The name of the converter.
+    @param error The location to store a possible error code.
+
+    The set is computed without holding the library lock, because computing it
+    may require a trial conversion of every codepoint.
+*/
+static encodable_set_t *get_encodable_set(const char *name, transcript_error_t *error) {
+  char normalized_name[NORMALIZE_NAME_MAX];
+  encodable_set_t *set, *ptr;
+  transcript_t *handle;
+  uint32_t *bits;
+
+  transcript_normalize_name(name, normalized_name, NORMALIZE_NAME_MAX);
+  ACQUIRE_LOCK();
+  for (ptr = encodable_sets; ptr != NULL; ptr = ptr->next) {
+    if (strcmp(ptr->name, normalized_name) == 0) {
+      RELEASE_LOCK();
+      return ptr;
+    }
+  }
+  RELEASE_LOCK();
+
+  if ((handle = transcript_open_converter(name, TRANSCRIPT_UTF32, 0, error)) == NULL) {
+    return NULL;
+  }
+  if ((bits = calloc(ENCODABLE_WORDS, sizeof(uint32_t))) == NULL) {
+    transcript_close_converter(handle);
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+  handle->get_encodable(handle, bits);
+  transcript_close_converter(handle);
+
+  set = compress_bitmap(bits);
+  free(bits);
+  if (set == NULL || (set->name = _transcript_strdup(normalized_name)) == NULL) {
+    if (set != NULL) {
+      free_set(set);
+    }
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return NULL;
+  }
+
+  ACQUIRE_LOCK();
+  /* Another thread may have added the same set in the mean time. */
+  for (ptr = encodable_sets; ptr != NULL; ptr = ptr->next) {
+    if (strcmp(ptr->name, normalized_name) == 0) {
+      RELEASE_LOCK();
+      free_set(set);
+      return ptr;
+    }
+  }
+  set->next = encodable_sets;
+  encodable_sets = set;
+  RELEASE_LOCK();
+  return set;
+}
+
+/** Select the first character set from a list which can represent a text.
+    @param text The text, encoded as UTF-8.
+    @param length The length of @a text in bytes.
+    @param candidates A @c NULL terminated list of converter names, in order of preference.
+    @param error The location to store a possible error code.
+    @return The index in @a candidates of the first converter which can convert
+        @a text without fall-backs or substitutions, or -1 if there is none.
+
+    The text is decoded once, after which each candidate is checked by a bitwise
+    AND of the codepoints in the text with the codepoints the candidate can
+    encode. The text itself is not converted. Characters which a converter can
+    only convert as part of an M:N conversion are not considered encodable.
+
+    The set of encodable codepoints of a converter is computed the first time
+    it is used, and kept until ::transcript_finalize is called. For most
+    converters this uses the conversion tables directly. For ISO-2022 and
+    EUC-TW converters it requires a trial conversion of every codepoint.
+
+    Candidates which can not be opened are skipped. If no candidate can
+    represent the text, @a error is set to the error for the first candidate
+    which could not be opened, or to ::TRANSCRIPT_UNASSIGNED. If @a text is
+    not valid UTF-8, @a error is set to ::TRANSCRIPT_ILLEGAL.
+*/
+int transcript_select_charset(const char *text, size_t length, const char **candidates,
+                              transcript_error_t *error) {
+  get_unicode_func_t get_unicode = _transcript_get_get_unicode(TRANSCRIPT_UTF8);
+  const char *textlimit = text + length;
+  transcript_error_t first_error = TRANSCRIPT_UNASSIGNED, candidate_error;
+  uint8_t block_used[NR_BLOCKS];
+  uint16_t used_blocks[NR_BLOCKS];
+  size_t nr_used_blocks = 0, i;
+  uint_fast32_t codepoint;
+  uint32_t *text_bits;
+  encodable_set_t *set;
+  int result = -1, j;
+
+  if ((text_bits = calloc(ENCODABLE_WORDS, sizeof(uint32_t))) == NULL) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_OUT_OF_MEMORY;
+    }
+    return -1;
+  }
+  memset(block_used, 0, sizeof(block_used));
+
+  while (text < textlimit) {
+    if ((codepoint = get_unicode(&text, textlimit, FALSE)) > UINT32_C(0x10ffff)) {
+      free(text_bits);
+      if (error != NULL) {
+        *error = TRANSCRIPT_ILLEGAL;
+      }
+      return -1;
+    }
+    if (!block_used[codepoint / BLOCK_SIZE]) {
+      block_used[codepoint / BLOCK_SIZE] = 1;
+      used_blocks[nr_used_blocks++] = codepoint / BLOCK_SIZE;
+    }
+    SET_ENCODABLE(text_bits, codepoint);
+  }
+
+  for (j = 0; candidates[j] != NULL && result < 0; j++) {
+    if ((set = get_encodable_set(candidates[j], &candidate_error)) == NULL) {
+      if (first_error == TRANSCRIPT_UNASSIGNED) {
+        first_error = candidate_error;
+      }
+      continue;
+    }
+
+    for (i = 0; i < nr_used_blocks; i++) {
+      const uint32_t *text_block = text_bits + used_blocks[i] * BLOCK_WORDS;
+      const uint32_t *set_block = set->blocks[set->index[used_blocks[i]]];
+      int k;
+
+      for (k = 0; k < BLOCK_WORDS && !(text_block[k] & ~set_block[k]); k++) {
+      }
+      if (k < BLOCK_WORDS) {
+        break;
+      }
+    }
+    if (i == nr_used_blocks) {
+      result = j;
+    }
+  }
+
+  free(text_bits);
+  if (result < 0 && error != NULL) {
+    *error = first_error;
+  }
+  return result;
+}
+
+/** @internal
+    @brief Free the sets of encodable codepoints computed by ::transcript_select_charset.
+
+    This function should be called with the lock acquired.
+*/
+void _transcript_free_encodable_sets(void) {
+  encodable_set_t *next;
+
+  for (; encodable_sets != NULL; encodable_sets = next) {
+    next = encodable_sets->next;
+    free_set(encodable_sets);
+  }
+}
+
+/** @} */
@@ -15,6 +15,7 @@
 /** @file */
 
 #include <errno.h>
+#include <string.h>
 
 #define TRANSCRIPT_ICONV_API
 #include "transcript_internal.h"
@@ -30,6 +31,121 @@
 /** @addtogroup transcript_iconv */
 /** @{ */
 
+/** @internal
+    @brief Find the length of the prefix of the input consisting of bytes 0x00-0x7F.
+
+    The input is checked eight bytes at a time, like the Unicode conversion kernels do.
+*/
+static size_t ascii_length(const uint8_t *inbuf, const uint8_t *inbuflimit) {
+  const uint8_t *start = inbuf;
+  uint64_t bytes;
+
+  while (inbuflimit - inbuf >= 8) {
+    memcpy(&bytes, inbuf, 8);
+    if (bytes & UINT64_C(0x8080808080808080)) {
+      break;
+    }
+    inbuf += 8;
+  }
+  while (inbuf < inbuflimit && *inbuf < 0x80) {
+    inbuf++;
+  }
+  return inbuf - start;
+}
+
+/** @internal
+    @brief Find the length of the prefix of the input which UTF-8 to UTF-8 conversion leaves
+        unchanged.
+
+    This is the prefix consisting of complete, well-formed UTF-8 sequences. The
+    prefix ends before any private use character or non-character, because
+    ::transcript_iconv substitutes or rejects those.
+*/
+static size_t utf8_length(const uint8_t *inbuf, const uint8_t *inbuflimit) {
+  const uint8_t *start = inbuf;
+  uint_fast32_t codepoint;
+  int i, len;
+  uint8_t low, high;
+
+  while (inbuf < inbuflimit) {
+    inbuf += ascii_length(inbuf, inbuflimit);
+    if (inbuf == inbuflimit) {
+      break;
+    }
+
+    /* Determine the sequence length and the valid range of the second byte, which
+       excludes overlong forms, surrogates and values above 0x10FFFF. */
+    low = 0x80;
+    high = 0xbf;
+    if (*inbuf >= 0xc2 && *inbuf <= 0xdf) {
+      len = 2;
+    } else if (*inbuf >= 0xe0 && *inbuf <= 0xef) {
+      len = 3;
+      if (*inbuf == 0xe0) {
+        low = 0xa0;
+      } else if (*inbuf == 0xed) {
+        high = 0x9f;
+      }
+    } else if (*inbuf >= 0xf0 && *inbuf <= 0xf4) {
+      len = 4;
+      if (*inbuf == 0xf0) {
+        low = 0x90;
+      } else if (*inbuf == 0xf4) {
+        high = 0x8f;
+      }
+    } else {
+      break;
+    }
+    if (inbuflimit - inbuf < len || inbuf[1] < low || inbuf[1] > high) {
+      break;
+    }
+    codepoint = *inbuf & (0x7f >> len);
+    for (i = 1; i < len; i++) {
+      if ((inbuf[i] & 0xc0) != 0x80) {
+        break;
+      }
+      codepoint = (codepoint << 6) | (inbuf[i] & 0x3f);
+    }
+    if (i < len) {
+      break;
+    }
+
+    if (codepoint >= UINT32_C(0xe000) &&
+        (codepoint <= UINT32_C(0xf8ff) || codepoint >= UINT32_C(0xf0000) ||
+         (codepoint >= UINT32_C(0xfdd0) && codepoint < UINT32_C(0xfdf0)) ||
+         (codepoint & UINT32_C(0xfffe)) == UINT32_C(0xfffe))) {
+      break;
+    }
+    inbuf += len;
+  }
+  return inbuf - start;
+}
+
+/** Find the length of the prefix of the input which a conversion leaves unchanged
+    (iconv compatibility interface).
+    @param cd The conversion state handle to use.
+    @param inbuf The input buffer.
+    @param inbytesleft The number of bytes in the input buffer.
+    @return The number of bytes at the start of @a inbuf which convert to exactly the same bytes.
+
+    The prefix can be used as output without copying. This is possible for
+    UTF-8 to UTF-8 conversions, and for ASCII input if both the source and the
+    target character set are stateless and ASCII compatible. For all other
+    conversions this function returns 0. The conversion state is not changed, so
+    to continue the conversion ::transcript_iconv must be called for the remaining
+    input.
+*/
+size_t transcript_iconv_passthrough(transcript_iconv_t cd, const char *inbuf, size_t inbytesleft) {
+  switch (cd->passthrough) {
+    case ICONV_PASSTHROUGH_ASCII:
+      return ascii_length((const uint8_t *)inbuf, (const uint8_t *)inbuf + inbytesleft);
+    case ICONV_PASSTHROUGH_UTF8:
+      return utf8_length((const uint8_t *)inbuf, (const uint8_t *)inbuf + inbytesleft);
+    default:
+      return 0;
+  }
+}
+
 /** Open a converter (iconv compatibility interface).
     @param tocode Name of the character set to convert to.
     @param fromcode Name of the character set to convert from.
@@ -68,6 +184,20 @@ transcript_iconv_t transcript_iconv_open(const char *tocode, const char *fromcod
     }
     ERROR(EINVAL);
   }
+
+  retval->passthrough = ICONV_PASSTHROUGH_NONE;
+  if (transcript_equal(fromcode, "UTF-8") && transcript_equal(tocode, "UTF-8")) {
+    retval->passthrough = ICONV_PASSTHROUGH_UTF8;
+  } else {
+    transcript_info_t from_info, to_info;
+    int required = TRANSCRIPT_INFO_STATELESS | TRANSCRIPT_INFO_ASCII_TRANSPARENT;
+
+    transcript_get_info(retval->from, &from_info);
+    transcript_get_info(retval->to, &to_info);
+    if ((from_info.flags & required) == required && (to_info.flags & required) == required) {
+      retval->passthrough = ICONV_PASSTHROUGH_ASCII;
+    }
+  }
   return retval;
 
 end_error:
@@ -126,6 +256,7 @@ size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft
 
   uint32_t codepoints[20];
   char *codepoint_ptr;
+  const char *codepoints_end;
   bool_t non_reversible;
 
   const char *inbuflimit, *outbuflimit;
@@ -145,6 +276,7 @@ size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft
     outbuflimit = (*outbuf) + (*outbytesleft);
     switch (transcript_from_unicode_flush(cd->to, outbuf, outbuflimit)) {
       case TRANSCRIPT_SUCCESS:
+        *outbytesleft = outbuflimit - *outbuf;
         break;
       case TRANSCRIPT_NO_SPACE:
         ERROR(E2BIG);
@@ -159,6 +291,24 @@ size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft
   outbuflimit = (*outbuf) + (*outbytesleft);
 
   while (_inbuf < inbuflimit) {
+    if (cd->passthrough != ICONV_PASSTHROUGH_NONE) {
+      /* Copy the input which does not need conversion, up to the space available in
+         the output buffer. Conversion continues at the first byte which needs it. */
+      size_t length = transcript_iconv_passthrough(
+          cd, _inbuf, (size_t)(outbuflimit - *outbuf) < (size_t)(inbuflimit - _inbuf)
+                          ? (size_t)(outbuflimit - *outbuf)
+                          : (size_t)(inbuflimit - _inbuf));
+      if (length > 0) {
+        memcpy(*outbuf, _inbuf, length);
+        *outbuf += length;
+        _inbuf += length;
+        *inbuf = _inbuf;
+        *inbytesleft = inbuflimit - _inbuf;
+        *outbytesleft = outbuflimit - *outbuf;
+        continue;
+      }
+    }
+
     transcript_save_state(cd->from, saved_state);
     non_reversible = FALSE;
     codepoint_ptr = (char *)&codepoints;
@@ -179,6 +329,7 @@ size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft
       case TRANSCRIPT_PRIVATE_USE:
       case TRANSCRIPT_UNASSIGNED:
         codepoints[0] = 0xFFFD;
+        codepoint_ptr = (char *)(codepoints + 1);
         transcript_to_unicode_skip(cd->from, (const char **)&_inbuf, inbuflimit);
         non_reversible = TRUE;
         break;
@@ -202,13 +353,13 @@ size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft
         non_reversible = TRUE;
       }
 
+      codepoints_end = codepoint_ptr;
       codepoint_ptr = (char *)&codepoints;
     try_again:
       /* Try to convert. If so far the conversion is reversible, try without substitutions and
        * fallbacks first. */
       switch (transcript_from_unicode(
-          cd->to, (const char **)&codepoint_ptr,
-          (const char *)codepoints + 20 * sizeof(codepoints[0]), outbuf, outbuflimit,
+          cd->to, (const char **)&codepoint_ptr, codepoints_end, outbuf, outbuflimit,
           TRANSCRIPT_NO_1N_CONVERSION |
               (non_reversible
                    ? TRANSCRIPT_SUBST_UNASSIGNED | TRANSCRIPT_SUBST_ILLEGAL |
@@ -240,6 +391,8 @@ size_t transcript_iconv(transcript_iconv_t cd, char **inbuf, size_t *inbytesleft
       non_reversible = FALSE;
     }
     *inbuf = _inbuf;
+    *inbytesleft = inbuflimit - _inbuf;
+    *outbytesleft = outbuflimit - *outbuf;
   }
 
   return result;
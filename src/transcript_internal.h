@@ -44,8 +44,16 @@ TRANSCRIPT_LOCAL extern void (*_transcript_acquire_lock)(void *);
 TRANSCRIPT_LOCAL extern void (*_transcript_release_lock)(void *);
 TRANSCRIPT_LOCAL extern pthread_mutex_t _transcript_lock;
 
+/** Input which ::transcript_iconv copies to the output without converting it. */
+enum {
+  ICONV_PASSTHROUGH_NONE,
+  ICONV_PASSTHROUGH_ASCII, /**< Bytes 0x00-0x7F. */
+  ICONV_PASSTHROUGH_UTF8   /**< Well-formed UTF-8 without private use or non-characters. */
+};
+
 struct _transcript_iconv_t {
   transcript_t *from, *to;
+  int passthrough; /**< One of the ICONV_PASSTHROUGH_* values. */
 };
 
 typedef struct transcript_alias_name_t {
@@ -56,6 +64,7 @@ typedef struct transcript_alias_name_t {
 #define NAME_DESC_FLAG_HAS_DISPNAME (1 << 0)
 #define NAME_DESC_FLAG_DISABLED (1 << 1)
 #define NAME_DESC_FLAG_PROBE_LOAD (1 << 2)
+#define NAME_DESC_FLAG_INTERNED (1 << 3)
 
 typedef struct transcript_name_desc_t {
   char *real_name;
@@ -63,6 +72,7 @@ typedef struct transcript_name_desc_t {
   transcript_alias_name_t *aliases;
   struct transcript_name_desc_t *next;
   int flags;
+  transcript_atom_t atom; /* The atom for this converter, or 0 if it has not been interned. */
 } transcript_name_desc_t;
 
 typedef void *(*open_func_t)(const char *);
@@ -70,13 +80,25 @@ typedef void *(*open_func_t)(const char *);
 TRANSCRIPT_LOCAL transcript_t *_transcript_fill_utf(transcript_t *handle,
                                                     transcript_utf_t utf_type);
 
+TRANSCRIPT_LOCAL void _transcript_release_library(void *library_handle);
+TRANSCRIPT_LOCAL void _transcript_set_open_observer(void (*observer)(const char *normalized_name));
+TRANSCRIPT_LOCAL bool_t _transcript_free_preloaded(void);
+TRANSCRIPT_LOCAL void _transcript_trial_encodable(transcript_t *handle, uint32_t *bits);
+TRANSCRIPT_LOCAL void _transcript_free_encodable_sets(void);
+
 TRANSCRIPT_LOCAL void _transcript_log(const char *fmt, ...);
 
 TRANSCRIPT_LOCAL transcript_name_desc_t *_transcript_get_name_desc(const char *name,
                                                                    int need_normalization);
 
+TRANSCRIPT_LOCAL int _transcript_probe_name_desc(const transcript_name_desc_t *converter);
+TRANSCRIPT_LOCAL transcript_t *_transcript_open_name_desc(const transcript_name_desc_t *converter,
+                                                          transcript_utf_t utf_type, int flags,
+                                                          transcript_error_t *error);
+
 TRANSCRIPT_LOCAL void *_transcript_db_open(const char *name, const char *ext, open_func_t open_func,
                                            transcript_error_t *error);
+TRANSCRIPT_LOCAL void _transcript_free_db_listings(void);
 
 TRANSCRIPT_LOCAL int _transcript_isalnum(int c);
 TRANSCRIPT_LOCAL int _transcript_isdigit(int c);
@@ -84,6 +106,8 @@ TRANSCRIPT_LOCAL int _transcript_isspace(int c);
 TRANSCRIPT_LOCAL int _transcript_isidchr(int c);
 TRANSCRIPT_LOCAL int _transcript_tolower(int c);
 
+TRANSCRIPT_LOCAL size_t _transcript_get_generic_fallback_sources(const uint16_t **sources);
+
 TRANSCRIPT_LOCAL void _transcript_init_aliases_from_file(void);
 TRANSCRIPT_LOCAL void _transcript_free_aliases(void);
 TRANSCRIPT_LOCAL void *_transcript_open_state_table_converter(const converter_tables_v1_t *tables,
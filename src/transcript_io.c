@@ -11,8 +11,12 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <dirent.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "transcript_dlfcn.h"
 #include "transcript_internal.h"
@@ -24,6 +28,48 @@
     goto end_error;                    \
   } while (0)
 
+/** The allocator for converters opened while holding the library lock, or @c NULL for malloc. */
+static const transcript_allocator_t *current_allocator;
+
+/** @struct library_ref_t
+    References to a plugin held by cloned converters, in addition to the one from lt_dlopen. */
+typedef struct library_ref_t {
+  lt_dlhandle handle;
+  int refcount;
+  struct library_ref_t *next;
+} library_ref_t;
+
+/** The plugins referenced by cloned converters. Protected by the library lock. */
+static library_ref_t *library_refs;
+
+/** Function called with the name of each converter plugin that is loaded, or @c NULL. Protected by
+    the library lock. */
+static void (*open_observer)(const char *normalized_name);
+
+/** Minimum number of seconds between checks whether a database directory has changed. */
+#define DIR_LISTING_RECHECK 1
+
+/** @struct dir_listing_t
+    The cached contents of a database directory.
+
+    The listing is used to answer lookups for files that do not exist, without
+    issuing an open call for each of them. It is revalidated using the
+    modification time of the directory.
+*/
+typedef struct dir_listing_t {
+  char *dir;         /**< The name of the directory. */
+  char **names;      /**< The sorted names of the files in the directory. */
+  size_t names_used, /**< The number of elements in ::names that are in use. */
+      names_allocated; /**< The number of elements allocated in ::names. */
+  time_t mtime;        /**< The modification time of the directory when it was read. */
+  time_t checked;      /**< The last time the modification time was checked. */
+  bool_t valid;        /**< Whether ::names reflects the contents of the directory. */
+  struct dir_listing_t *next;
+} dir_listing_t;
+
+/** The cached listings of the database directories. Protected by the library lock. */
+static dir_listing_t *dir_listings;
+
 /** Wrapper around fopen such that it can be passed to ::_transcript_db_open. */
 static FILE *fopen_wrapper(const char *name) { return fopen(name, "r"); }
 
@@ -83,20 +129,38 @@ int transcript_probe_converter_nolock(const char *name) {
   transcript_normalize_name(name, normalized_name, NORMALIZE_NAME_MAX);
 
   if ((converter = _transcript_get_name_desc(normalized_name, 0)) != NULL) {
-    if (converter->flags & NAME_DESC_FLAG_DISABLED) {
-      return FALSE;
-    }
-    return probe_converter(converter->name, !!(converter->flags & NAME_DESC_FLAG_PROBE_LOAD));
+    return _transcript_probe_name_desc(converter);
   }
   return probe_converter(normalized_name, FALSE);
 }
 
+/** @internal
+    @brief Check if the converter described by a name descriptor is available.
+
+    Must be called with the library lock held.
+*/
+int _transcript_probe_name_desc(const transcript_name_desc_t *converter) {
+  if (converter->flags & NAME_DESC_FLAG_DISABLED) {
+    return FALSE;
+  }
+  return probe_converter(converter->name, !!(converter->flags & NAME_DESC_FLAG_PROBE_LOAD));
+}
+
 /** Do-nothing function for reset_to/reset_from and save/load. */
 static void void_nop(void) {}
 
 /** Do-nothing function for flush_from. */
 static transcript_error_t success_nop(void) { return TRANSCRIPT_SUCCESS; }
 
+/** get_info implementation for converters which do not describe themselves. */
+static void unknown_info(const transcript_t *handle, transcript_info_t *info) {
+  (void)handle;
+  info->flags = 0;
+  info->max_char_bytes = 0;
+  info->max_from_unicode_bytes = 0;
+  info->max_to_unicode_codepoints = 0;
+}
+
 /** Fill the @c get_unicode and @c put_unicode members of a ::transcript_t struct and put in a NOP
  * function for missing functions. */
 static transcript_t *complete_converter(transcript_t *handle, transcript_utf_t utf_type) {
@@ -105,6 +169,8 @@ static transcript_t *complete_converter(transcript_t *handle, transcript_utf_t u
   }
   handle->get_unicode = _transcript_get_get_unicode(utf_type);
   handle->put_unicode = _transcript_get_put_unicode(utf_type);
+  handle->cache_atom = 0;
+  handle->cache_next = NULL;
 
   if (handle->reset_to == NULL) {
     handle->reset_to = (reset_func_t)void_nop;
@@ -119,9 +185,177 @@ static transcript_t *complete_converter(transcript_t *handle, transcript_utf_t u
     handle->save = (save_load_func_t)void_nop;
     handle->load = (save_load_func_t)void_nop;
   }
+  if (handle->get_info == NULL) {
+    handle->get_info = unknown_info;
+  }
+  if (handle->get_encodable == NULL) {
+    handle->get_encodable = _transcript_trial_encodable;
+  }
   return handle;
 }
 
+/** @internal
+    @brief Set the function to call with the name of each converter plugin that is loaded.
+    @param observer The function to call, or @c NULL.
+
+    This includes the plugins loaded by modules for their sub-converters. Must be
+    called with the library lock held.
+*/
+void _transcript_set_open_observer(void (*observer)(const char *normalized_name)) {
+  open_observer = observer;
+}
+
+/** @internal
+    @brief Set the allocator used for the handles of converters that are opened.
+    @param allocator The allocator to use, or @c NULL to use malloc.
+    @return The previously set allocator.
+
+    Must be called with the library lock held, and the previous allocator must
+    be restored before releasing the lock. Modules set a @c NULL allocator while
+    opening converters that are shared between handles, such that these are
+    never allocated with the allocator of the handle that happens to open them.
+*/
+const transcript_allocator_t *_transcript_set_allocator(const transcript_allocator_t *allocator) {
+  const transcript_allocator_t *previous = current_allocator;
+  current_allocator = allocator;
+  return previous;
+}
+
+/** @internal
+    @brief Allocate memory for a converter handle.
+    @param size The size of the converter's handle structure, which must start with a
+        ::transcript_t.
+
+    The memory is allocated with the allocator for the converter being opened,
+    which is recorded in the handle. The ::transcript_t at the start of the
+    memory is cleared, such that members a converter does not set are zero.
+    Memory that belongs to the handle alone should be allocated with
+    ::transcript_handle_alloc, and all of it, including the handle itself,
+    should be released with ::transcript_handle_free.
+*/
+void *transcript_alloc_handle_nolock(size_t size) {
+  transcript_t *result;
+
+  if (current_allocator == NULL) {
+    result = malloc(size);
+  } else {
+    result = current_allocator->alloc(current_allocator->data, size);
+  }
+  if (result != NULL) {
+    memset(result, 0, sizeof(transcript_t));
+    result->allocator = current_allocator;
+  }
+  return result;
+}
+
+/** @internal
+    @brief Allocate memory which belongs to a converter handle.
+    @param handle The converter handle, allocated with ::transcript_alloc_handle_nolock.
+    @param size The number of bytes to allocate.
+*/
+void *transcript_handle_alloc(const transcript_t *handle, size_t size) {
+  if (handle->allocator == NULL) {
+    return malloc(size);
+  }
+  return handle->allocator->alloc(handle->allocator->data, size);
+}
+
+/** @internal
+    @brief Release memory allocated with ::transcript_alloc_handle_nolock or
+        ::transcript_handle_alloc.
+    @param handle The converter handle the memory belongs to.
+    @param ptr The memory to release, which may be @a handle itself.
+*/
+void transcript_handle_free(const transcript_t *handle, void *ptr) {
+  const transcript_allocator_t *allocator = handle->allocator;
+
+  if (allocator == NULL) {
+    free(ptr);
+  } else if (allocator->free != NULL) {
+    allocator->free(allocator->data, ptr);
+  }
+}
+
+/** @internal
+    @brief Allocate a copy of a converter handle, for use by clone implementations.
+    @param handle The handle to copy.
+    @param size The size of the converter's handle structure.
+
+    The copy is allocated in the same way as by ::transcript_alloc_handle_nolock.
+    Any resources referenced by the handle must be acquired separately by the
+    caller.
+*/
+void *transcript_clone_handle_nolock(const transcript_t *handle, size_t size) {
+  transcript_t *result;
+
+  if ((result = transcript_alloc_handle_nolock(size)) != NULL) {
+    const transcript_allocator_t *allocator = result->allocator;
+    memcpy(result, handle, size);
+    result->allocator = allocator;
+  }
+  return result;
+}
+
+/** @internal
+    @brief Clone a converter without locking.
+
+    This function is called by ::transcript_clone_converter, after locking the
+    internal mutex. Converters which use other converters call this function to
+    clone those.
+*/
+transcript_t *transcript_clone_converter_nolock(const transcript_t *handle,
+                                                transcript_error_t *error) {
+  const transcript_allocator_t *previous;
+  library_ref_t *ref;
+  transcript_t *result;
+
+  for (ref = library_refs; ref != NULL && ref->handle != handle->library_handle; ref = ref->next) {
+  }
+  if (ref == NULL) {
+    if ((ref = malloc(sizeof(library_ref_t))) == NULL) {
+      if (error != NULL) {
+        *error = TRANSCRIPT_OUT_OF_MEMORY;
+      }
+      return NULL;
+    }
+    ref->handle = handle->library_handle;
+    ref->refcount = 0;
+    ref->next = library_refs;
+    library_refs = ref;
+  }
+  ref->refcount++;
+
+  previous = _transcript_set_allocator(handle->allocator);
+  result = handle->clone(handle, error);
+  _transcript_set_allocator(previous);
+
+  if (result == NULL) {
+    _transcript_release_library(handle->library_handle);
+  }
+  return result;
+}
+
+/** @internal
+    @brief Release the reference of a converter to its plugin.
+
+    Must be called with the library lock held.
+*/
+void _transcript_release_library(void *library_handle) {
+  library_ref_t **ptr;
+
+  for (ptr = &library_refs; *ptr != NULL; ptr = &(*ptr)->next) {
+    if ((*ptr)->handle == library_handle) {
+      library_ref_t *ref = *ptr;
+      if (--ref->refcount == 0) {
+        *ptr = ref->next;
+        free(ref);
+      }
+      return;
+    }
+  }
+  lt_dlclose(library_handle);
+}
+
 /** Open a converter plugin. */
 static transcript_t *open_converter(const char *normalized_name, transcript_utf_t utf_type,
                                     int flags, transcript_error_t *error) {
@@ -140,6 +374,9 @@ static transcript_t *open_converter(const char *normalized_name, transcript_utf_
     fclose(test_handle);
     ERROR(TRANSCRIPT_DLOPEN_FAILURE);
   }
+  if (open_observer != NULL) {
+    open_observer(normalized_name);
+  }
 
   if ((get_iface = get_sym(handle, "transcript_get_iface_", normalized_name)) == NULL) {
     ERROR(TRANSCRIPT_INVALID_FORMAT);
@@ -159,7 +396,10 @@ static transcript_t *open_converter(const char *normalized_name, transcript_utf_
       }
       break;
     }
-    case TRANSCRIPT_FULL_MODULE_V1: {
+    case TRANSCRIPT_FULL_MODULE_V1:
+      /* Version 1 modules use a smaller transcript_t, which makes their handles incompatible. */
+      ERROR(TRANSCRIPT_WRONG_VERSION);
+    case TRANSCRIPT_FULL_MODULE_V2: {
       transcript_t *(*open_converter)(const char *, transcript_utf_t, int flags,
                                       transcript_error_t *);
       if ((open_converter = get_sym(handle, "transcript_open_", normalized_name)) == NULL) {
@@ -215,17 +455,34 @@ transcript_t *transcript_open_converter_nolock(const char *name, transcript_utf_
   transcript_normalize_name(name, normalized_name, NORMALIZE_NAME_MAX);
 
   if ((converter = _transcript_get_name_desc(normalized_name, 0)) != NULL) {
-    if (converter->flags & NAME_DESC_FLAG_DISABLED) {
-      if (error != NULL) {
-        *error = TRANSCRIPT_CONVERTER_DISABLED;
-      }
-      return NULL;
-    }
-    return complete_converter(open_converter(converter->name, utf_type, flags, error), utf_type);
+    return _transcript_open_name_desc(converter, utf_type, flags, error);
   }
   return complete_converter(open_converter(normalized_name, utf_type, flags, error), utf_type);
 }
 
+/** @internal
+    @brief Open the converter described by a name descriptor.
+
+    Must be called with the library lock held.
+*/
+transcript_t *_transcript_open_name_desc(const transcript_name_desc_t *converter,
+                                         transcript_utf_t utf_type, int flags,
+                                         transcript_error_t *error) {
+  if (utf_type > TRANSCRIPT_UTF32LE || utf_type <= 0) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_BAD_ARG;
+    }
+    return NULL;
+  }
+  if (converter->flags & NAME_DESC_FLAG_DISABLED) {
+    if (error != NULL) {
+      *error = TRANSCRIPT_CONVERTER_DISABLED;
+    }
+    return NULL;
+  }
+  return complete_converter(open_converter(converter->name, utf_type, flags, error), utf_type);
+}
+
 /** Try to open a file from a database directory.
     @param name The base name of the file to open.
     @param ext The extension of the file to open.
@@ -260,6 +517,156 @@ end_error:
   return result;
 }
 
+/** Release the names stored in a directory listing. */
+static void clear_listing(dir_listing_t *listing) {
+  size_t i;
+
+  for (i = 0; i < listing->names_used; i++) {
+    free(listing->names[i]);
+  }
+  listing->names_used = 0;
+  listing->valid = FALSE;
+}
+
+/** Comparison function for sorting and searching the names in a ::dir_listing_t. */
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/** (Re-)read the contents of a directory into a listing. */
+static void read_listing(dir_listing_t *listing) {
+  struct dirent *entry;
+  DIR *dir;
+
+  clear_listing(listing);
+  if ((dir = opendir(listing->dir)) == NULL) {
+    return;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    if (listing->names_used >= listing->names_allocated) {
+      size_t new_allocated = listing->names_allocated == 0 ? 64 : listing->names_allocated * 2;
+      char **new_names;
+      if ((new_names = realloc(listing->names, new_allocated * sizeof(char *))) == NULL) {
+        goto end_error;
+      }
+      listing->names = new_names;
+      listing->names_allocated = new_allocated;
+    }
+    if ((listing->names[listing->names_used] = _transcript_strdup(entry->d_name)) == NULL) {
+      goto end_error;
+    }
+    listing->names_used++;
+  }
+  closedir(dir);
+  qsort(listing->names, listing->names_used, sizeof(char *), compare_names);
+  listing->valid = TRUE;
+  return;
+
+end_error:
+  closedir(dir);
+  clear_listing(listing);
+}
+
+/** Get an up-to-date listing of a directory.
+    @param dir The directory to get the listing for.
+    @return The listing for the directory, or @c NULL if it could not be allocated.
+
+    The directory is re-read if its modification time changed. To limit the number
+    of system calls, the modification time is checked at most once every
+    ::DIR_LISTING_RECHECK seconds.
+*/
+static dir_listing_t *get_listing(const char *dir) {
+  dir_listing_t *listing;
+  struct stat statbuf;
+  time_t now;
+
+  now = time(NULL);
+  for (listing = dir_listings; listing != NULL; listing = listing->next) {
+    if (strcmp(listing->dir, dir) == 0) {
+      break;
+    }
+  }
+
+  if (listing == NULL) {
+    if ((listing = malloc(sizeof(dir_listing_t))) == NULL) {
+      return NULL;
+    }
+    if ((listing->dir = _transcript_strdup(dir)) == NULL) {
+      free(listing);
+      return NULL;
+    }
+    listing->names = NULL;
+    listing->names_used = 0;
+    listing->names_allocated = 0;
+    listing->valid = FALSE;
+    listing->mtime = (time_t)-1;
+    listing->checked = 0;
+    listing->next = dir_listings;
+    dir_listings = listing;
+  } else if (now - listing->checked < DIR_LISTING_RECHECK) {
+    return listing;
+  }
+
+  listing->checked = now;
+  if (stat(dir, &statbuf) != 0) {
+    clear_listing(listing);
+    listing->mtime = (time_t)-1;
+    return listing;
+  }
+  if (!listing->valid || statbuf.st_mtime != listing->mtime) {
+    read_listing(listing);
+    /* A change made in the same second as reading the directory does not change the
+       modification time we see, so such a listing must be re-read on the next check. */
+    listing->mtime = statbuf.st_mtime < now ? statbuf.st_mtime : (time_t)-1;
+  }
+  return listing;
+}
+
+/** Check whether a directory is known not to contain a file.
+    @param dir The directory to check.
+    @param name The base name of the file.
+    @param ext The extension of the file.
+    @return @c TRUE if the file is known to be absent, @c FALSE if it may exist.
+*/
+static bool_t listing_lacks_file(const char *dir, const char *name, const char *ext) {
+  char buffer[NORMALIZE_NAME_MAX + 16];
+  dir_listing_t *listing;
+  char *key = buffer;
+
+  if (strlen(name) + 1 + strlen(ext) + 1 > sizeof(buffer)) {
+    return FALSE;
+  }
+  if ((listing = get_listing(dir)) == NULL || !listing->valid) {
+    return FALSE;
+  }
+
+  strcpy(buffer, name);
+  strcat(buffer, ".");
+  strcat(buffer, ext);
+  return bsearch(&key, listing->names, listing->names_used, sizeof(char *), compare_names) == NULL;
+}
+
+/** @internal
+    @brief Release the cached database directory listings.
+
+    This function should be called with the lock acquired.
+*/
+void _transcript_free_db_listings(void) {
+  dir_listing_t *next;
+
+  for (; dir_listings != NULL; dir_listings = next) {
+    next = dir_listings->next;
+    clear_listing(dir_listings);
+    free(dir_listings->names);
+    free(dir_listings->dir);
+    free(dir_listings);
+  }
+}
+
 /** @internal
     @brief Open a file from the database directory.
     @param name The base name of the file to open.
@@ -269,7 +676,8 @@ end_error:
 
     This function first looks in the diretory named in the TRANSCRIPT_PATH
     environment variable (if set), and then in the compiled in database
-    directory.
+    directory. Directories which are known not to contain the file (see
+    ::dir_listing_t) are skipped without trying to open the file.
 */
 void *_transcript_db_open(const char *name, const char *ext, open_func_t open_func,
                           transcript_error_t *error) {
@@ -277,6 +685,14 @@ void *_transcript_db_open(const char *name, const char *ext, open_func_t open_fu
   FILE *result;
 
   for (next_dir = _transcript_search_path; *next_dir != NULL; next_dir++) {
+    /* Names often come from untrusted input, so don't try to open files we know are absent. */
+    if (listing_lacks_file(*next_dir, name, ext)) {
+      errno = ENOENT;
+      if (error != NULL) {
+        *error = TRANSCRIPT_ERRNO;
+      }
+      continue;
+    }
     if ((result = db_open(name, ext, *next_dir, open_func, error)) != NULL) {
       return result;
     }
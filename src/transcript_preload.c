@@ -0,0 +1,350 @@
+/* Copyright (C) 2013 G.P. Halkes
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 3, as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/** @file */
+
+#ifdef HAS_DL_ITERATE_PHDR
+/* Required for dl_iterate_phdr. */
+#define _GNU_SOURCE
+#include <link.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <pthread.h>
+#include <string.h>
+
+#include "transcript_dlfcn.h"
+#include "transcript_internal.h"
+
+/** @addtogroup transcript */
+/** @{ */
+
+/** @internal Maximum number of threads used to prefault the preloaded converters. */
+#define MAX_PREFAULT_THREADS 4
+
+/** @struct pinned_t
+    A converter kept open until ::transcript_finalize, to keep its plugin and tables loaded. */
+typedef struct pinned_t {
+  char *name; /**< The normalized name of the converter. */
+  transcript_t *handle;
+  struct pinned_t *next;
+} pinned_t;
+
+/** The preloaded converters. Protected by the library lock. */
+static pinned_t *pinned;
+
+/** The names of the plugins loaded while preloading a converter. Protected by the library lock. */
+static char **loaded_names;
+static size_t loaded_names_used, /**< The number of elements in ::loaded_names that are in use. */
+    loaded_names_allocated;      /**< The number of elements allocated in ::loaded_names. */
+
+/** Record the name of a loaded plugin. Used as observer for ::_transcript_set_open_observer. */
+static void record_loaded_name(const char *normalized_name) {
+  if (loaded_names_used >= loaded_names_allocated) {
+    size_t new_allocated = loaded_names_allocated == 0 ? 16 : loaded_names_allocated * 2;
+    char **new_names;
+    if ((new_names = realloc(loaded_names, new_allocated * sizeof(char *))) == NULL) {
+      return;
+    }
+    loaded_names = new_names;
+    loaded_names_allocated = new_allocated;
+  }
+  if ((loaded_names[loaded_names_used] = _transcript_strdup(normalized_name)) != NULL) {
+    loaded_names_used++;
+  }
+}
+
+/** Check whether a converter has already been preloaded. */
+static bool_t is_pinned(const char *normalized_name) {
+  pinned_t *ptr;
+
+  for (ptr = pinned; ptr != NULL; ptr = ptr->next) {
+    if (strcmp(ptr->name, normalized_name) == 0) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/** @internal
+    @brief Open a converter and add it to the ::pinned list.
+    @param name The name of the converter.
+    @param flags The flags to open the converter with.
+    @return An error code.
+
+    Must be called with the library lock held.
+*/
+static transcript_error_t pin_converter(const char *name, int flags) {
+  char normalized_name[NORMALIZE_NAME_MAX];
+  transcript_error_t error = TRANSCRIPT_SUCCESS;
+  pinned_t *ptr;
+
+  transcript_normalize_name(name, normalized_name, NORMALIZE_NAME_MAX);
+  if (is_pinned(normalized_name)) {
+    return TRANSCRIPT_SUCCESS;
+  }
+
+  if ((ptr = malloc(sizeof(pinned_t))) == NULL) {
+    return TRANSCRIPT_OUT_OF_MEMORY;
+  }
+  if ((ptr->name = _transcript_strdup(normalized_name)) == NULL) {
+    free(ptr);
+    return TRANSCRIPT_OUT_OF_MEMORY;
+  }
+  if ((ptr->handle = transcript_open_converter_nolock(name, TRANSCRIPT_UTF32, flags, &error)) ==
+      NULL) {
+    free(ptr->name);
+    free(ptr);
+    return error;
+  }
+  ptr->next = pinned;
+  pinned = ptr;
+  return TRANSCRIPT_SUCCESS;
+}
+
+#ifdef HAS_DL_ITERATE_PHDR
+/** @struct prefault_range_t
+    A mapped segment of a plugin. */
+typedef struct {
+  const char *start;
+  size_t length;
+} prefault_range_t;
+
+/** @struct prefault_t
+    The segments of all preloaded plugins, built by ::add_ranges. */
+typedef struct {
+  const void *base; /**< An address in the plugin being searched for. */
+  prefault_range_t *ranges;
+  size_t ranges_used, ranges_allocated;
+  size_t stride; /**< The number of threads dividing the ranges. */
+} prefault_t;
+
+/** @struct prefault_thread_t
+    The arguments for a single ::prefault_ranges thread. */
+typedef struct {
+  prefault_t *prefault;
+  size_t first;
+  pthread_t thread;
+} prefault_thread_t;
+
+/** Callback for dl_iterate_phdr, which adds the readable segments of the plugin containing
+    prefault_t::base to prefault_t::ranges. */
+static int add_ranges(struct dl_phdr_info *info, size_t size, void *data) {
+  prefault_t *prefault = data;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  int i;
+
+  (void)size;
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    uintptr_t start = (uintptr_t)info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+    if (info->dlpi_phdr[i].p_type == PT_LOAD && (uintptr_t)prefault->base >= start &&
+        (uintptr_t)prefault->base < start + info->dlpi_phdr[i].p_memsz) {
+      break;
+    }
+  }
+  if (i == info->dlpi_phnum) {
+    return 0;
+  }
+
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    uintptr_t start, end;
+    if (info->dlpi_phdr[i].p_type != PT_LOAD || !(info->dlpi_phdr[i].p_flags & PF_R)) {
+      continue;
+    }
+    if (prefault->ranges_used >= prefault->ranges_allocated) {
+      size_t new_allocated = prefault->ranges_allocated == 0 ? 16 : prefault->ranges_allocated * 2;
+      prefault_range_t *new_ranges;
+      if ((new_ranges = realloc(prefault->ranges, new_allocated * sizeof(prefault_range_t))) ==
+          NULL) {
+        return 1;
+      }
+      prefault->ranges = new_ranges;
+      prefault->ranges_allocated = new_allocated;
+    }
+    start = (uintptr_t)info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+    end = start + info->dlpi_phdr[i].p_memsz;
+    start &= ~(uintptr_t)(page_size - 1);
+    prefault->ranges[prefault->ranges_used].start = (const char *)start;
+    prefault->ranges[prefault->ranges_used].length = end - start;
+    prefault->ranges_used++;
+  }
+  return 1;
+}
+
+/** Thread function which advises the kernel about, and touches all pages of, every
+    prefault_t::stride'th range. */
+static void *prefault_ranges(void *data) {
+  prefault_thread_t *thread = data;
+  prefault_t *prefault = thread->prefault;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t i, offset;
+
+  for (i = thread->first; i < prefault->ranges_used; i += prefault->stride) {
+    const volatile char *start = prefault->ranges[i].start;
+    madvise((void *)prefault->ranges[i].start, prefault->ranges[i].length, MADV_WILLNEED);
+    for (offset = 0; offset < prefault->ranges[i].length; offset += page_size) {
+      (void)start[offset];
+    }
+  }
+  return NULL;
+}
+
+/** @internal
+    @brief Prefault the tables of the preloaded converters.
+
+    The segments to prefault are collected with the library lock held, after
+    which they are prefaulted by up to ::MAX_PREFAULT_THREADS threads. Must be
+    called with the library lock held; the lock is released on return.
+*/
+static void prefault_pinned(void) {
+  prefault_thread_t threads[MAX_PREFAULT_THREADS];
+  prefault_t prefault;
+  size_t nr_threads, started, i;
+  pinned_t *ptr;
+
+  prefault.ranges = NULL;
+  prefault.ranges_used = 0;
+  prefault.ranges_allocated = 0;
+
+  for (ptr = pinned; ptr != NULL; ptr = ptr->next) {
+    char sym[NORMALIZE_NAME_MAX + 32];
+    transcript_name_desc_t *converter;
+
+    if (ptr->handle->library_handle == NULL) {
+      continue;
+    }
+    /* Find an address in the plugin through a symbol every plugin provides. */
+    converter = _transcript_get_name_desc(ptr->name, 0);
+    strcpy(sym, "transcript_get_iface_");
+    strcat(sym, converter != NULL ? converter->name : ptr->name);
+    if ((prefault.base = lt_dlsym(ptr->handle->library_handle, sym)) != NULL) {
+      dl_iterate_phdr(add_ranges, &prefault);
+    }
+  }
+  RELEASE_LOCK();
+
+  nr_threads = prefault.ranges_used < MAX_PREFAULT_THREADS ? prefault.ranges_used
+                                                           : MAX_PREFAULT_THREADS;
+  prefault.stride = nr_threads;
+  for (i = 0; i < nr_threads; i++) {
+    threads[i].prefault = &prefault;
+    threads[i].first = i;
+  }
+  for (i = 0; i < nr_threads; i++) {
+    if (pthread_create(&threads[i].thread, NULL, prefault_ranges, &threads[i]) != 0) {
+      break;
+    }
+  }
+  started = i;
+  /* If not all threads could be started, handle their ranges in this thread. */
+  for (; i < nr_threads; i++) {
+    prefault_ranges(&threads[i]);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+  free(prefault.ranges);
+}
+#endif
+
+/** Load converters ahead of their first use.
+    @param names A @c NULL terminated list of converter names.
+    @param flags The flags to open the converters with. If ::TRANSCRIPT_PRELOAD_PREFAULT is
+        included, the tables of the converters are also read into memory.
+    @return ::TRANSCRIPT_SUCCESS, or the error for the first converter that could not be loaded.
+
+    The converters, including the converters modules such as ISO-2022 and
+    EUC-TW use internally, are kept loaded until ::transcript_finalize is called.
+    Converters opened later therefore do not have to be loaded from disk, which
+    avoids a latency spike at their first use. A failure for one of the names
+    does not prevent the other converters from being loaded.
+
+    Loading converters requires the library lock, so the converters themselves
+    are loaded one after the other. Reading the tables into memory is done by
+    multiple threads, after the lock is released. Prefaulting is only
+    supported on platforms which provide @c dl_iterate_phdr.
+*/
+transcript_error_t transcript_preload(const char **names, int flags) {
+  transcript_error_t result = TRANSCRIPT_SUCCESS, error;
+  size_t i;
+
+  ACQUIRE_LOCK();
+  if (!_transcript_initialized_count) {
+    RELEASE_LOCK();
+    return TRANSCRIPT_NOT_INITIALIZED;
+  }
+
+  _transcript_set_open_observer(record_loaded_name);
+  for (; *names != NULL; names++) {
+    error = pin_converter(*names, flags & ~TRANSCRIPT_PRELOAD_PREFAULT);
+    if (error != TRANSCRIPT_SUCCESS && result == TRANSCRIPT_SUCCESS) {
+      result = error;
+    }
+
+    /* Also pin the converters that were loaded for internal use by the converter, such that
+       they stay loaded when the converter closes them or loads them only on first use. The
+       first name is the plugin of the converter itself, which is already held by its handle.
+       Pinning may load more plugins, which are appended to the list. */
+    for (i = 1; i < loaded_names_used; i++) {
+      pin_converter(loaded_names[i], TRANSCRIPT_INTERNAL);
+    }
+    for (i = 0; i < loaded_names_used; i++) {
+      free(loaded_names[i]);
+    }
+    loaded_names_used = 0;
+  }
+  _transcript_set_open_observer(NULL);
+  free(loaded_names);
+  loaded_names = NULL;
+  loaded_names_allocated = 0;
+
+#ifdef HAS_DL_ITERATE_PHDR
+  if (flags & TRANSCRIPT_PRELOAD_PREFAULT) {
+    prefault_pinned();
+    return result;
+  }
+#endif
+  RELEASE_LOCK();
+  return result;
+}
+
+/** @internal
+    @brief Close the converters loaded by ::transcript_preload.
+    @return @c TRUE if any converters were closed, @c FALSE otherwise.
+
+    This function should be called with the lock acquired. The lock is released
+    while the converters are closed, because converters such as EUC-TW and
+    GB-18030 close their sub-converters with ::transcript_close_converter, which
+    acquires the lock.
+*/
+bool_t _transcript_free_preloaded(void) {
+  pinned_t *list, *next;
+
+  if ((list = pinned) == NULL) {
+    return FALSE;
+  }
+  pinned = NULL;
+  RELEASE_LOCK();
+
+  for (; list != NULL; list = next) {
+    next = list->next;
+    transcript_close_converter(list->handle);
+    free(list->name);
+    free(list);
+  }
+  ACQUIRE_LOCK();
+  return TRUE;
+}
+
+/** @} */
@@ -33,7 +33,7 @@ for i in test[0-9][0-9] ; do
 		continue
 	fi
 
-	printf "  - executing test %d\n" "${i#test}"
+	printf "  - executing test %d\n" "$((10#${i#test}))"
 	sed -r '/^%%/,$d;s/#.*//' "$i" > input.txt
 	sed -r '1,/^%%/d;s/#.*//;s/[[:space:]]+//g' "$i" > output.txt
 
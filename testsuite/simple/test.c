@@ -4,7 +4,9 @@
 #include <unistd.h>
 #include <strings.h>
 #include <string.h>
+#include <errno.h>
 
+#define TRANSCRIPT_ICONV_API
 #include "transcript.h"
 
 void fatal(const char *fmt, ...) {
@@ -16,21 +18,180 @@ void fatal(const char *fmt, ...) {
 	exit(EXIT_FAILURE);
 }
 
+/* The interface used for the conversion, selected with -a. */
+static enum { API_DEFAULT, API_SHARED, API_SAVE_STATE, API_AT, API_CLONE, API_ACQUIRE, API_ATOM, API_PROBE, API_PRELOAD, API_INFO, API_ICONV, API_SELECT } api = API_DEFAULT;
+static enum { FROM, TO } dir = FROM;
+static int open_flags;
+static int convert_flags;
+static transcript_state_t shared_state;
+static void *converter_memory;
+static transcript_iconv_t iconv_cd;
+static size_t passthrough_length;
+
+/* Read hexadecimal input bytes until the buffer holds size bytes or the input ends. */
+static size_t read_input(char *buf, size_t fill, size_t size) {
+	while (fill < size && fscanf(stdin, " %2hhx ", buf + fill) == 1)
+		fill++;
+	return fill;
+}
+
+static transcript_t *open_converter(const char *name, int utf_type) {
+	transcript_error_t error;
+	transcript_t *conv;
+	transcript_atom_t atom;
+	size_t size;
+
+	if (api == API_ATOM) {
+		if ((atom = transcript_intern(name)) == 0)
+			fatal("Error interning converter name\n");
+		if (transcript_intern(transcript_atom_name(atom)) != atom || !transcript_probe_atom(atom))
+			fatal("Interned converter name does not resolve to the same converter\n");
+		if ((conv = transcript_open_atom(atom, utf_type, open_flags, &error)) == NULL)
+			fatal("Error opening converter: %s\n", transcript_strerror(error));
+		return conv;
+	}
+	if (api == API_AT) {
+		if ((size = transcript_converter_size(name, utf_type, open_flags, &error)) == 0)
+			fatal("Error determining converter size: %s\n", transcript_strerror(error));
+		if ((converter_memory = malloc(size)) == NULL)
+			fatal("Out of memory\n");
+		if ((conv = transcript_open_converter_at(name, utf_type, open_flags, converter_memory, size, &error)) == NULL)
+			fatal("Error opening converter: %s\n", transcript_strerror(error));
+		return conv;
+	}
+	if (api == API_ACQUIRE) {
+		if ((conv = transcript_acquire(name, utf_type, open_flags, &error)) == NULL)
+			fatal("Error acquiring converter: %s\n", transcript_strerror(error));
+		return conv;
+	}
+	if (api == API_SHARED) {
+		if ((conv = transcript_open_shared_converter(name, utf_type, open_flags, &error)) == NULL)
+			fatal("Error opening converter: %s\n", transcript_strerror(error));
+		transcript_init_shared_state(conv, &shared_state);
+		return conv;
+	}
+	if ((conv = transcript_open_converter(name, utf_type, open_flags, &error)) == NULL)
+		fatal("Error opening converter: %s\n", transcript_strerror(error));
+	return conv;
+}
+
+static transcript_error_t convert_iconv(const char **inbuf, const char *inbuflimit, char **outbuf,
+		const char *outbuflimit, int flags)
+{
+	size_t inbytesleft = inbuflimit - *inbuf, outbytesleft = outbuflimit - *outbuf;
+	const char *inbuf_start = *inbuf;
+	char *outbuf_start = *outbuf;
+
+	/* The prefix which needs no conversion must come out of the conversion unchanged. */
+	passthrough_length = transcript_iconv_passthrough(iconv_cd, *inbuf, inbytesleft);
+	if (transcript_iconv(iconv_cd, (char **) inbuf, &inbytesleft, outbuf, &outbytesleft) == (size_t) -1 &&
+			(errno != EINVAL || (flags & TRANSCRIPT_END_OF_TEXT)))
+		return errno == E2BIG ? TRANSCRIPT_NO_SPACE : TRANSCRIPT_ILLEGAL;
+	if (*inbuf + inbytesleft != inbuflimit || *outbuf + outbytesleft != outbuflimit)
+		fatal("Byte counts not updated by transcript_iconv\n");
+	if ((size_t) (*outbuf - outbuf_start) < passthrough_length ||
+			memcmp(outbuf_start, inbuf_start, passthrough_length) != 0)
+		fatal("Passthrough prefix changed by the conversion\n");
+
+	if ((flags & TRANSCRIPT_END_OF_TEXT) && transcript_iconv(iconv_cd, NULL, NULL, outbuf, &outbytesleft) == (size_t) -1)
+		return TRANSCRIPT_NO_SPACE;
+	return TRANSCRIPT_SUCCESS;
+}
+
+/* Convert a buffer. At the end of the text, the closing bytes of stateful converters are written
+   as well. */
+static transcript_error_t convert(transcript_t *conv, const char **inbuf, const char *inbuflimit, char **outbuf,
+		const char *outbuflimit, int flags)
+{
+	transcript_error_t error;
+
+	if (api == API_ICONV)
+		return convert_iconv(inbuf, inbuflimit, outbuf, outbuflimit, flags);
+	if (api == API_SHARED) {
+		if (dir == TO)
+			return transcript_to_unicode_shared(conv, &shared_state, inbuf, inbuflimit, outbuf, outbuflimit, flags);
+		if ((error = transcript_from_unicode_shared(conv, &shared_state, inbuf, inbuflimit, outbuf, outbuflimit,
+				flags)) != TRANSCRIPT_SUCCESS || !(flags & TRANSCRIPT_END_OF_TEXT))
+			return error;
+		return transcript_from_unicode_flush_shared(conv, &shared_state, outbuf, outbuflimit);
+	}
+	if (dir == TO)
+		return transcript_to_unicode(conv, inbuf, inbuflimit, outbuf, outbuflimit, flags);
+	if ((error = transcript_from_unicode(conv, inbuf, inbuflimit, outbuf, outbuflimit, flags)) != TRANSCRIPT_SUCCESS ||
+			!(flags & TRANSCRIPT_END_OF_TEXT))
+		return error;
+	return transcript_from_unicode_flush(conv, outbuf, outbuflimit);
+}
+
+/* Continue the conversion with a different handle, to check that the state carries over. */
+static transcript_t *next_converter(transcript_t *conv, const char *name, int utf_type) {
+	char state[TRANSCRIPT_SAVE_STATE_SIZE];
+	transcript_error_t error;
+	transcript_t *clone;
+
+	if (api == API_CLONE) {
+		if ((clone = transcript_clone_converter(conv, &error)) == NULL)
+			fatal("Error cloning converter: %s\n", transcript_strerror(error));
+		transcript_close_converter(conv);
+		conv = clone;
+	} else if (api == API_SAVE_STATE) {
+		transcript_save_state(conv, state);
+		transcript_close_converter(conv);
+		conv = open_converter(name, utf_type);
+		transcript_load_state(conv, state);
+	}
+	return conv;
+}
+
+/* Leave a cached handle in the middle of a conversion, and check that acquiring it again reuses
+   it in its initial state. A converter is opened in between, which would get the memory of the
+   released handle if that had been closed instead of cached. */
+static transcript_t *reacquire_converter(transcript_t *conv, const char *name, int utf_type,
+		const char *inbuf, size_t fill)
+{
+	char outbuf[1024], *outbuf_ptr = outbuf;
+	const char *inbuf_ptr = inbuf;
+	transcript_error_t error;
+	transcript_t *reused, *other;
+
+	convert(conv, &inbuf_ptr, inbuf + fill, &outbuf_ptr, outbuf + sizeof(outbuf), 0);
+	transcript_release(conv);
+	if ((other = transcript_open_converter(name, utf_type, open_flags, &error)) == NULL)
+		fatal("Error opening converter: %s\n", transcript_strerror(error));
+	if ((reused = open_converter(name, utf_type)) != conv)
+		fatal("Released converter was not reused\n");
+	transcript_close_converter(other);
+	return reused;
+}
+
 int main(int argc, char *argv[]) {
 	transcript_error_t error;
-	void *conv;
+	transcript_t *conv;
 	char inbuf[1024], outbuf[1024], *outbuf_ptr;
 	const char *inbuf_ptr;
 	size_t i;
 	size_t fill = 0;
+	size_t buffer_size = sizeof(inbuf);
 
 	int c;
-	enum { FROM, TO } dir = FROM;
-	transcript_error_t (*convert)(transcript_t *, const char **, const char *, char **, const char *, int) = transcript_from_unicode;
 	int utf_type = TRANSCRIPT_UTF8;
+	const char *utf_name = "UTF-8";
 	int option_dump = 0;
 	int flags = TRANSCRIPT_FILE_START;
 
+	static struct { const char *name; int api; } api_list[] = {
+		{ "shared", API_SHARED },
+		{ "save-state", API_SAVE_STATE },
+		{ "at", API_AT },
+		{ "clone", API_CLONE },
+		{ "acquire", API_ACQUIRE },
+		{ "atom", API_ATOM },
+		{ "probe", API_PROBE },
+		{ "preload", API_PRELOAD },
+		{ "info", API_INFO },
+		{ "iconv", API_ICONV },
+		{ "select", API_SELECT }};
+
 	static struct { const char *name; int type; } utf_list[] = {
 		{ "UTF-8", TRANSCRIPT_UTF8 },
 		{ "UTF-16", TRANSCRIPT_UTF16 },
@@ -42,23 +203,46 @@ int main(int argc, char *argv[]) {
 
 	transcript_init();
 
-	while ((c = getopt(argc, argv, "d:u:D")) != EOF) {
+	while ((c = getopt(argc, argv, "a:b:d:efsu:D")) != EOF) {
 		switch (c) {
+			case 'a':
+				for (i = 0; i < sizeof(api_list) / sizeof(api_list[0]); i++) {
+					if (strcasecmp(optarg, api_list[i].name) == 0) {
+						api = api_list[i].api;
+						break;
+					}
+				}
+				if (i == sizeof(api_list) / sizeof(api_list[0]))
+					fatal("Invalid argument for -a\n");
+				break;
+			case 'b':
+				buffer_size = strtoul(optarg, NULL, 10);
+				if (buffer_size == 0 || buffer_size > sizeof(inbuf))
+					fatal("Invalid argument for -b\n");
+				break;
 			case 'd':
 				if (strcasecmp(optarg, "to") == 0) {
 					dir = TO;
-					convert = transcript_to_unicode;
 				} else if (strcasecmp(optarg, "from") == 0) {
 					dir = FROM;
-					convert = transcript_from_unicode;
 				} else {
 					fatal("Invalid argument for -d\n");
 				}
 				break;
+			case 'e':
+				open_flags |= TRANSCRIPT_EXPANDED_TABLES;
+				break;
+			case 'f':
+				convert_flags |= TRANSCRIPT_ALLOW_FALLBACK;
+				break;
+			case 's':
+				convert_flags |= TRANSCRIPT_SUBST_UNASSIGNED;
+				break;
 			case 'u':
 				for (i = 0; i < sizeof(utf_list) / sizeof(utf_list[0]); i++) {
 					if (strcasecmp(optarg, utf_list[i].name) == 0) {
 						utf_type = utf_list[i].type;
+						utf_name = utf_list[i].name;
 						break;
 					}
 				}
@@ -74,24 +258,97 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (argc - optind != 1)
-		fatal("Usage: test [-d <direction>] [-u <utf type>] [-D] <codepage name>\n");
+		fatal("Usage: test [-a <interface>] [-b <buffer size>] [-d <direction>] [-e] [-f] [-s] [-u <utf type>] [-D] <codepage name>\n");
 
-	if ((conv = transcript_open_converter(argv[optind], utf_type, 0, &error)) == NULL)
-		fatal("Error opening converter: %s\n", transcript_strerror(error));
+	if (api == API_PROBE) {
+		/* The second probe is answered from the cached directory listings. */
+		printf("%02X", transcript_probe_converter(argv[optind]));
+		printf("%02X\n", transcript_probe_converter(argv[optind]));
+		return 0;
+	}
+
+	if (api == API_SELECT) {
+		/* The codepage name is a comma separated list of candidates, the input is UTF-8 text. */
+		const char *candidates[16];
+		char *name;
+		int selected;
+
+		for (i = 0, name = strtok(argv[optind], ","); name != NULL && i < 15; name = strtok(NULL, ","))
+			candidates[i++] = name;
+		candidates[i] = NULL;
+		fill = read_input(inbuf, 0, sizeof(inbuf));
+		if ((selected = transcript_select_charset(inbuf, fill, candidates, &error)) < 0 &&
+				error != TRANSCRIPT_UNASSIGNED)
+			fatal("Error selecting character set: %s\n", transcript_strerror(error));
+		printf("%02X\n", (uint8_t) selected);
+		return 0;
+	}
+
+	if (api == API_PRELOAD) {
+		const char *names[2];
+
+		names[0] = argv[optind];
+		names[1] = NULL;
+		if ((error = transcript_preload(names, 0)) != TRANSCRIPT_SUCCESS)
+			fatal("Error preloading converter: %s\n", transcript_strerror(error));
+	}
+
+	if (api == API_ICONV) {
+		conv = NULL;
+		if ((iconv_cd = dir == TO ? transcript_iconv_open(utf_name, argv[optind]) :
+				transcript_iconv_open(argv[optind], utf_name)) == (transcript_iconv_t) -1)
+			fatal("Error opening converter: %s\n", strerror(errno));
+	} else {
+		conv = open_converter(argv[optind], utf_type);
+	}
+
+	if (api == API_INFO) {
+		transcript_info_t info;
+
+		transcript_get_info(conv, &info);
+		printf("%02X%02X%02X%02X\n", info.flags, info.max_char_bytes, info.max_from_unicode_bytes,
+			info.max_to_unicode_codepoints);
+		transcript_close_converter(conv);
+		return 0;
+	}
 
 	do {
-		while (fill < 1024 && fscanf(stdin, " %2hhx ", inbuf + fill) == 1)
-			fill++;
+		fill = read_input(inbuf, fill, buffer_size);
+		if (api == API_ACQUIRE && (flags & TRANSCRIPT_FILE_START))
+			conv = reacquire_converter(conv, argv[optind], utf_type, inbuf, fill);
 		inbuf_ptr = inbuf;
 		outbuf_ptr = outbuf;
-		if ((error = convert(conv, &inbuf_ptr, inbuf + fill, &outbuf_ptr, outbuf + 1024, feof(stdin) ? TRANSCRIPT_END_OF_TEXT : 0)) != TRANSCRIPT_SUCCESS)
+		error = convert(conv, &inbuf_ptr, inbuf + fill, &outbuf_ptr, outbuf + sizeof(outbuf),
+				convert_flags | (feof(stdin) ? TRANSCRIPT_END_OF_TEXT : 0));
+		/* Before the end of the text, an incomplete character is completed by the next read. */
+		if (error == TRANSCRIPT_INCOMPLETE && !feof(stdin) && inbuf_ptr != inbuf)
+			error = TRANSCRIPT_SUCCESS;
+		if (error != TRANSCRIPT_SUCCESS)
 			fatal("conversion result: %s\n", transcript_strerror(error));
+		if (api == API_ICONV)
+			printf("%02X ", (unsigned int) passthrough_length);
 		for (i = 0; i < (size_t) (outbuf_ptr - outbuf); i++)
 			printf("%02X", (uint8_t) outbuf[i]);
 		putchar('\n');
 		fill -= (inbuf_ptr - inbuf);
 		memmove(inbuf, inbuf_ptr, fill);
 		flags &= ~TRANSCRIPT_FILE_START;
+		if (!feof(stdin))
+			conv = next_converter(conv, argv[optind], utf_type);
 	} while (!feof(stdin));
+
+	if (api == API_AT) {
+		transcript_close_converter(conv);
+		free(converter_memory);
+	} else if (api == API_ACQUIRE) {
+		transcript_release(conv);
+		transcript_flush_cache();
+	} else if (api == API_ICONV) {
+		transcript_iconv_close(iconv_cd);
+	} else if (api == API_PRELOAD) {
+		/* Finalizing closes the preloaded converter, including its sub-converters. */
+		transcript_close_converter(conv);
+		transcript_finalize();
+	}
 	return 0;
 }
@@ -6,6 +6,7 @@ for OPT ; do
 	case "$OPT" in
 		-r) REGENERATE=1 ;;
 		-n) NO_BUILD=1 ;;
+		-b) BATCH=1 ;;
 	esac
 done
 
@@ -20,7 +21,7 @@ cd "$(dirname "$0")" || die "Could not cd to script dir"
 make --no-print-directory -q -C ../src.util/ucm2ltc || make --no-print-directory -C ../src.util/ucm2ltc
 [[ -d ../src/tables ]] || mkdir ../src/tables
 
-# The script below uses the following sed script:
+# The list_tables function below uses the following sed script:
 # '/\\$/{$ s/\\$//;$! H};/\\$/!{H;g;s/[[:space:]]+\\\n[[:space:]]+/ /g;s/^\n//;p;z;h}'
 # Unwrap lines with a trailing backslash. This works as follows:
 # If the line ends in a backslash, there are two cases:
@@ -37,15 +38,12 @@ make --no-print-directory -q -C ../src.util/ucm2ltc || make --no-print-directory
 # - copy pattern space to hold space
 # The last two commands are necessary because there is no command to clear the
 # hold space.
-{
-	echo "SHELL := /bin/bash"
+# Print a line of the form '<output>: <ucm2ltc arguments>' for each table.
+list_tables() {
 	unset HANDLED
 	while read TARGET FILES ; do
 		out="`echo \"${TARGET%:}\" | sed -r 's/\.ucm$//;s/[^a-zA-Z0-9]//g;s/(^|[^0-9])0+/\1/' | tr [:upper:] [:lower:]`"
-		echo "../src/tables/${out}.c: `echo \"$FILES\" | sed -r 's/(^| )(-[^ \t]+ )+/ /g'`"
-		echo "	@echo \"Generating ../src/tables/${out}.c\""
-		echo "	@../src.util/ucm2ltc/ucm2ltc -o \"../src/tables/${out}.c\" $FILES"
-		ALLTARGETS="${ALLTARGETS} ../src/tables/${out}.c"
+		echo "../src/tables/${out}.c: $FILES"
 		for f in $FILES ; do
 			if [ "x${f#-}" != "x$f" ] ; then
 				continue
@@ -58,15 +56,30 @@ make --no-print-directory -q -C ../src.util/ucm2ltc || make --no-print-directory
 	for f in `{ echo "$HANDLED$HANDLED" ; find -name '*.ucm' -printf '%P\n' ; } | sort | uniq -u` ; do
 		out="`echo \"${f##*/}\" | sed -r 's/\.ucm$//;s/[^a-zA-Z0-9]//g;s/(^|[^0-9])0+/\1/' | tr [:upper:] [:lower:]`"
 		echo "../src/tables/${out}.c: $f"
-		echo "	@echo \"Generating ../src/tables/${out}.c\""
-		echo "	@../src.util/ucm2ltc/ucm2ltc -o \"../src/tables/${out}.c\" $f"
-		ALLTARGETS="${ALLTARGETS} ../src/tables/${out}.c"
 	done
-	cat <<EOF
+}
+
+if [[ -n $BATCH ]] ; then
+	# Generate all tables with a single ucm2ltc process. Only changed tables are rewritten.
+	list_tables | ../src.util/ucm2ltc/ucm2ltc -j"$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)" -B- || exit 1
+	REMOVE="$(export LANG=C ; comm -2 -3 <( ls ../src/tables/*.c ) <( list_tables | sed -r 's/:.*//' | sort ))"
+	[[ -n $REMOVE ]] && { echo "Removing $REMOVE" ; rm $REMOVE ; }
+else
+	{
+		echo "SHELL := /bin/bash"
+		while read OUTPUT FILES ; do
+			OUTPUT="${OUTPUT%:}"
+			echo "${OUTPUT}: `echo \"$FILES\" | sed -r 's/(^| )(-[^ \t]+ )+/ /g'`"
+			echo "	@echo \"Generating ${OUTPUT}\""
+			echo "	@../src.util/ucm2ltc/ucm2ltc -o \"${OUTPUT}\" $FILES"
+			ALLTARGETS="${ALLTARGETS} ${OUTPUT}"
+		done < <(list_tables)
+		cat <<EOF
 all:${ALLTARGETS}
 
 remove-stale:
 	@export LANG=C;REMOVE=\$\$(comm -2 -3 <( ls ../src/tables/*.c ) <( echo "${ALLTARGETS}" | tr ' ' '\n' | sort )) ; [[ -n \$\$REMOVE ]] && { echo "Removing \$\$REMOVE" ; rm \$\$REMOVE ; } || true
 EOF
-} | make -f - ${REGENERATE:+-B} all remove-stale || exit 1
+	} | make -f - ${REGENERATE:+-B} all remove-stale || exit 1
+fi
 [[ -z $NO_BUILD ]] && make -C ../src --no-print-directory